@@ -0,0 +1,354 @@
+/*
+ * Microbenchmarks of the smp_mad_stress hot path.
+ *
+ * smpdump.c is included directly, so every stage of send_mads and
+ * process_mads can be measured on its own, on the same engine code that
+ * is built into the tool (but with -O2). Mads go through an in-memory
+ * loopback transport which answers instantly, so only our own CPU cost
+ * is measured.
+ *
+ * Every stage reports ns per mad and, when perf_event_open is permitted,
+ * user space instructions per mad.
+ */
+
+#define main smp_mad_stress_main
+#include "smpdump.c"
+#undef main
+
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define MEM_RING 4096
+
+/*
+ * In-memory loopback transport
+ */
+static uint8_t mem_ring[MEM_RING][IB_MAD_SIZE];
+static unsigned mem_head, mem_tail;
+static int mem_discard; // drop sent mads, for stages which only send
+
+static int mem_init(void)
+{
+	return 0;
+}
+
+static int mem_open_port(const char *ca, int port)
+{
+	mem_head = mem_tail = 0;
+	return 0;
+}
+
+static int mem_close_port(int portid)
+{
+	return 0;
+}
+
+static int mem_register(int portid, int mgmt_class, int mgmt_version, uint8_t rmpp_version, long *method_mask)
+{
+	return 0;
+}
+
+static int mem_unregister(int portid, int agentid)
+{
+	return 0;
+}
+
+static int mem_send(int portid, int agentid, void *umad, int length, int timeout_ms, int retries)
+{
+	if (mem_discard)
+		return 0;
+	if (mem_tail - mem_head == MEM_RING)
+		return -ENOBUFS;
+	memcpy(mem_ring[mem_tail++ % MEM_RING], umad_get_mad(umad), IB_MAD_SIZE);
+	return 0;
+}
+
+static int mem_poll(int portid, int timeout_ms)
+{
+	return mem_head != mem_tail ? 0 : -ETIMEDOUT;
+}
+
+static int mem_recv(int portid, void *umad, int *length, int timeout_ms)
+{
+	uint8_t *mad = umad_get_mad(umad);
+
+	if (mem_head == mem_tail)
+		return -EAGAIN;
+	memcpy(mad, mem_ring[mem_head++ % MEM_RING], IB_MAD_SIZE);
+	mad[3] |= 0x80;
+	((struct ib_user_mad *)umad)->status = 0;
+	*length = IB_MAD_SIZE;
+	return 0;
+}
+
+static const struct mad_transport mem_transport = {
+	.name = "mem",
+	.init = mem_init,
+	.open_port = mem_open_port,
+	.close_port = mem_close_port,
+	.register_agent = mem_register,
+	.unregister_agent = mem_unregister,
+	.send = mem_send,
+	.recv = mem_recv,
+	.poll = mem_poll,
+};
+
+/*
+ * Measurement
+ */
+static int perf_fd = -1;
+static int bench_source_depth = 128;
+static int bench_target_depth = 8;
+static int bench_targets = 16;
+static uint64_t bench_iters = 1000000;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void perf_open(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	perf_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	if (perf_fd < 0)
+		fprintf(stderr, "perf_event_open: %m, instructions are not counted (see /proc/sys/kernel/perf_event_paranoid)\n");
+}
+
+static void perf_start(void)
+{
+	if (perf_fd < 0)
+		return;
+	ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+	ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static uint64_t perf_stop(void)
+{
+	uint64_t n = 0;
+
+	if (perf_fd < 0)
+		return 0;
+	ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+	if (read(perf_fd, &n, sizeof(n)) != sizeof(n))
+		return 0;
+	return n;
+}
+
+static void report(const char *stage, uint64_t ns, uint64_t instr, uint64_t n)
+{
+	if (!n)
+		n = 1;
+	if (perf_fd >= 0)
+		printf("%-48s %10.1f %12.1f\n", stage, (double)ns / n, (double)instr / n);
+	else
+		printf("%-48s %10.1f %12s\n", stage, (double)ns / n, "n/a");
+}
+
+#define BENCH(stage, n, body) do {					\
+	uint64_t _t, _i, _n = (n);					\
+	perf_start();							\
+	_t = now_ns();							\
+	for (_i = 0; _i < _n; ++_i) {					\
+		body;							\
+	}								\
+	_t = now_ns() - _t;						\
+	report(stage, _t, perf_stop(), _n);				\
+} while (0)
+
+static void bench_worker(struct mad_worker *w)
+{
+	uint32_t lids[MAX_LIDS];
+	int i;
+
+	for (i = 0; i < bench_targets; ++i)
+		lids[i] = i + 1;
+
+	init_mad_worker(w);
+	w->source_queue_depth = bench_source_depth;
+	w->target_queue_depth = bench_target_depth;
+	w->smp_attr = 0x15;
+	w->smp_mod = 1;
+	w->sw_timeout_ms = 1000;
+
+	g_transport = &mem_transport;
+	mem_discard = 0;
+	init_ib_device(w, NULL, 0);
+	set_lid_routet_targets(w, lids, bench_targets);
+}
+
+/* fill every slot, nothing is answered */
+static void fill_slots(struct mad_worker *w)
+{
+	mem_discard = 1;
+	send_mads(w);
+	mem_discard = 0;
+}
+
+static void bench_stages(void)
+{
+	struct mad_worker w;
+	struct timeval now;
+	struct drsmp *smp;
+	uint8_t resp[IB_MAD_SIZE];
+	int i, slot, status = 0, length;
+	char prefix[64];
+	FILE *f;
+
+	bench_worker(&w);
+	BENCH("template setup (smp_get_init)", bench_iters,
+	      smp_get_init(w.umad, 1, w.smp_attr, w.smp_mod, mngt_method_get, NULL));
+
+	BENCH("in-memory transport send + recv", bench_iters,
+	      w.tr->send(w.portid, w.mad_agent, w.umad, IB_MAD_SIZE, 0, 0);
+	      length = IB_MAD_SIZE;
+	      w.tr->recv(w.portid, w.umad, &length, -1));
+	finalize_mad_worker(&w);
+
+	bench_worker(&w);
+	fill_slots(&w);
+	mem_discard = 1;
+	BENCH("release + send_mads, slot search, one free slot", bench_iters,
+	      release_mad(&w, _i % w.source_queue_depth);
+	      send_mads(&w));
+	mem_discard = 0;
+	finalize_mad_worker(&w);
+
+	/* worst case of the credit scan: one free slot, every target is full */
+	bench_worker(&w);
+	fill_slots(&w);
+	release_mad(&w, 0);
+	for (i = 0; i < w.n_targets; ++i)
+		w.on_wire[i] = w.target_queue_depth;
+	BENCH("send_mads, full credit scan, per call", bench_iters / w.n_targets + 1,
+	      send_mads(&w));
+	for (i = 0; i < w.n_targets; ++i)
+		w.on_wire[i] = 0;
+	finalize_mad_worker(&w);
+
+	bench_worker(&w);
+	fill_slots(&w);
+	smp = (struct drsmp *)resp;
+	memcpy(resp, umad_get_mad(w.umad), IB_MAD_SIZE);
+	BENCH("recv_mad, tid match, all slots on wire", bench_iters,
+	      slot = (_i * 7919) % w.source_queue_depth;
+	      smp->tid = w.mads_on_wire[slot].tid;
+	      memcpy(mem_ring[mem_tail++ % MEM_RING], resp, IB_MAD_SIZE);
+	      if (recv_mad(&w, &status, &now) != slot)
+		      IBPANIC("tid match failed"));
+	finalize_mad_worker(&w);
+
+	bench_worker(&w);
+	fill_slots(&w);
+	gettimeofday(&now, NULL);
+	BENCH("deadline heap remove + push, all slots on wire", bench_iters,
+	      slot = (_i * 7919) % w.source_queue_depth;
+	      deadline_heap_remove(&w, slot);
+	      w.mads_on_wire[slot].deadline_us = timeval_to_us(&now) + _i;
+	      deadline_heap_push(&w, slot));
+
+	BENCH("account_mad (stats update)", bench_iters,
+	      account_mad(&w, (_i * 7919) % w.n_targets, w.mgmt_class, 0, 0, 100 + (_i & 63)));
+
+	memset(resp, 0xa5, sizeof(resp));
+	init_verify_mask(&w);
+	BENCH("verify_data (64 byte masked compare)", bench_iters,
+	      status += verify_data(&w, resp + (_i & 1), w.targets[0].data));
+
+	snprintf(prefix, sizeof(prefix), "/tmp/mad_bench.%d", getpid());
+	if (!mad_trace_open(&w.trace, prefix, 0, 1 << 16)) {
+		BENCH("trace_mad (trace record append)", bench_iters,
+		      trace_mad(&w, mad_trace_complete, &w.mads_on_wire[_i % w.source_queue_depth], &now, 100, 0, 0));
+		mad_trace_close(&w.trace, 0);
+		snprintf(prefix, sizeof(prefix), "/tmp/mad_bench.%d.0.trace", getpid());
+		unlink(prefix);
+	}
+
+	w.start = now;
+	w.end = now;
+	w.end.tv_sec++;
+	f = fopen("/dev/null", "w");
+	if (f) {
+		BENCH("print_statistics, per call", bench_iters / 1000 + 1,
+		      print_statistics(&w, 1, f));
+		fclose(f);
+	}
+	finalize_mad_worker(&w);
+}
+
+static void bench_loop(void)
+{
+	struct mad_worker w;
+	uint64_t t, instr, n = 0;
+	int i;
+
+	bench_worker(&w);
+	w.timeout_ms = 1000;
+
+	perf_start();
+	t = now_ns();
+	process_mads(&w);
+	t = now_ns() - t;
+	instr = perf_stop();
+
+	for (i = 0; i < w.n_targets; ++i)
+		n += w.stats[i].ok_mads;
+
+	report("full loop (process_mads), per completed mad", t, instr, n);
+	printf("%-48s %10.0f\n", "full loop mad/s", n / (t / 1e9));
+	finalize_mad_worker(&w);
+}
+
+int main(int argc, char *argv[])
+{
+	int ch;
+
+	while ((ch = getopt(argc, argv, "N:n:l:i:")) != -1) {
+		switch (ch) {
+		case 'N':
+			bench_source_depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			bench_target_depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			bench_targets = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			bench_iters = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-N source queue depth] [-n target queue depth] [-l targets] [-i iterations]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	if (bench_source_depth < 1 || bench_source_depth > MAX_SOURCE_QUEUE_DEPTH ||
+	    bench_targets < 1 || bench_targets > MAX_LIDS || bench_source_depth > MEM_RING)
+		IBPANIC("bad parameters");
+
+	perf_open();
+
+	printf("source queue depth: %d , target queue depth: %d , targets: %d , iterations: %" PRIu64 "\n\n",
+	       bench_source_depth, bench_target_depth, bench_targets, bench_iters);
+	printf("%-48s %10s %12s\n", "stage", "ns/mad", "instr/mad");
+
+	bench_stages();
+	bench_loop();
+	return 0;
+}
@@ -0,0 +1,124 @@
+/*
+ * Log-linear latency histogram.
+ *
+ * Values below 64 have their own bucket, above that every power of 2 range
+ * is split into 32 buckets, so a bucket is never wider than ~3% of its
+ * value. 896 buckets cover the whole uint32_t range (us).
+ */
+
+#ifndef _MAD_HIST_H_
+#define _MAD_HIST_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define LAT_HIST_BUCKETS 896
+
+struct lat_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint32_t min;
+	uint32_t max;
+	uint64_t n[LAT_HIST_BUCKETS];
+};
+
+static inline int lat_hist_bucket(uint32_t v)
+{
+	int e;
+
+	if (v < 64)
+		return v;
+	e = 31 - __builtin_clz(v);
+	return 64 + (e - 6) * 32 + (int)((v >> (e - 5)) - 32);
+}
+
+/* lowest value which falls into bucket b */
+static inline uint32_t lat_hist_bucket_low(int b)
+{
+	int e;
+
+	if (b < 64)
+		return b;
+	e = (b - 64) / 32 + 6;
+	return (uint32_t)(32 + (b - 64) % 32) << (e - 5);
+}
+
+static inline void lat_hist_init(struct lat_hist *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+static inline void lat_hist_add(struct lat_hist *h, uint32_t v)
+{
+	if (!h->count || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->count++;
+	h->sum += v;
+	h->n[lat_hist_bucket(v)]++;
+}
+
+static inline void lat_hist_merge(struct lat_hist *dst, const struct lat_hist *src)
+{
+	int i;
+
+	if (!src->count)
+		return;
+	if (!dst->count || src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+	dst->count += src->count;
+	dst->sum += src->sum;
+	for (i = 0; i < LAT_HIST_BUCKETS; ++i)
+		dst->n[i] += src->n[i];
+}
+
+/* p in [0, 100], returns lower bound of the bucket, clamped to [min, max] */
+static inline uint32_t lat_hist_percentile(const struct lat_hist *h, double p)
+{
+	uint64_t rank, seen = 0;
+	uint32_t v;
+	int i;
+
+	if (!h->count)
+		return 0;
+
+	rank = (uint64_t)(p / 100.0 * h->count);
+	if (rank >= h->count)
+		rank = h->count - 1;
+
+	for (i = 0; i < LAT_HIST_BUCKETS; ++i) {
+		seen += h->n[i];
+		if (seen > rank)
+			break;
+	}
+
+	v = lat_hist_bucket_low(i < LAT_HIST_BUCKETS ? i : LAT_HIST_BUCKETS - 1);
+	if (v < h->min)
+		v = h->min;
+	if (v > h->max)
+		v = h->max;
+	return v;
+}
+
+static inline uint32_t lat_hist_avg(const struct lat_hist *h)
+{
+	return h->count ? h->sum / h->count : 0;
+}
+
+/*
+ * Coarse power of 2 buckets, for per target distributions: bucket b holds
+ * values up to 2^b - 1, the last one everything above.
+ */
+#define LAT_LOG2_BUCKETS 24
+
+static inline int lat_log2_bucket(uint32_t v)
+{
+	int b = v ? 32 - __builtin_clz(v) : 0;
+
+	return b < LAT_LOG2_BUCKETS ? b : LAT_LOG2_BUCKETS - 1;
+}
+
+#endif /* _MAD_HIST_H_ */
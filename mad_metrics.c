@@ -0,0 +1,207 @@
+/*
+ * Minimal HTTP server for mad_metrics.h: GET /metrics, one request per
+ * connection, served sequentially by one thread.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "mad_metrics.h"
+
+#define METRICS_POLL_MS 200 // how fast the server notices stop
+#define METRICS_IO_TIMEOUT_S 2
+#define METRICS_MAX_REQUEST 4096
+
+static struct {
+	int fd;
+	char unix_path[108];
+	metrics_render_fn render;
+	void *ctx;
+	volatile int stop;
+	pthread_t thread;
+} srv = { .fd = -1 };
+
+static int listen_tcp(const char *addr)
+{
+	struct sockaddr_in sin;
+	const char *port = strrchr(addr, ':');
+	char host[64] = "127.0.0.1";
+	int fd, one = 1;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+
+	if (port) {
+		if (port - addr >= sizeof(host))
+			return -EINVAL;
+		memcpy(host, addr, port - addr);
+		host[port - addr] = 0;
+		port++;
+	} else {
+		port = addr;
+	}
+	if (inet_pton(AF_INET, host, &sin.sin_addr) != 1 || !atoi(port))
+		return -EINVAL;
+	sin.sin_port = htons(atoi(port));
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) || listen(fd, 8)) {
+		int rc = -errno;
+		close(fd);
+		return rc;
+	}
+	return fd;
+}
+
+static int listen_unix(const char *path)
+{
+	struct sockaddr_un sun;
+	struct stat st;
+	int fd;
+
+	if (strlen(path) >= sizeof(sun.sun_path))
+		return -ENAMETOOLONG;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	/* stale socket of a previous run */
+	if (!stat(path, &st) && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) || listen(fd, 8)) {
+		int rc = -errno;
+		close(fd);
+		return rc;
+	}
+	strcpy(srv.unix_path, path);
+	return fd;
+}
+
+static void write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		buf += n;
+		len -= n;
+	}
+}
+
+static void serve(int fd)
+{
+	struct timeval tv = { .tv_sec = METRICS_IO_TIMEOUT_S };
+	char req[METRICS_MAX_REQUEST + 1], hdr[256];
+	size_t len = 0, body_len = 0;
+	char *body = NULL;
+	ssize_t n;
+	FILE *f;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	/* the request line is all we need, headers are read and ignored */
+	while (len < METRICS_MAX_REQUEST) {
+		n = read(fd, req + len, METRICS_MAX_REQUEST - len);
+		if (n <= 0)
+			return;
+		len += n;
+		req[len] = 0;
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+			break;
+	}
+
+	if (strncmp(req, "GET /metrics ", 13) && strncmp(req, "GET / ", 6)) {
+		n = snprintf(hdr, sizeof(hdr), "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+		write_all(fd, hdr, n);
+		return;
+	}
+
+	f = open_memstream(&body, &body_len);
+	if (!f)
+		return;
+	srv.render(f, srv.ctx);
+	fclose(f);
+
+	n = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+		     "Content-Type: text/plain; version=0.0.4\r\n"
+		     "Content-Length: %zu\r\nConnection: close\r\n\r\n", body_len);
+	write_all(fd, hdr, n);
+	write_all(fd, body, body_len);
+	free(body);
+}
+
+static void *metrics_thread(void *arg)
+{
+	struct pollfd pfd = { .fd = srv.fd, .events = POLLIN };
+	int fd;
+
+	while (!srv.stop) {
+		if (poll(&pfd, 1, METRICS_POLL_MS) <= 0)
+			continue;
+		fd = accept4(srv.fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0)
+			continue;
+		serve(fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+int metrics_server_start(const char *addr, metrics_render_fn render, void *ctx)
+{
+	int rc;
+
+	srv.fd = strchr(addr, '/') ? listen_unix(addr) : listen_tcp(addr);
+	if (srv.fd < 0)
+		return srv.fd;
+
+	srv.render = render;
+	srv.ctx = ctx;
+	srv.stop = 0;
+
+	rc = pthread_create(&srv.thread, NULL, metrics_thread, NULL);
+	if (rc) {
+		close(srv.fd);
+		srv.fd = -1;
+		return -rc;
+	}
+	return 0;
+}
+
+void metrics_server_stop(void)
+{
+	if (srv.fd < 0)
+		return;
+
+	srv.stop = 1;
+	pthread_join(srv.thread, NULL);
+	close(srv.fd);
+	srv.fd = -1;
+	if (srv.unix_path[0])
+		unlink(srv.unix_path);
+}
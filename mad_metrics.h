@@ -0,0 +1,25 @@
+/*
+ * Live metrics of smp_mad_stress in Prometheus text format.
+ *
+ * A single server thread accepts scrapes on a loopback TCP port or a unix
+ * socket and calls render to produce the body. render must only read data
+ * the workers publish for it (see struct mad_snapshot in smpdump.c), it
+ * never touches the mad loop.
+ */
+
+#ifndef _MAD_METRICS_H_
+#define _MAD_METRICS_H_
+
+#include <stdio.h>
+
+typedef void (*metrics_render_fn)(FILE *f, void *ctx);
+
+/*
+ * addr: [<ipv4 address>:]<port>, default address 127.0.0.1, or a unix
+ * socket path (anything with a '/').
+ * Returns 0 or negative errno.
+ */
+int metrics_server_start(const char *addr, metrics_render_fn render, void *ctx);
+void metrics_server_stop(void);
+
+#endif /* _MAD_METRICS_H_ */
@@ -0,0 +1,123 @@
+/*
+ * Classification of mad completions.
+ *
+ * A completion has a umad (transport) status - 0 when a responce arrived,
+ * errno otherwise - and, when a responce arrived, the status field of its
+ * MAD header (IBA 13.4.7):
+ *   bit 0      busy, the request was discarded
+ *   bit 1      redirect required
+ *   bits 2-4   invalid field code
+ *   bits 8-14  class specific
+ *   bit 15     direction (D) bit of directed route SMPs, not a status
+ *
+ * SA (IBA 15.2.1.1) uses bits 8-15 as a code, not as bits. Its codes 1-7
+ * are counted in the class bit counters, code n in the one of bit 7 + n.
+ *
+ * The outcome is exclusive, one per completion, used to split counters and
+ * latency. Status counters count every set bit / invalid field code.
+ */
+
+#ifndef _MAD_STATUS_H_
+#define _MAD_STATUS_H_
+
+#include <stdint.h>
+#include <errno.h>
+
+#define MAD_STATUS_BUSY 0x0001
+#define MAD_STATUS_REDIRECT 0x0002
+#define MAD_STATUS_INVALID_MASK 0x001c
+#define MAD_STATUS_INVALID_SHIFT 2
+#define MAD_STATUS_CLASS_MASK 0x7f00
+#define MAD_STATUS_CLASS_SHIFT 8
+#define MAD_STATUS_MASK 0x7fff // without DR D bit
+#define MAD_STATUS_SA_CLASS 0x03
+
+enum mad_outcome {
+	mad_outcome_ok,
+	mad_outcome_busy,
+	mad_outcome_redirect,
+	mad_outcome_invalid,	// any invalid field code
+	mad_outcome_class,	// class specific status only
+	mad_outcome_timeout,	// umad ETIMEDOUT
+	mad_outcome_error,	// any other umad status
+	MAD_OUTCOMES
+};
+
+enum mad_status_counter {
+	mad_st_busy,
+	mad_st_redirect,
+	mad_st_bad_version,	// invalid field code 1
+	mad_st_unsup_method,	// 2
+	mad_st_unsup_attr,	// 3, method/attribute combination
+	mad_st_invalid_reserved,// 4-6
+	mad_st_invalid_value,	// 7, attribute or modifier value
+	mad_st_class_bit,	// + class specific bit 0..6 (status bits 8..14)
+	MAD_STATUS_COUNTERS = mad_st_class_bit + 7
+};
+
+static const char * const mad_outcome_names[MAD_OUTCOMES] = {
+	"ok", "busy", "redirect", "invalid", "class", "timeout", "error",
+};
+
+static const char * const mad_status_names[MAD_STATUS_COUNTERS] = {
+	"busy", "redirect", "bad_version", "unsup_method", "unsup_attr", "invalid_reserved", "invalid_value",
+	"class_bit8", "class_bit9", "class_bit10", "class_bit11", "class_bit12", "class_bit13", "class_bit14",
+};
+
+static const char * const mad_sa_status_names[7] = {
+	"sa_no_resources", "sa_req_invalid", "sa_no_records", "sa_too_many_records",
+	"sa_invalid_gid", "sa_insuf_comps", "sa_denied",
+};
+
+static inline const char *mad_status_name(int mgmt_class, int i)
+{
+	if (mgmt_class == MAD_STATUS_SA_CLASS && i >= mad_st_class_bit)
+		return mad_sa_status_names[i - mad_st_class_bit];
+	return mad_status_names[i];
+}
+
+static inline enum mad_outcome mad_outcome(int umad_status, uint16_t mad_status)
+{
+	if (umad_status)
+		return umad_status == ETIMEDOUT ? mad_outcome_timeout : mad_outcome_error;
+
+	mad_status &= MAD_STATUS_MASK;
+	if (!mad_status)
+		return mad_outcome_ok;
+	if (mad_status & MAD_STATUS_INVALID_MASK)
+		return mad_outcome_invalid;
+	if (mad_status & MAD_STATUS_BUSY)
+		return mad_outcome_busy;
+	if (mad_status & MAD_STATUS_REDIRECT)
+		return mad_outcome_redirect;
+	return mad_outcome_class;
+}
+
+/* add every status of a non zero MAD status to n[MAD_STATUS_COUNTERS] */
+static inline void mad_status_count(uint64_t *n, int mgmt_class, uint16_t mad_status)
+{
+	static const uint8_t invalid[8] = {
+		0, mad_st_bad_version, mad_st_unsup_method, mad_st_unsup_attr,
+		mad_st_invalid_reserved, mad_st_invalid_reserved, mad_st_invalid_reserved, mad_st_invalid_value,
+	};
+	int code = (mad_status & MAD_STATUS_INVALID_MASK) >> MAD_STATUS_INVALID_SHIFT;
+	int i;
+
+	if (mad_status & MAD_STATUS_BUSY)
+		n[mad_st_busy]++;
+	if (mad_status & MAD_STATUS_REDIRECT)
+		n[mad_st_redirect]++;
+	if (code)
+		n[invalid[code]]++;
+	if (mgmt_class == MAD_STATUS_SA_CLASS) {
+		code = mad_status >> MAD_STATUS_CLASS_SHIFT;
+		if (code >= 1 && code <= 7)
+			n[mad_st_class_bit + code - 1]++;
+		return;
+	}
+	for (i = 0; i < 7; ++i)
+		if (mad_status & (1 << (MAD_STATUS_CLASS_SHIFT + i)))
+			n[mad_st_class_bit + i]++;
+}
+
+#endif /* _MAD_STATUS_H_ */
@@ -0,0 +1,145 @@
+/*
+ * Binary event trace writer, see mad_trace.h for the file layout.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "mad_trace.h"
+
+static uint64_t round_up_pow2(uint64_t n)
+{
+	uint64_t r = 1;
+
+	while (r < n)
+		r <<= 1;
+	return r;
+}
+
+static inline uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* cost of the clock itself, subtracted from every sample */
+static uint64_t clock_overhead_ns(void)
+{
+	uint64_t t0, t1, best = ~0ULL;
+	int i;
+
+	for (i = 0; i < 32; ++i) {
+		t0 = monotonic_ns();
+		t1 = monotonic_ns();
+		if (t1 - t0 < best)
+			best = t1 - t0;
+	}
+	return best;
+}
+
+int mad_trace_open(struct mad_trace *t, const char *prefix, int worker, uint64_t n_records)
+{
+	char name[4096];
+	void *p;
+
+	memset(t, 0, sizeof(*t));
+	t->fd = -1;
+
+	n_records = round_up_pow2(n_records ? n_records : MAD_TRACE_DEFAULT_RECORDS);
+	t->map_size = MAD_TRACE_HDR_SIZE + n_records * sizeof(struct mad_trace_rec);
+
+	snprintf(name, sizeof(name), "%s.%d.trace", prefix, worker);
+	t->fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (t->fd < 0)
+		return -errno;
+
+	if (ftruncate(t->fd, t->map_size)) {
+		close(t->fd);
+		return -errno;
+	}
+
+	/* populate now, so first touch page faults are not paid by the mad loop */
+	p = mmap(NULL, t->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, t->fd, 0);
+	if (p == MAP_FAILED) {
+		close(t->fd);
+		return -errno;
+	}
+
+	t->hdr = (struct mad_trace_hdr *)p;
+	t->recs = (struct mad_trace_rec *)((char *)p + MAD_TRACE_HDR_SIZE);
+	t->mask = n_records - 1;
+
+	memcpy(t->hdr->magic, MAD_TRACE_MAGIC, sizeof(t->hdr->magic));
+	t->hdr->version = MAD_TRACE_VERSION;
+	t->hdr->rec_size = sizeof(struct mad_trace_rec);
+	t->hdr->worker = worker;
+	t->hdr->capacity = n_records;
+	t->hdr->head = 0;
+
+	t->clock_ns = clock_overhead_ns();
+	return 0;
+}
+
+void mad_trace_append_sampled(struct mad_trace *t, const struct mad_trace_rec *r)
+{
+	uint64_t start;
+
+	/* first append also warms up the clock, don't count it */
+	if (!t->head) {
+		t->hdr->start_us = r->ts_us;
+		t->recs[0] = *r;
+		t->hdr->head = ++t->head;
+		return;
+	}
+
+	start = monotonic_ns();
+	t->recs[t->head & t->mask] = *r;
+	t->hdr->head = ++t->head;
+	start = monotonic_ns() - start;
+
+	t->sampled_ns += start > t->clock_ns ? start - t->clock_ns : 0;
+	t->sampled++;
+}
+
+/* estimated total time spent in mad_trace_append */
+uint64_t mad_trace_overhead_ns(const struct mad_trace *t)
+{
+	if (!t->sampled)
+		return 0;
+	return t->sampled_ns * t->head / t->sampled;
+}
+
+void mad_trace_close(struct mad_trace *t, uint64_t end_us)
+{
+	uint64_t n, keep;
+
+	if (!t->hdr)
+		return;
+
+	t->hdr->end_us = end_us;
+
+	/* don't leave unused tail of the ring on disk */
+	n = t->head < t->hdr->capacity ? t->head : t->hdr->capacity;
+	keep = round_up_pow2(n ? n : 1);
+	if (keep < t->hdr->capacity)
+		t->hdr->capacity = keep;
+
+	munmap(t->hdr, t->map_size);
+	if (keep < t->mask + 1 &&
+	    ftruncate(t->fd, MAD_TRACE_HDR_SIZE + keep * sizeof(struct mad_trace_rec)))
+		fprintf(stderr, "can't truncate trace file: %m\n");
+	close(t->fd);
+
+	t->hdr = NULL;
+	t->recs = NULL;
+	t->fd = -1;
+}
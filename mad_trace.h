@@ -0,0 +1,85 @@
+/*
+ * Binary event trace of mads sent and completed by smp_mad_stress.
+ *
+ * Every worker owns one trace file: a page sized header followed by a ring
+ * of fixed size records. The file is mmap'd, so appending a record is a
+ * plain memory store - no locks and no syscalls on the hot path. When the
+ * ring is full the oldest records are overwritten, header.head keeps the
+ * total number of records ever written.
+ */
+
+#ifndef _MAD_TRACE_H_
+#define _MAD_TRACE_H_
+
+#include <stdint.h>
+
+#define MAD_TRACE_MAGIC "SMPTRACE"
+#define MAD_TRACE_VERSION 1
+#define MAD_TRACE_HDR_SIZE 4096
+#define MAD_TRACE_DEFAULT_RECORDS (1 << 20)
+#define MAD_TRACE_SAMPLE_MASK 0xff // measure cost of every 256th append
+
+enum mad_trace_event {
+	mad_trace_send = 1,
+	mad_trace_complete = 2,
+	mad_trace_lost = 3, // slot reclaimed by software deadline
+	mad_trace_retry = 4, // attempt timed out, the tool sends the mad again
+};
+
+struct mad_trace_rec {
+	uint64_t ts_us;		// event time, us since epoch
+	uint32_t tid;		// low 32 bit of transaction id, host order
+	uint32_t latency_us;	// completion and lost events only
+	uint32_t attr_mod;
+	uint16_t lid;
+	uint16_t attr;
+	uint16_t queue;		// mads on wire of the worker after the event
+	uint16_t mad_status;	// MAD header status, host order
+	uint8_t event;		// enum mad_trace_event
+	uint8_t status;		// umad status (errno)
+	uint8_t mgmt_class;
+	uint8_t method;
+} __attribute__((packed));
+
+struct mad_trace_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t rec_size;
+	uint32_t worker;
+	uint32_t pad;
+	uint64_t capacity;	// records in the ring, power of 2
+	uint64_t head;		// records written so far
+	uint64_t start_us;
+	uint64_t end_us;
+};
+
+struct mad_trace {
+	struct mad_trace_hdr *hdr;
+	struct mad_trace_rec *recs;
+	uint64_t head;
+	uint64_t mask;
+	size_t map_size;
+	int fd;
+	/* self measured overhead, sampled */
+	uint64_t sampled;
+	uint64_t sampled_ns;
+	uint64_t clock_ns;
+};
+
+int mad_trace_open(struct mad_trace *t, const char *prefix, int worker, uint64_t n_records);
+void mad_trace_close(struct mad_trace *t, uint64_t end_us);
+uint64_t mad_trace_overhead_ns(const struct mad_trace *t);
+void mad_trace_append_sampled(struct mad_trace *t, const struct mad_trace_rec *r);
+
+static inline void mad_trace_append(struct mad_trace *t, const struct mad_trace_rec *r)
+{
+	if (!(t->head & MAD_TRACE_SAMPLE_MASK)) {
+		mad_trace_append_sampled(t, r);
+		return;
+	}
+
+	t->recs[t->head & t->mask] = *r;
+	t->hdr->head = ++t->head;
+}
+
+#endif /* _MAD_TRACE_H_ */
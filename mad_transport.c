@@ -0,0 +1,19 @@
+/*
+ * Kernel umad transport, see mad_transport.h.
+ */
+
+#include <infiniband/umad.h>
+
+#include "mad_transport.h"
+
+const struct mad_transport umad_transport = {
+	.name = "umad",
+	.init = umad_init,
+	.open_port = umad_open_port,
+	.close_port = umad_close_port,
+	.register_agent = umad_register,
+	.unregister_agent = umad_unregister,
+	.send = umad_send,
+	.recv = umad_recv,
+	.poll = umad_poll,
+};
@@ -0,0 +1,58 @@
+/*
+ * Transport used by smp_mad_stress workers to send and receive mads.
+ *
+ * The calls follow libibumad semantic: mads live in umad buffers allocated
+ * by umad_alloc, status of a received mad is read with umad_status.
+ * umad_transport passes everything to the kernel, sim_transport answers
+ * in-process with a simulated SMA, so the engine can be run and measured
+ * without a fabric.
+ */
+
+#ifndef _MAD_TRANSPORT_H_
+#define _MAD_TRANSPORT_H_
+
+#include <stdint.h>
+
+struct mad_transport {
+	const char *name;
+	int (*init)(void);
+	int (*open_port)(const char *ca, int port);
+	int (*close_port)(int portid);
+	int (*register_agent)(int portid, int mgmt_class, int mgmt_version, uint8_t rmpp_version, long *method_mask);
+	int (*unregister_agent)(int portid, int agentid);
+	int (*send)(int portid, int agentid, void *umad, int length, int timeout_ms, int retries);
+	int (*recv)(int portid, void *umad, int *length, int timeout_ms);
+	int (*poll)(int portid, int timeout_ms);
+};
+
+extern const struct mad_transport umad_transport;
+extern const struct mad_transport sim_transport;
+
+/*
+ * Simulated SMA configuration, comma separated key=value list:
+ *   service=fix:<us>|uni:<min us>:<max us>|exp:<mean us>|logn:<median us>:<sigma>
+ *   wire=<us>          one way wire and HCA latency
+ *   capacity=<n>       mads served concurrently by one target
+ *   queue=<n>          mads queued on one target, above that it answers BUSY
+ *   drop=<p>           probability a mad or its responce is dropped, kernel retries it
+ *   lost=<p>           probability a mad is never completed, not even with a timeout
+ *   late=<p>           probability the answer to a timed out last attempt is still delivered
+ *   dup=<p>            probability a responce is delivered twice
+ *   dead=<lid>[:<lid>] targets which never answer
+ *   unsup=<attr>[:<attr>] attributes answered with MAD status "unsupported method/attribute"
+ *   foreign=<lid>[:<lid>] devices of another vendor (NodeInfo vendor and device ID),
+ *                      vendor specific attributes are unsupported there
+ *   payload=<file>     canned attribute data, lines of "<attr> <128 hex digits>"
+ *   nodes=<n>          records of a SA NodeRecord table, default 64
+ *   seed=<n>
+ * PerfMgt PortCounters(Extended) Gets are answered with counters which grow
+ * with time since init, at a rate of their own per target and port.
+ * SA Gets are served by the target they are sent to (the SM), records of
+ * dead lids are answered with "no records". GetTable responces are
+ * delivered whole, as the kernel RMPP agent does, every segment after the
+ * first delays them; recv fails with -ENOSPC, leaving the responce queued,
+ * when *length is too small for it.
+ */
+int sim_transport_config(const char *spec);
+
+#endif /* _MAD_TRANSPORT_H_ */
@@ -0,0 +1,913 @@
+/*
+ * In-process simulated SMA transport, see mad_transport.h.
+ *
+ * Every target is a queue with 'capacity' servers and a limited number of
+ * waiting slots. A sent mad is scheduled right away: its arrival, service
+ * start, service end and the time its responce is delivered are computed
+ * from the configured distributions, and the responce is put into a
+ * per-port heap ordered by delivery time. poll and recv sleep until the
+ * next responce is due. Kernel retries are modelled: an attempt which is
+ * dropped or answered after timeout_ms is retransmitted and occupies the
+ * target again. The answer of the last attempt can still be delivered
+ * after the timeout (late), a responce can be delivered twice (dup).
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include <infiniband/umad.h>
+
+#include "iba_types.h"
+#include "mad_transport.h"
+
+#define SIM_MAX_PORTS 256
+#define SIM_MAX_AGENTS 32
+#define SIM_MAX_DEAD 256
+#define SIM_MAX_UNSUP 64
+#define SIM_MAX_CAPACITY 1024
+#define SIM_TARGETS_HASH (1 << 17)
+#define SIM_SPIN_NS 50000 // sleeping shorter than this is too inaccurate, spin
+#define SIM_MAD_SIZE 256
+#define SIM_SWITCH_PORTS 40
+#define SIM_RMPP_SEGMENT_NS 1000 // every RMPP segment after the first delays the responce
+#define SIM_SA_SEGMENT_DATA 200
+
+#define SIM_MAD_STATUS_BUSY 0x0001
+#define SIM_MAD_STATUS_UNSUP_ATTR 0x000c
+#define SIM_MAD_STATUS_DR_D_BIT 0x8000
+#define SIM_SMI_DIRECT_CLASS 0x81
+#define SIM_PERF_ATTR_PORT_COUNTERS_EXT 0x001D
+#define SIM_SA_STATUS_NO_RECORDS 0x0300
+
+enum sim_dist {
+	sim_dist_fix,
+	sim_dist_uni,
+	sim_dist_exp,
+	sim_dist_logn,
+};
+
+struct sim_payload {
+	uint16_t attr;
+	uint8_t data[64];
+};
+
+struct sim_config {
+	int dist;
+	double a, b;	// distribution parameters, us
+	uint64_t wire_ns;
+	int capacity;
+	int queue;
+	double drop;
+	double lost;
+	double late;
+	double dup;
+	uint64_t seed;
+	int nodes;	// records of a NodeRecord table
+	uint32_t dead[SIM_MAX_DEAD];
+	int n_dead;
+	uint16_t unsup[SIM_MAX_UNSUP];
+	int n_unsup;
+	uint32_t foreign[SIM_MAX_DEAD];	// devices of another vendor
+	int n_foreign;
+	struct sim_payload *payloads;
+	int n_payloads;
+};
+
+struct sim_attr {
+	uint16_t attr;
+	uint32_t mod;
+	uint8_t data[64];
+};
+
+struct sim_target {
+	uint32_t key;
+	pthread_spinlock_t lock;
+	int dead;
+	uint64_t *server_free;	// time every server becomes free
+	uint64_t *done;		// min-heap, end of service of accepted mads
+	int n_done;
+	struct sim_attr *attrs;	// attribute values, changed by Set
+	int n_attrs;
+};
+
+struct sim_resp {
+	uint64_t due_ns;
+	int status;
+	int agent;
+	int length;	// above SIM_MAD_SIZE for RMPP responces
+	uint8_t mad[SIM_MAD_SIZE];
+};
+
+struct sim_port {
+	int used;
+	uint64_t rng;
+	int n_agents;
+	struct sim_resp *resp;	// min-heap by due_ns
+	int n_resp;
+	int max_resp;
+};
+
+static struct sim_config sim = {
+	.dist = sim_dist_fix,
+	.a = 20,
+	.wire_ns = 1000,
+	.capacity = 1,
+	.queue = 64,
+	.seed = 1,
+	.nodes = 64,
+};
+
+static struct sim_port sim_ports[SIM_MAX_PORTS];
+static struct sim_target *sim_targets[SIM_TARGETS_HASH];
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t sim_start_ns; // port counters grow from here
+
+static inline uint64_t sim_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift64*, uniform in (0, 1] */
+static inline double sim_rand(struct sim_port *p)
+{
+	p->rng ^= p->rng >> 12;
+	p->rng ^= p->rng << 25;
+	p->rng ^= p->rng >> 27;
+	return (((p->rng * 0x2545F4914F6CDD1DULL) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t sim_service_ns(struct sim_port *p)
+{
+	double us, u;
+
+	switch (sim.dist) {
+	case sim_dist_uni:
+		us = sim.a + (sim.b - sim.a) * sim_rand(p);
+		break;
+	case sim_dist_exp:
+		us = -sim.a * log(sim_rand(p));
+		break;
+	case sim_dist_logn:
+		/* Box-Muller */
+		u = sqrt(-2 * log(sim_rand(p))) * cos(2 * M_PI * sim_rand(p));
+		us = sim.a * exp(sim.b * u);
+		break;
+	default:
+		us = sim.a;
+	}
+	return us * 1000;
+}
+
+static uint32_t sim_hash(uint32_t k)
+{
+	k ^= k >> 16;
+	k *= 0x7feb352d;
+	k ^= k >> 15;
+	return k;
+}
+
+static struct sim_target *sim_target_new(uint32_t key)
+{
+	struct sim_target *t = calloc(1, sizeof(*t));
+	int i;
+
+	if (!t)
+		return NULL;
+
+	t->key = key;
+	t->server_free = calloc(sim.capacity, sizeof(t->server_free[0]));
+	t->done = calloc(sim.queue + sim.capacity, sizeof(t->done[0]));
+	if (!t->server_free || !t->done)
+		return NULL;
+	pthread_spin_init(&t->lock, PTHREAD_PROCESS_PRIVATE);
+
+	for (i = 0; i < sim.n_dead; ++i)
+		if (sim.dead[i] == key)
+			t->dead = 1;
+	return t;
+}
+
+/* lock free lookup, targets are only created under sim_lock */
+static struct sim_target *sim_target_get(uint32_t key)
+{
+	uint32_t i = sim_hash(key) & (SIM_TARGETS_HASH - 1);
+	struct sim_target *t;
+
+	while ((t = __atomic_load_n(&sim_targets[i], __ATOMIC_ACQUIRE))) {
+		if (t->key == key)
+			return t;
+		i = (i + 1) & (SIM_TARGETS_HASH - 1);
+	}
+
+	pthread_mutex_lock(&sim_lock);
+	while ((t = sim_targets[i])) {
+		if (t->key == key)
+			break;
+		i = (i + 1) & (SIM_TARGETS_HASH - 1);
+	}
+	if (!t) {
+		t = sim_target_new(key);
+		__atomic_store_n(&sim_targets[i], t, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&sim_lock);
+	return t;
+}
+
+static int sim_is_foreign(uint32_t key)
+{
+	int i;
+
+	for (i = 0; i < sim.n_foreign; ++i)
+		if (sim.foreign[i] == key)
+			return 1;
+	return 0;
+}
+
+static void sim_default_payload(uint32_t key, uint16_t attr, uint32_t mod, uint8_t *data)
+{
+	uint64_t guid = 0x0002c90300000000ULL | key;
+	uint32_t h = sim_hash(key ^ ((uint32_t)attr << 16) ^ sim_hash(mod));
+	int i;
+
+	for (i = 0; i < 64; ++i) {
+		h = sim_hash(h + i);
+		data[i] = h;
+	}
+
+	switch (attr) {
+	case 0x0011: // NodeInfo of a 40 port switch
+		memset(data, 0, 64);
+		data[0] = 1;
+		data[1] = 1;
+		data[2] = 2;
+		data[3] = 40;
+		for (i = 0; i < 8; ++i)
+			data[4 + i] = data[12 + i] = data[20 + i] = guid >> (56 - 8 * i);
+		data[29] = 8;
+		data[30] = 0xd2;
+		data[31] = 0xf0;
+		data[35] = 0xa0;
+		data[38] = 0x02;
+		data[39] = 0xc9;
+		if (sim_is_foreign(key)) {
+			data[30] = 0x73;
+			data[31] = 0x22;
+			data[37] = 0x00;
+			data[38] = 0x11;
+			data[39] = 0x75;
+		}
+		break;
+	case 0x0015: // PortInfo, LID and port number
+		data[16] = key >> 8;
+		data[17] = key;
+		data[28] = mod;
+		break;
+	case 0xFF90: // MLNX ExtendedPortInfo, FDR10 supported, active on odd lids
+		memset(data, 0, 64);
+		data[3] = 1;
+		data[7] = 1;
+		data[11] = 1;
+		data[15] = key & 1;
+		break;
+	}
+}
+
+static struct sim_attr *sim_target_attr(struct sim_target *t, uint16_t attr, uint32_t mod)
+{
+	struct sim_attr *a;
+	int i;
+
+	for (i = 0; i < t->n_attrs; ++i)
+		if (t->attrs[i].attr == attr && t->attrs[i].mod == mod)
+			return &t->attrs[i];
+
+	a = realloc(t->attrs, (t->n_attrs + 1) * sizeof(t->attrs[0]));
+	if (!a)
+		return NULL;
+	t->attrs = a;
+	a = &t->attrs[t->n_attrs++];
+	a->attr = attr;
+	a->mod = mod;
+
+	for (i = 0; i < sim.n_payloads; ++i)
+		if (sim.payloads[i].attr == attr)
+			break;
+	if (i < sim.n_payloads)
+		memcpy(a->data, sim.payloads[i].data, 64);
+	else
+		sim_default_payload(t->key, attr, mod, a->data);
+	return a;
+}
+
+static inline uint64_t sim_sat(uint64_t v, uint64_t max)
+{
+	return v < max ? v : max;
+}
+
+/*
+ * PortCounters(Extended) of a port: traffic grows at a rate of its own,
+ * port 1 also collects symbol errors. 32 bit and shorter counters saturate.
+ */
+static void sim_pm_answer(struct sim_target *t, uint8_t *mad)
+{
+	uint16_t attr = ntohs(*(uint16_t *)(mad + 16));
+	int port = mad[64 + 1];
+	uint64_t us = (sim_now_ns() - sim_start_ns) / 1000;
+	uint64_t words = us * (100 + (t->key * 7 + port * 13) % 200);
+	uint64_t symbol_errors = port == 1 ? us / 50000 : 0;
+	ib_port_counters_ext_t *e = (ib_port_counters_ext_t *)(mad + 64);
+	ib_port_counters_t *c = (ib_port_counters_t *)(mad + 64);
+
+	memset(mad + 64, 0, IB_PM_DATA_SIZE);
+	c->port_select = port;
+
+	if (attr == SIM_PERF_ATTR_PORT_COUNTERS_EXT) {
+		e->xmit_data = htobe64(words);
+		e->rcv_data = htobe64(words / 2);
+		e->xmit_pkts = htobe64(words / 64);
+		e->rcv_pkts = htobe64(words / 128);
+		e->xmit_wait = htobe64(us / 10);
+		e->symbol_err_cnt = htobe64(symbol_errors);
+	} else {
+		c->xmit_data = htobe32(sim_sat(words, UINT32_MAX));
+		c->rcv_data = htobe32(sim_sat(words / 2, UINT32_MAX));
+		c->xmit_pkts = htobe32(sim_sat(words / 64, UINT32_MAX));
+		c->rcv_pkts = htobe32(sim_sat(words / 128, UINT32_MAX));
+		c->xmit_wait = htobe32(sim_sat(us / 10, UINT32_MAX));
+		c->symbol_err_cnt = htobe16(sim_sat(symbol_errors, UINT16_MAX));
+	}
+}
+
+/* one record of lid (and port), returns its size */
+static int sim_sa_record(uint16_t attr, uint16_t lid, int port, uint8_t *rec)
+{
+	ib_node_record_t *nr = (ib_node_record_t *)rec;
+	ib_portinfo_record_t *pir = (ib_portinfo_record_t *)rec;
+	ib_path_rec_t *pr = (ib_path_rec_t *)rec;
+	uint8_t data[64];
+
+	switch (attr) {
+	case 0x0011:
+		memset(nr, 0, sizeof(*nr));
+		nr->lid = htons(lid);
+		sim_default_payload(lid, 0x0011, 0, data);
+		memcpy(&nr->node_info, data, sizeof(nr->node_info));
+		sim_default_payload(lid, 0x0010, 0, nr->node_desc.description);
+		return sizeof(*nr);
+	case 0x0012:
+		memset(pir, 0, sizeof(*pir));
+		pir->lid = htons(lid);
+		pir->port_num = port;
+		sim_default_payload(lid, 0x0015, port, data);
+		memcpy(&pir->port_info, data, sizeof(pir->port_info));
+		return sizeof(*pir);
+	case 0x0035:
+		/* the request is the record, slid and dlid are kept */
+		pr->num_path = 1;
+		pr->pkey = htons(0xffff);
+		pr->mtu = 0x80 | 5; // exactly 4096
+		pr->rate = 0x80 | 16; // exactly 100 Gb/s
+		pr->pkt_life = 0x80 | 18;
+		return sizeof(*pr);
+	}
+	return 0;
+}
+
+/* records of a GetTable: every node, every port of a 40 port switch, one path */
+static int sim_sa_table_records(uint16_t attr)
+{
+	return attr == 0x0011 ? sim.nodes : attr == 0x0012 ? SIM_SWITCH_PORTS + 1 : 1;
+}
+
+/*
+ * SubnAdmGet(Table) of a NodeRecord, PortInfoRecord or PathRecord: the SM
+ * knows every lid but the dead ones, records are built from the default
+ * payloads. Returns the responce length, GetTable records beyond the
+ * first mad are built by sim_sa_fill_table on delivery.
+ */
+static int sim_sa_answer(uint8_t *mad)
+{
+	ib_sa_mad_t *sa = (ib_sa_mad_t *)mad;
+	uint16_t attr = ntohs(sa->attr_id);
+	uint16_t lid = attr == 0x0035 ? ntohs(((ib_path_rec_t *)sa->data)->dlid) : ntohs(*(uint16_t *)sa->data);
+	int i, len, table = mad[3] == 0x92;
+
+	for (i = 0; i < sim.n_dead; ++i)
+		if (sim.dead[i] == lid && !(table && attr == 0x0011)) {
+			sa->status = htons(SIM_SA_STATUS_NO_RECORDS);
+			return SIM_MAD_SIZE;
+		}
+
+	len = sim_sa_record(attr, lid, ((ib_portinfo_record_t *)sa->data)->port_num, sa->data);
+	if (!len) {
+		sa->status = htons(SIM_MAD_STATUS_UNSUP_ATTR);
+		return SIM_MAD_SIZE;
+	}
+	sa->attr_offset = htons(len / 8);
+	if (!table)
+		return SIM_MAD_SIZE;
+	return offsetof(ib_sa_mad_t, data) + len * sim_sa_table_records(attr);
+}
+
+static void sim_sa_fill_table(uint8_t *mad, int length)
+{
+	ib_sa_mad_t *sa = (ib_sa_mad_t *)mad;
+	uint16_t attr = ntohs(sa->attr_id);
+	uint16_t lid = ntohs(*(uint16_t *)sa->data);
+	int i, len = ntohs(sa->attr_offset) * 8;
+	uint8_t *rec = sa->data;
+
+	for (i = 0; rec + len <= mad + length; ++i, rec += len) {
+		if (attr == 0x0011)
+			sim_sa_record(attr, i + 1, 0, rec);
+		else if (attr == 0x0012)
+			sim_sa_record(attr, lid, i, rec);
+	}
+}
+
+/* build the responce in place of the request, returns its length */
+static int sim_answer(struct sim_target *t, uint8_t *mad)
+{
+	uint16_t attr = ntohs(*(uint16_t *)(mad + 16));
+	uint32_t mod = ntohl(*(uint32_t *)(mad + 20));
+	int set = mad[3] == 2;
+	struct sim_attr *a;
+	int i;
+
+	mad[3] = mad[3] == IB_MAD_METHOD_GETTABLE ? 0x92 : 0x81; // GetTableResp, GetResp
+	for (i = 0; i < sim.n_unsup; ++i)
+		if (sim.unsup[i] == attr) {
+			*(uint16_t *)(mad + 4) = htons(SIM_MAD_STATUS_UNSUP_ATTR);
+			return SIM_MAD_SIZE;
+		}
+	if (attr >= 0xFF00 && sim_is_foreign(t->key)) {
+		*(uint16_t *)(mad + 4) = htons(SIM_MAD_STATUS_UNSUP_ATTR);
+		return SIM_MAD_SIZE;
+	}
+
+	if (mad[1] == IB_MCLASS_PERF) {
+		sim_pm_answer(t, mad);
+		return SIM_MAD_SIZE;
+	}
+	if (mad[1] == IB_MCLASS_SUBN_ADM)
+		return sim_sa_answer(mad);
+
+	a = sim_target_attr(t, attr, mod);
+	if (a) {
+		if (set)
+			memcpy(a->data, mad + 64, 64);
+		memcpy(mad + 64, a->data, 64);
+	}
+	return SIM_MAD_SIZE;
+}
+
+static void sim_done_pop(struct sim_target *t)
+{
+	uint64_t x;
+	int i = 0, l, m;
+
+	x = t->done[--t->n_done];
+	while ((l = 2 * i + 1) < t->n_done) {
+		m = l;
+		if (l + 1 < t->n_done && t->done[l + 1] < t->done[l])
+			m = l + 1;
+		if (x <= t->done[m])
+			break;
+		t->done[i] = t->done[m];
+		i = m;
+	}
+	t->done[i] = x;
+}
+
+static void sim_done_push(struct sim_target *t, uint64_t x)
+{
+	int i = t->n_done++;
+
+	while (i && t->done[(i - 1) / 2] > x) {
+		t->done[i] = t->done[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	t->done[i] = x;
+}
+
+/*
+ * Serve one attempt arriving at the target at 'arrival'.
+ * Returns end of service, 0 if the target is overloaded.
+ */
+static uint64_t sim_serve(struct sim_port *p, struct sim_target *t, uint8_t *mad, uint64_t arrival, int *length)
+{
+	uint64_t start, end;
+	int i, s = 0;
+
+	pthread_spin_lock(&t->lock);
+
+	while (t->n_done && t->done[0] <= arrival)
+		sim_done_pop(t);
+
+	if (t->n_done >= sim.queue + sim.capacity) {
+		pthread_spin_unlock(&t->lock);
+		return 0;
+	}
+
+	for (i = 1; i < sim.capacity; ++i)
+		if (t->server_free[i] < t->server_free[s])
+			s = i;
+
+	start = t->server_free[s] > arrival ? t->server_free[s] : arrival;
+	end = start + sim_service_ns(p);
+	t->server_free[s] = end;
+	sim_done_push(t, end);
+	*length = sim_answer(t, mad);
+
+	pthread_spin_unlock(&t->lock);
+	return end;
+}
+
+static void sim_resp_push(struct sim_port *p, const struct sim_resp *r)
+{
+	struct sim_resp *q;
+	int i;
+
+	if (p->n_resp == p->max_resp) {
+		p->max_resp = p->max_resp ? p->max_resp * 2 : 1024;
+		q = realloc(p->resp, p->max_resp * sizeof(p->resp[0]));
+		if (!q) {
+			fprintf(stderr, "sim: out of memory\n");
+			exit(1);
+		}
+		p->resp = q;
+	}
+
+	i = p->n_resp++;
+	while (i && p->resp[(i - 1) / 2].due_ns > r->due_ns) {
+		p->resp[i] = p->resp[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	p->resp[i] = *r;
+}
+
+static void sim_resp_pop(struct sim_port *p, struct sim_resp *r)
+{
+	struct sim_resp *x;
+	int i = 0, l, m;
+
+	*r = p->resp[0];
+	x = &p->resp[--p->n_resp];
+	while ((l = 2 * i + 1) < p->n_resp) {
+		m = l;
+		if (l + 1 < p->n_resp && p->resp[l + 1].due_ns < p->resp[l].due_ns)
+			m = l + 1;
+		if (x->due_ns <= p->resp[m].due_ns)
+			break;
+		p->resp[i] = p->resp[m];
+		i = m;
+	}
+	if (p->n_resp)
+		p->resp[i] = *x;
+}
+
+static void sim_sleep_until(uint64_t t)
+{
+	struct timespec ts;
+	uint64_t now = sim_now_ns();
+
+	if (t > now + SIM_SPIN_NS) {
+		t -= SIM_SPIN_NS;
+		ts.tv_sec = t / 1000000000;
+		ts.tv_nsec = t % 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+		t += SIM_SPIN_NS;
+	}
+
+	while (sim_now_ns() < t)
+		;
+}
+
+static int sim_init(void)
+{
+	sim_start_ns = sim_now_ns();
+	return 0;
+}
+
+static int sim_open_port(const char *ca, int port)
+{
+	int i;
+
+	pthread_mutex_lock(&sim_lock);
+	for (i = 0; i < SIM_MAX_PORTS; ++i)
+		if (!sim_ports[i].used)
+			break;
+	if (i < SIM_MAX_PORTS) {
+		memset(&sim_ports[i], 0, sizeof(sim_ports[i]));
+		sim_ports[i].used = 1;
+		sim_ports[i].rng = sim_hash(sim.seed + i) | (sim.seed << 32) | 1;
+	}
+	pthread_mutex_unlock(&sim_lock);
+
+	return i < SIM_MAX_PORTS ? i : -EMFILE;
+}
+
+static int sim_close_port(int portid)
+{
+	pthread_mutex_lock(&sim_lock);
+	free(sim_ports[portid].resp);
+	memset(&sim_ports[portid], 0, sizeof(sim_ports[portid]));
+	pthread_mutex_unlock(&sim_lock);
+	return 0;
+}
+
+static int sim_register(int portid, int mgmt_class, int mgmt_version, uint8_t rmpp_version, long *method_mask)
+{
+	struct sim_port *p = &sim_ports[portid];
+
+	if (p->n_agents == SIM_MAX_AGENTS)
+		return -EINVAL;
+	return p->n_agents++;
+}
+
+static int sim_unregister(int portid, int agentid)
+{
+	return 0;
+}
+
+static uint32_t sim_target_key(struct ib_user_mad *um, const uint8_t *mad)
+{
+	uint32_t h = 2166136261u;
+	int i;
+
+	if (mad[1] != SIM_SMI_DIRECT_CLASS)
+		return ntohs(um->addr.lid);
+
+	/* DR: hop count and initial path */
+	for (i = 0; i <= mad[7] && i < 64; ++i)
+		h = (h ^ mad[128 + i]) * 16777619;
+	return 0x10000 | (h & 0xffff);
+}
+
+static int sim_send(int portid, int agentid, void *umad, int length, int timeout_ms, int retries)
+{
+	struct sim_port *p = &sim_ports[portid];
+	struct ib_user_mad *um = umad;
+	uint8_t *mad = umad_get_mad(umad);
+	uint64_t now = sim_now_ns(), timeout_ns = timeout_ms * 1000000ULL;
+	uint64_t sent, end;
+	struct sim_target *t;
+	struct sim_resp r;
+	int k;
+
+	t = sim_target_get(sim_target_key(um, mad));
+	if (!t)
+		return -ENOMEM;
+
+	if (sim.lost > 0 && sim_rand(p) < sim.lost)
+		return 0;
+
+	r.agent = agentid;
+	r.length = SIM_MAD_SIZE;
+	r.status = ETIMEDOUT;
+	r.due_ns = now + timeout_ns * (retries + 1);
+
+	for (k = 0; k <= retries && !t->dead; ++k) {
+		sent = now + k * timeout_ns;
+		if (sim.drop > 0 && sim_rand(p) < sim.drop)
+			continue;
+
+		memcpy(r.mad, mad, SIM_MAD_SIZE);
+		end = sim_serve(p, t, r.mad, sent + sim.wire_ns, &r.length);
+		if (!end) {
+			/* overloaded, answer BUSY right away */
+			r.mad[3] = 0x81;
+			*(uint16_t *)(r.mad + 4) = htons(SIM_MAD_STATUS_BUSY);
+			end = sent + sim.wire_ns;
+		}
+
+		if (sim.drop > 0 && sim_rand(p) < sim.drop)
+			continue;
+		if (timeout_ns && end + sim.wire_ns - sent > timeout_ns) {
+			if (k == retries && sim.late > 0 && sim_rand(p) < sim.late) {
+				struct sim_resp l = r;
+
+				if (l.mad[1] == SIM_SMI_DIRECT_CLASS)
+					*(uint16_t *)(l.mad + 4) |= htons(SIM_MAD_STATUS_DR_D_BIT);
+				l.status = 0;
+				l.due_ns = end + sim.wire_ns;
+				sim_resp_push(p, &l);
+			}
+			continue;
+		}
+
+		if (r.mad[1] == SIM_SMI_DIRECT_CLASS)
+			*(uint16_t *)(r.mad + 4) |= htons(SIM_MAD_STATUS_DR_D_BIT);
+		r.status = 0;
+		r.due_ns = end + sim.wire_ns;
+		if (r.length > SIM_MAD_SIZE)
+			r.due_ns += SIM_RMPP_SEGMENT_NS * ((r.length - SIM_MAD_SIZE + SIM_SA_SEGMENT_DATA - 1) / SIM_SA_SEGMENT_DATA);
+		break;
+	}
+
+	if (r.status) {
+		memcpy(r.mad, mad, SIM_MAD_SIZE);
+		r.length = SIM_MAD_SIZE;
+	}
+
+	sim_resp_push(p, &r);
+	if (!r.status && sim.dup > 0 && sim_rand(p) < sim.dup) {
+		r.due_ns += sim.wire_ns;
+		sim_resp_push(p, &r);
+	}
+	return 0;
+}
+
+static int sim_poll(int portid, int timeout_ms)
+{
+	struct sim_port *p = &sim_ports[portid];
+	uint64_t now = sim_now_ns();
+	uint64_t deadline = timeout_ms < 0 ? ~0ULL : now + timeout_ms * 1000000ULL;
+
+	while (1) {
+		if (p->n_resp && p->resp[0].due_ns <= now)
+			return 0;
+		if (deadline <= now)
+			return -ETIMEDOUT;
+		sim_sleep_until(p->n_resp && p->resp[0].due_ns < deadline ? p->resp[0].due_ns :
+				deadline == ~0ULL ? now + 1000000000ULL : deadline);
+		now = sim_now_ns();
+	}
+}
+
+static int sim_recv(int portid, void *umad, int *length, int timeout_ms)
+{
+	struct sim_port *p = &sim_ports[portid];
+	struct ib_user_mad *um = umad;
+	struct sim_resp r;
+	int rc;
+
+	rc = sim_poll(portid, timeout_ms);
+	if (rc)
+		return rc;
+
+	/* like the kernel, a responce which doesn't fit stays queued */
+	if (p->resp[0].length > *length) {
+		*length = p->resp[0].length;
+		return -ENOSPC;
+	}
+
+	sim_resp_pop(p, &r);
+	memcpy(umad_get_mad(umad), r.mad, SIM_MAD_SIZE);
+	if (r.length > SIM_MAD_SIZE)
+		sim_sa_fill_table(umad_get_mad(umad), r.length);
+	um->status = r.status;
+	um->agent_id = r.agent;
+	um->length = *length = r.length;
+	return r.agent;
+}
+
+static int parse_hex(const char *s, uint8_t *data, int n)
+{
+	int i;
+	unsigned v;
+
+	for (i = 0; i < n; ++i, s += 2)
+		if (sscanf(s, "%2x", &v) != 1)
+			return -1;
+		else
+			data[i] = v;
+	return 0;
+}
+
+static int sim_load_payloads(const char *file)
+{
+	char line[512], hex[256];
+	struct sim_payload *p;
+	unsigned attr;
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (!f)
+		return -errno;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || sscanf(line, "%i %255s", (int *)&attr, hex) != 2)
+			continue;
+		p = realloc(sim.payloads, (sim.n_payloads + 1) * sizeof(*p));
+		if (!p)
+			break;
+		sim.payloads = p;
+		p = &sim.payloads[sim.n_payloads];
+		p->attr = attr;
+		memset(p->data, 0, sizeof(p->data));
+		if (strlen(hex) != 128 || parse_hex(hex, p->data, 64)) {
+			fprintf(stderr, "sim: bad payload for attr 0x%x in %s\n", attr, file);
+			fclose(f);
+			return -EINVAL;
+		}
+		sim.n_payloads++;
+	}
+
+	fclose(f);
+	return 0;
+}
+
+static int sim_parse_dist(const char *v)
+{
+	if (sscanf(v, "fix:%lf", &sim.a) == 1)
+		sim.dist = sim_dist_fix;
+	else if (sscanf(v, "uni:%lf:%lf", &sim.a, &sim.b) == 2)
+		sim.dist = sim_dist_uni;
+	else if (sscanf(v, "exp:%lf", &sim.a) == 1)
+		sim.dist = sim_dist_exp;
+	else if (sscanf(v, "logn:%lf:%lf", &sim.a, &sim.b) == 2)
+		sim.dist = sim_dist_logn;
+	else
+		return -EINVAL;
+	return 0;
+}
+
+int sim_transport_config(const char *spec)
+{
+	char *str, *tok, *save, *save_list, *v, *d;
+	int rc = 0;
+
+	str = strdup(spec);
+	if (!str)
+		return -ENOMEM;
+
+	for (tok = strtok_r(str, ",", &save); tok && !rc; tok = strtok_r(NULL, ",", &save)) {
+		v = strchr(tok, '=');
+		if (!v) {
+			rc = -EINVAL;
+			break;
+		}
+		*v++ = 0;
+
+		if (!strcmp(tok, "service"))
+			rc = sim_parse_dist(v);
+		else if (!strcmp(tok, "wire"))
+			sim.wire_ns = strtod(v, NULL) * 1000;
+		else if (!strcmp(tok, "capacity"))
+			sim.capacity = strtoul(v, NULL, 0);
+		else if (!strcmp(tok, "queue"))
+			sim.queue = strtoul(v, NULL, 0);
+		else if (!strcmp(tok, "drop"))
+			sim.drop = strtod(v, NULL);
+		else if (!strcmp(tok, "lost"))
+			sim.lost = strtod(v, NULL);
+		else if (!strcmp(tok, "late"))
+			sim.late = strtod(v, NULL);
+		else if (!strcmp(tok, "dup"))
+			sim.dup = strtod(v, NULL);
+		else if (!strcmp(tok, "nodes"))
+			sim.nodes = strtoul(v, NULL, 0);
+		else if (!strcmp(tok, "seed"))
+			sim.seed = strtoull(v, NULL, 0);
+		else if (!strcmp(tok, "payload"))
+			rc = sim_load_payloads(v);
+		else if (!strcmp(tok, "dead"))
+			for (d = strtok_r(v, ":", &save_list); d && sim.n_dead < SIM_MAX_DEAD; d = strtok_r(NULL, ":", &save_list))
+				sim.dead[sim.n_dead++] = strtoul(d, NULL, 0);
+		else if (!strcmp(tok, "foreign"))
+			for (d = strtok_r(v, ":", &save_list); d && sim.n_foreign < SIM_MAX_DEAD; d = strtok_r(NULL, ":", &save_list))
+				sim.foreign[sim.n_foreign++] = strtoul(d, NULL, 0);
+		else if (!strcmp(tok, "unsup"))
+			for (d = strtok_r(v, ":", &save_list); d && sim.n_unsup < SIM_MAX_UNSUP; d = strtok_r(NULL, ":", &save_list))
+				sim.unsup[sim.n_unsup++] = strtoul(d, NULL, 0);
+		else
+			rc = -EINVAL;
+
+		if (rc)
+			fprintf(stderr, "sim: bad option '%s=%s'\n", tok, v);
+	}
+
+	if (!rc && (sim.capacity < 1 || sim.capacity > SIM_MAX_CAPACITY || sim.queue < 0)) {
+		fprintf(stderr, "sim: capacity must be 1..%d, queue >= 0\n", SIM_MAX_CAPACITY);
+		rc = -EINVAL;
+	}
+
+	free(str);
+	return rc;
+}
+
+const struct mad_transport sim_transport = {
+	.name = "sim",
+	.init = sim_init,
+	.open_port = sim_open_port,
+	.close_port = sim_close_port,
+	.register_agent = sim_register,
+	.unregister_agent = sim_unregister,
+	.send = sim_send,
+	.recv = sim_recv,
+	.poll = sim_poll,
+};
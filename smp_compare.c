@@ -0,0 +1,531 @@
+/*
+ * Regression gate for smp_mad_stress --json results.
+ *
+ * Baseline and new runs are given as one or more result files each, every
+ * file is one trial. Total and per target (lid) throughput and latency of
+ * the trials are averaged and compared, Welch's t-test over the trials
+ * tells whether a difference is significant. A metric regresses when it is
+ * worse than its threshold and the difference is significant (or can't be
+ * tested, a single trial on either side). Exit status is 1 on regression.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <getopt.h>
+
+#define MAX_TRIALS 64
+#define MAX_METRICS 4096
+
+/*
+ * Minimal JSON reader, enough for the result files
+ */
+enum json_type {
+	json_null,
+	json_bool,
+	json_num,
+	json_str,
+	json_arr,
+	json_obj,
+};
+
+struct json {
+	enum json_type type;
+	double num;
+	char *str;
+	int n;
+	char **keys;		// json_obj
+	struct json *items;	// json_arr, json_obj
+};
+
+struct json_parser {
+	const char *p;
+	const char *file;
+};
+
+static void *xrealloc(void *p, size_t size)
+{
+	p = realloc(p, size);
+	if (!p) {
+		fprintf(stderr, "out of memory\n");
+		exit(2);
+	}
+	return p;
+}
+
+static int json_error(struct json_parser *jp, const char *what)
+{
+	fprintf(stderr, "%s: bad JSON, %s near '%.16s'\n", jp->file, what, jp->p);
+	return -1;
+}
+
+static void json_ws(struct json_parser *jp)
+{
+	while (isspace((unsigned char)*jp->p))
+		jp->p++;
+}
+
+static int json_parse_str(struct json_parser *jp, char **out)
+{
+	const char *s = ++jp->p;
+	char *d;
+
+	while (*jp->p && *jp->p != '"')
+		jp->p += *jp->p == '\\' && jp->p[1] ? 2 : 1;
+	if (!*jp->p)
+		return json_error(jp, "unterminated string");
+
+	/* escapes are kept as is, only \" and \\ are unescaped */
+	*out = d = xrealloc(NULL, jp->p - s + 1);
+	for (; s < jp->p; ++s) {
+		if (*s == '\\' && (s[1] == '"' || s[1] == '\\'))
+			++s;
+		*d++ = *s;
+	}
+	*d = 0;
+	jp->p++;
+	return 0;
+}
+
+static int json_parse(struct json_parser *jp, struct json *v)
+{
+	char *end;
+
+	memset(v, 0, sizeof(*v));
+	json_ws(jp);
+
+	switch (*jp->p) {
+	case '{':
+	case '[': {
+		int obj = *jp->p == '{';
+		char close = obj ? '}' : ']';
+
+		v->type = obj ? json_obj : json_arr;
+		jp->p++;
+		json_ws(jp);
+		if (*jp->p == close) {
+			jp->p++;
+			return 0;
+		}
+		while (1) {
+			v->items = xrealloc(v->items, (v->n + 1) * sizeof(v->items[0]));
+			if (obj) {
+				v->keys = xrealloc(v->keys, (v->n + 1) * sizeof(v->keys[0]));
+				json_ws(jp);
+				if (*jp->p != '"' || json_parse_str(jp, &v->keys[v->n]))
+					return json_error(jp, "expected key");
+				json_ws(jp);
+				if (*jp->p++ != ':')
+					return json_error(jp, "expected ':'");
+			}
+			if (json_parse(jp, &v->items[v->n++]))
+				return -1;
+			json_ws(jp);
+			if (*jp->p == ',') {
+				jp->p++;
+				continue;
+			}
+			if (*jp->p++ != close)
+				return json_error(jp, obj ? "expected '}'" : "expected ']'");
+			return 0;
+		}
+	}
+	case '"':
+		v->type = json_str;
+		return json_parse_str(jp, &v->str);
+	case 't':
+	case 'f':
+	case 'n':
+		if (!strncmp(jp->p, "true", 4) || !strncmp(jp->p, "null", 4)) {
+			v->type = *jp->p == 'n' ? json_null : json_bool;
+			v->num = *jp->p == 't';
+			jp->p += 4;
+			return 0;
+		}
+		if (!strncmp(jp->p, "false", 5)) {
+			v->type = json_bool;
+			jp->p += 5;
+			return 0;
+		}
+		return json_error(jp, "unknown literal");
+	default:
+		v->type = json_num;
+		v->num = strtod(jp->p, &end);
+		if (end == jp->p)
+			return json_error(jp, "unexpected character");
+		jp->p = end;
+		return 0;
+	}
+}
+
+static const struct json *json_get(const struct json *v, const char *key)
+{
+	int i;
+
+	if (!v || v->type != json_obj)
+		return NULL;
+	for (i = 0; i < v->n; ++i)
+		if (!strcmp(v->keys[i], key))
+			return &v->items[i];
+	return NULL;
+}
+
+static double json_get_num(const struct json *v, const char *key)
+{
+	const struct json *n = json_get(v, key);
+
+	return n && n->type == json_num ? n->num : NAN;
+}
+
+static int json_load(const char *file, struct json *v)
+{
+	struct json_parser jp = { .file = file };
+	char *buf = NULL;
+	size_t len = 0, n;
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (!f) {
+		fprintf(stderr, "%s: %m\n", file);
+		return -1;
+	}
+	do {
+		buf = xrealloc(buf, len + 65536 + 1);
+		n = fread(buf + len, 1, 65536, f);
+		len += n;
+	} while (n);
+	fclose(f);
+	buf[len] = 0;
+
+	jp.p = buf;
+	if (json_parse(&jp, v))
+		return -1;
+	/* strings are copied, buf is not referenced by v */
+	free(buf);
+	return 0;
+}
+
+/*
+ * Metrics
+ */
+enum metric_dir {
+	higher_better,
+	lower_better,
+};
+
+struct metric {
+	char name[48];
+	enum metric_dir dir;
+	int n[2];			// trials with the metric, 0 - baseline, 1 - new
+	int last[2];			// last trial + 1 a value was added for
+	double weight[2];		// of the last trial value, 0 - values add up
+	double v[2][MAX_TRIALS];
+};
+
+static struct metric g_metrics[MAX_METRICS];
+static int g_nmetrics;
+static double g_tput_threshold = 5.0;	// %
+static double g_lat_threshold = 10.0;	// %
+static double g_alpha = 0.05;
+static int g_verbose;
+
+static struct metric *metric_get(const char *name, enum metric_dir dir)
+{
+	int i;
+
+	for (i = 0; i < g_nmetrics; ++i)
+		if (!strcmp(g_metrics[i].name, name))
+			return &g_metrics[i];
+	if (g_nmetrics == MAX_METRICS) {
+		fprintf(stderr, "too many metrics, max: %d\n", MAX_METRICS);
+		exit(2);
+	}
+	snprintf(g_metrics[g_nmetrics].name, sizeof(g_metrics[0].name), "%s", name);
+	g_metrics[g_nmetrics].dir = dir;
+	return &g_metrics[g_nmetrics++];
+}
+
+/*
+ * A lid may show up in several workers: values of one trial add up when
+ * weight is 0 (mad/s), else they are averaged weighted by it (latency by
+ * completed mads).
+ */
+static void metric_add(const char *name, enum metric_dir dir, int side, int trial, double v, double weight)
+{
+	struct metric *m;
+	double *last;
+
+	if (isnan(v) || isnan(weight))
+		return;
+	m = metric_get(name, dir);
+	if (m->last[side] == trial + 1) {
+		last = &m->v[side][m->n[side] - 1];
+		if (!weight)
+			*last += v;
+		else if (m->weight[side] + weight > 0)
+			*last = (*last * m->weight[side] + v * weight) / (m->weight[side] + weight);
+		m->weight[side] += weight;
+		return;
+	}
+	m->last[side] = trial + 1;
+	m->weight[side] = weight;
+	m->v[side][m->n[side]++] = v;
+}
+
+static int load_trial(const char *file, int side, int trial)
+{
+	const struct json *total, *lat, *workers, *targets, *t;
+	struct json root;
+	char name[48];
+	double lid, completed;
+	int i, j;
+
+	if (json_load(file, &root))
+		return -1;
+
+	total = json_get(&root, "total");
+	workers = json_get(&root, "workers");
+	if (!total || !workers || workers->type != json_arr) {
+		fprintf(stderr, "%s: not a smp_mad_stress --json result\n", file);
+		return -1;
+	}
+
+	lat = json_get(total, "latency_us");
+	metric_add("total mad/s", higher_better, side, trial, json_get_num(total, "mad_per_s"), 0);
+	metric_add("total latency p50 (us)", lower_better, side, trial, json_get_num(lat, "p50"), 1);
+	metric_add("total latency p99 (us)", lower_better, side, trial, json_get_num(lat, "p99"), 1);
+	metric_add("total latency p99.9 (us)", lower_better, side, trial, json_get_num(lat, "p99_9"), 1);
+
+	for (i = 0; i < workers->n; ++i) {
+		targets = json_get(&workers->items[i], "targets");
+		if (!targets || targets->type != json_arr)
+			continue;
+		for (j = 0; j < targets->n; ++j) {
+			t = &targets->items[j];
+			lat = json_get(t, "latency_us");
+			lid = json_get_num(t, "lid");
+			completed = json_get_num(t, "ok_mads") + json_get_num(t, "timeouts") + json_get_num(t, "errors");
+			snprintf(name, sizeof(name), "lid %.0f mad/s", lid);
+			metric_add(name, higher_better, side, trial, json_get_num(t, "mad_per_s"), 0);
+			/* per worker tails can't be merged, weighting by mads is close enough */
+			snprintf(name, sizeof(name), "lid %.0f latency avg (us)", lid);
+			metric_add(name, lower_better, side, trial, json_get_num(lat, "avg"), completed);
+			snprintf(name, sizeof(name), "lid %.0f latency p99 (us)", lid);
+			metric_add(name, lower_better, side, trial, json_get_num(lat, "p99"), completed);
+			snprintf(name, sizeof(name), "lid %.0f latency p99.9 (us)", lid);
+			metric_add(name, lower_better, side, trial, json_get_num(lat, "p99_9"), completed);
+		}
+	}
+	/* the tree is leaked, it lives until exit anyway */
+	return 0;
+}
+
+/*
+ * Welch's t-test
+ */
+
+/* continued fraction of the regularized incomplete beta function */
+static double betacf(double a, double b, double x)
+{
+	double c = 1, d, h, del, aa;
+	int m, m2;
+
+	d = 1 - (a + b) * x / (a + 1);
+	if (fabs(d) < 1e-300)
+		d = 1e-300;
+	d = 1 / d;
+	h = d;
+	for (m = 1; m <= 200; ++m) {
+		m2 = 2 * m;
+		aa = m * (b - m) * x / ((a + m2 - 1) * (a + m2));
+		d = 1 + aa * d;
+		if (fabs(d) < 1e-300)
+			d = 1e-300;
+		c = 1 + aa / c;
+		if (fabs(c) < 1e-300)
+			c = 1e-300;
+		d = 1 / d;
+		h *= d * c;
+		aa = -(a + m) * (a + b + m) * x / ((a + m2) * (a + m2 + 1));
+		d = 1 + aa * d;
+		if (fabs(d) < 1e-300)
+			d = 1e-300;
+		c = 1 + aa / c;
+		if (fabs(c) < 1e-300)
+			c = 1e-300;
+		d = 1 / d;
+		del = d * c;
+		h *= del;
+		if (fabs(del - 1) < 1e-12)
+			break;
+	}
+	return h;
+}
+
+static double ibeta(double a, double b, double x)
+{
+	double bt;
+
+	if (x <= 0)
+		return 0;
+	if (x >= 1)
+		return 1;
+	bt = exp(lgamma(a + b) - lgamma(a) - lgamma(b) + a * log(x) + b * log(1 - x));
+	if (x < (a + 1) / (a + b + 2))
+		return bt * betacf(a, b, x) / a;
+	return 1 - bt * betacf(b, a, 1 - x) / b;
+}
+
+static void mean_var(const double *v, int n, double *mean, double *var)
+{
+	double s = 0;
+	int i;
+
+	for (i = 0; i < n; ++i)
+		s += v[i];
+	*mean = s / n;
+
+	s = 0;
+	for (i = 0; i < n; ++i)
+		s += (v[i] - *mean) * (v[i] - *mean);
+	*var = n > 1 ? s / (n - 1) : 0;
+}
+
+/* two sided p-value, NAN if it can't be computed */
+static double welch_p(const struct metric *m, double mean0, double var0, double mean1, double var1)
+{
+	double se0, se1, se, t, df;
+
+	if (m->n[0] < 2 || m->n[1] < 2)
+		return NAN;
+
+	se0 = var0 / m->n[0];
+	se1 = var1 / m->n[1];
+	se = se0 + se1;
+	if (se == 0)
+		return mean0 == mean1 ? 1 : 0;
+
+	t = (mean1 - mean0) / sqrt(se);
+	df = se * se / (se0 * se0 / (m->n[0] - 1) + se1 * se1 / (m->n[1] - 1));
+	return ibeta(df / 2, 0.5, df / (df + t * t));
+}
+
+static int compare(FILE *f)
+{
+	double mean0, var0, mean1, var1, delta, p, threshold;
+	int i, regressions = 0, worse, shown = 0;
+	const char *verdict;
+	struct metric *m;
+
+	fprintf(f, "%-28s %14s %14s %9s %9s  %s\n", "metric", "baseline", "new", "delta %", "p-value", "verdict");
+	for (i = 0; i < g_nmetrics; ++i) {
+		m = &g_metrics[i];
+
+		if (!m->n[0] || !m->n[1]) {
+			fprintf(f, "%-28s %14s %14s %9s %9s  %s\n", m->name, m->n[0] ? "" : "-", m->n[1] ? "" : "-",
+				"", "", m->n[0] ? "missing in new" : "new");
+			continue;
+		}
+
+		mean_var(m->v[0], m->n[0], &mean0, &var0);
+		mean_var(m->v[1], m->n[1], &mean1, &var1);
+		delta = mean0 ? (mean1 - mean0) * 100 / mean0 : 0;
+		p = welch_p(m, mean0, var0, mean1, var1);
+
+		threshold = m->dir == higher_better ? g_tput_threshold : g_lat_threshold;
+		worse = m->dir == higher_better ? -delta > threshold : delta > threshold;
+
+		if (worse && (isnan(p) || p < g_alpha)) {
+			verdict = "REGRESSION";
+			regressions++;
+		} else if (worse) {
+			verdict = "not significant";
+		} else if (!isnan(p) && p < g_alpha && fabs(delta) > threshold) {
+			verdict = "improved";
+		} else {
+			verdict = "ok";
+		}
+
+		/* totals are always shown, targets when they are not ok */
+		if (!g_verbose && strncmp(m->name, "total", 5) && !strcmp(verdict, "ok"))
+			continue;
+		shown++;
+
+		fprintf(f, "%-28s %14.1f %14.1f %+9.2f ", m->name, mean0, mean1, delta);
+		if (isnan(p))
+			fprintf(f, "%9s", "n/a");
+		else
+			fprintf(f, "%9.4f", p);
+		fprintf(f, "  %s\n", verdict);
+	}
+
+	fprintf(f, "\nthresholds: mad/s -%.1f%% , latency +%.1f%% , alpha: %.3f\n", g_tput_threshold, g_lat_threshold, g_alpha);
+	if (!g_verbose)
+		fprintf(f, "%d metrics compared, %d not shown as ok (-v shows all)\n", g_nmetrics, g_nmetrics - shown);
+	fprintf(f, "%s: %d regressions\n", regressions ? "FAIL" : "PASS", regressions);
+	return regressions;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "\nUsage: %s [options] -b <baseline.json> [-b ...] <new.json>...\n\n", prog);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  -b <file>        baseline result (smp_mad_stress --json), one per trial\n");
+	fprintf(stderr, "  -T <percent>     mad/s regression threshold, default: 5\n");
+	fprintf(stderr, "  -L <percent>     latency regression threshold, default: 10\n");
+	fprintf(stderr, "  -a <alpha>       significance level, default: 0.05\n");
+	fprintf(stderr, "  -v               show all targets, not only changed ones\n");
+	fprintf(stderr, "\nExit status: 0 - no regression, 1 - regression, 2 - error\n");
+	fprintf(stderr, "\nExamples:\n");
+	fprintf(stderr, "  %s -b base1.json -b base2.json -b base3.json out1.json out2.json out3.json\n\n", prog);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *baseline[MAX_TRIALS];
+	int i, ch, n_baseline = 0;
+
+	while ((ch = getopt(argc, argv, "b:T:L:a:vh")) != -1) {
+		switch (ch) {
+		case 'b':
+			if (n_baseline == MAX_TRIALS) {
+				fprintf(stderr, "too many baseline trials, max: %d\n", MAX_TRIALS);
+				return 2;
+			}
+			baseline[n_baseline++] = optarg;
+			break;
+		case 'T':
+			g_tput_threshold = strtod(optarg, NULL);
+			break;
+		case 'L':
+			g_lat_threshold = strtod(optarg, NULL);
+			break;
+		case 'a':
+			g_alpha = strtod(optarg, NULL);
+			break;
+		case 'v':
+			g_verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (!n_baseline || optind >= argc || argc - optind > MAX_TRIALS)
+		usage(argv[0]);
+
+	for (i = 0; i < n_baseline; ++i)
+		if (load_trial(baseline[i], 0, i))
+			return 2;
+	for (i = optind; i < argc; ++i)
+		if (load_trial(argv[i], 1, i - optind))
+			return 2;
+
+	return compare(stdout) ? 1 : 0;
+}
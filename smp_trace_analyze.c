@@ -0,0 +1,572 @@
+/*
+ * Offline analyzer for smp_mad_stress --trace files.
+ *
+ * Trace files are mmap'd and split into chunks which are processed by a pool
+ * of threads. Every thread aggregates into its own tables, the tables are
+ * merged at the end, so the records are read exactly once and without locks.
+ *
+ * Reports total, per attribute, per target (lid) and per interval latency
+ * percentiles, throughput timeline and the list of slowest mads.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mad_trace.h"
+#include "mad_hist.h"
+
+#define CHUNK_RECORDS (1 << 20)
+#define MAX_THREADS 256
+#define STATUS_TIMEOUT 110 // ETIMEDOUT
+
+struct trace_file {
+	const char *name;
+	void *map;
+	size_t size;
+	struct mad_trace_hdr *hdr;
+	struct mad_trace_rec *recs;
+	uint64_t n;	// valid records
+	uint64_t first;	// ring position of the oldest record
+	uint64_t mask;
+};
+
+struct chunk {
+	int file;
+	uint64_t start;	// logical index, 0 - the oldest record
+	uint64_t count;
+};
+
+struct stats {
+	uint64_t sent;
+	uint64_t ok;
+	uint64_t timeouts;
+	uint64_t errors;
+	uint64_t lost;
+	uint64_t retries;	// attempts retransmitted by the tool
+	uint64_t mad_status;	// completed with non zero MAD status
+	struct lat_hist lat;
+};
+
+struct stat_map {
+	uint32_t *keys;
+	struct stats **vals;
+	uint32_t cap;	// power of 2
+	uint32_t n;
+};
+
+struct outlier {
+	struct mad_trace_rec rec;
+	int worker;
+};
+
+struct agg {
+	struct stats total;
+	struct stat_map by_lid;
+	struct stat_map by_attr;
+	struct stats **intervals;
+	uint64_t n_intervals;
+	struct outlier *outliers;	// min-heap by latency
+	int n_outliers;
+};
+
+static struct trace_file *g_files;
+static int g_nfiles;
+static struct chunk *g_chunks;
+static int g_nchunks;
+static int g_next_chunk;
+static uint64_t g_start_us;
+static uint64_t g_interval_us = 1000000;
+static int g_max_outliers = 20;
+
+static void *xcalloc(size_t n, size_t size)
+{
+	void *p = calloc(n, size);
+
+	if (!p) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+static struct stats *new_stats(void)
+{
+	return xcalloc(1, sizeof(struct stats));
+}
+
+static void stats_merge(struct stats *dst, const struct stats *src)
+{
+	dst->sent += src->sent;
+	dst->ok += src->ok;
+	dst->timeouts += src->timeouts;
+	dst->errors += src->errors;
+	dst->lost += src->lost;
+	dst->retries += src->retries;
+	dst->mad_status += src->mad_status;
+	lat_hist_merge(&dst->lat, &src->lat);
+}
+
+static inline uint32_t hash32(uint32_t k)
+{
+	k ^= k >> 16;
+	k *= 0x7feb352d;
+	k ^= k >> 15;
+	return k;
+}
+
+static struct stats *map_get(struct stat_map *m, uint32_t key);
+
+static void map_grow(struct stat_map *m)
+{
+	struct stat_map old = *m;
+	uint32_t i, j;
+
+	m->cap = old.cap ? old.cap * 2 : 64;
+	m->keys = xcalloc(m->cap, sizeof(m->keys[0]));
+	m->vals = xcalloc(m->cap, sizeof(m->vals[0]));
+
+	for (i = 0; i < old.cap; ++i) {
+		if (!old.vals[i])
+			continue;
+		for (j = hash32(old.keys[i]) & (m->cap - 1); m->vals[j]; j = (j + 1) & (m->cap - 1))
+			;
+		m->keys[j] = old.keys[i];
+		m->vals[j] = old.vals[i];
+	}
+
+	free(old.keys);
+	free(old.vals);
+}
+
+static struct stats *map_get(struct stat_map *m, uint32_t key)
+{
+	uint32_t j;
+
+	if ((m->n + 1) * 2 > m->cap)
+		map_grow(m);
+
+	for (j = hash32(key) & (m->cap - 1); m->vals[j]; j = (j + 1) & (m->cap - 1))
+		if (m->keys[j] == key)
+			return m->vals[j];
+
+	m->keys[j] = key;
+	m->vals[j] = new_stats();
+	m->n++;
+	return m->vals[j];
+}
+
+static struct stats *interval_get(struct agg *a, uint64_t ts_us)
+{
+	uint64_t i = ts_us > g_start_us ? (ts_us - g_start_us) / g_interval_us : 0;
+	uint64_t n;
+
+	if (i >= a->n_intervals) {
+		n = a->n_intervals ? a->n_intervals : 64;
+		while (n <= i)
+			n *= 2;
+		a->intervals = realloc(a->intervals, n * sizeof(a->intervals[0]));
+		if (!a->intervals) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		memset(a->intervals + a->n_intervals, 0, (n - a->n_intervals) * sizeof(a->intervals[0]));
+		a->n_intervals = n;
+	}
+
+	if (!a->intervals[i])
+		a->intervals[i] = new_stats();
+	return a->intervals[i];
+}
+
+static void outlier_down(struct outlier *h, int n, int i)
+{
+	struct outlier t;
+	int l, m;
+
+	while ((l = 2 * i + 1) < n) {
+		m = l;
+		if (l + 1 < n && h[l + 1].rec.latency_us < h[l].rec.latency_us)
+			m = l + 1;
+		if (h[i].rec.latency_us <= h[m].rec.latency_us)
+			break;
+		t = h[i];
+		h[i] = h[m];
+		h[m] = t;
+		i = m;
+	}
+}
+
+static void outlier_add(struct agg *a, const struct mad_trace_rec *r, int worker)
+{
+	struct outlier t;
+	int i;
+
+	if (!g_max_outliers)
+		return;
+
+	if (a->n_outliers < g_max_outliers) {
+		i = a->n_outliers++;
+		a->outliers[i].rec = *r;
+		a->outliers[i].worker = worker;
+		while (i && a->outliers[(i - 1) / 2].rec.latency_us > a->outliers[i].rec.latency_us) {
+			t = a->outliers[i];
+			a->outliers[i] = a->outliers[(i - 1) / 2];
+			a->outliers[(i - 1) / 2] = t;
+			i = (i - 1) / 2;
+		}
+	} else if (r->latency_us > a->outliers[0].rec.latency_us) {
+		a->outliers[0].rec = *r;
+		a->outliers[0].worker = worker;
+		outlier_down(a->outliers, a->n_outliers, 0);
+	}
+}
+
+static void account(struct stats *s, const struct mad_trace_rec *r)
+{
+	switch (r->event) {
+	case mad_trace_send:
+		s->sent++;
+		return;
+	case mad_trace_lost:
+		s->lost++;
+		return;
+	case mad_trace_retry:
+		s->retries++;
+		return;
+	case mad_trace_complete:
+		if (r->status == STATUS_TIMEOUT)
+			s->timeouts++;
+		else if (r->status)
+			s->errors++;
+		else
+			s->ok++;
+		if (!r->status && (r->mad_status & 0x7fff))
+			s->mad_status++;
+		lat_hist_add(&s->lat, r->latency_us);
+		return;
+	}
+}
+
+static void process_chunk(struct agg *a, const struct chunk *c)
+{
+	const struct trace_file *f = &g_files[c->file];
+	const struct mad_trace_rec *r;
+	uint64_t i;
+
+	for (i = c->start; i < c->start + c->count; ++i) {
+		r = &f->recs[(f->first + i) & f->mask];
+
+		account(&a->total, r);
+		account(map_get(&a->by_lid, r->lid), r);
+		account(map_get(&a->by_attr, r->attr), r);
+		account(interval_get(a, r->ts_us), r);
+
+		if (r->event == mad_trace_complete || r->event == mad_trace_lost)
+			outlier_add(a, r, f->hdr->worker);
+	}
+}
+
+static void *analyze_thread(void *ctx)
+{
+	struct agg *a = ctx;
+	int c;
+
+	while ((c = __sync_fetch_and_add(&g_next_chunk, 1)) < g_nchunks)
+		process_chunk(a, &g_chunks[c]);
+
+	return NULL;
+}
+
+static int open_trace(struct trace_file *f, const char *name)
+{
+	struct stat st;
+	int fd;
+
+	f->name = name;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		fprintf(stderr, "can't open %s: %m\n", name);
+		return -1;
+	}
+
+	f->size = st.st_size;
+	if (f->size < MAD_TRACE_HDR_SIZE) {
+		fprintf(stderr, "%s: too short for a trace file\n", name);
+		close(fd);
+		return -1;
+	}
+
+	f->map = mmap(NULL, f->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (f->map == MAP_FAILED) {
+		fprintf(stderr, "can't map %s: %m\n", name);
+		return -1;
+	}
+	madvise(f->map, f->size, MADV_SEQUENTIAL);
+
+	f->hdr = f->map;
+	f->recs = (struct mad_trace_rec *)((char *)f->map + MAD_TRACE_HDR_SIZE);
+
+	if (memcmp(f->hdr->magic, MAD_TRACE_MAGIC, sizeof(f->hdr->magic)) ||
+	    f->hdr->version != MAD_TRACE_VERSION ||
+	    f->hdr->rec_size != sizeof(struct mad_trace_rec) ||
+	    !f->hdr->capacity || (f->hdr->capacity & (f->hdr->capacity - 1)) ||
+	    MAD_TRACE_HDR_SIZE + f->hdr->capacity * sizeof(struct mad_trace_rec) > f->size) {
+		fprintf(stderr, "%s: not a valid trace file\n", name);
+		return -1;
+	}
+
+	f->mask = f->hdr->capacity - 1;
+	if (f->hdr->head > f->hdr->capacity) {
+		/* the ring wrapped, the oldest record follows the newest */
+		f->n = f->hdr->capacity;
+		f->first = f->hdr->head & f->mask;
+	} else {
+		f->n = f->hdr->head;
+		f->first = 0;
+	}
+	return 0;
+}
+
+static void make_chunks(void)
+{
+	uint64_t off;
+	int i, n = 0;
+
+	for (i = 0; i < g_nfiles; ++i)
+		n += (g_files[i].n + CHUNK_RECORDS - 1) / CHUNK_RECORDS;
+
+	g_chunks = xcalloc(n ? n : 1, sizeof(g_chunks[0]));
+
+	for (i = 0; i < g_nfiles; ++i) {
+		for (off = 0; off < g_files[i].n; off += CHUNK_RECORDS) {
+			g_chunks[g_nchunks].file = i;
+			g_chunks[g_nchunks].start = off;
+			g_chunks[g_nchunks].count = g_files[i].n - off < CHUNK_RECORDS ? g_files[i].n - off : CHUNK_RECORDS;
+			g_nchunks++;
+		}
+	}
+}
+
+static void merge_map(struct stat_map *dst, const struct stat_map *src)
+{
+	uint32_t i;
+
+	for (i = 0; i < src->cap; ++i)
+		if (src->vals[i])
+			stats_merge(map_get(dst, src->keys[i]), src->vals[i]);
+}
+
+static void merge_agg(struct agg *dst, const struct agg *src)
+{
+	uint64_t i;
+	int j;
+
+	stats_merge(&dst->total, &src->total);
+	merge_map(&dst->by_lid, &src->by_lid);
+	merge_map(&dst->by_attr, &src->by_attr);
+
+	for (i = 0; i < src->n_intervals; ++i)
+		if (src->intervals[i])
+			stats_merge(interval_get(dst, g_start_us + i * g_interval_us), src->intervals[i]);
+
+	for (j = 0; j < src->n_outliers; ++j)
+		outlier_add(dst, &src->outliers[j].rec, src->outliers[j].worker);
+}
+
+static void print_stats_hdr(FILE *f, const char *key)
+{
+	fprintf(f, "%-12s %12s %12s %10s %10s %10s %10s %10s %8s %8s %8s %8s %8s %8s\n", key, "sent", "completed",
+		"timeouts", "errors", "lost", "retries", "mad_stat", "min", "p50", "p90", "p99", "p99.9", "max");
+}
+
+static void print_stats(FILE *f, const char *key, const struct stats *s)
+{
+	fprintf(f, "%-12s %12" PRIu64 " %12" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+		" %8u %8u %8u %8u %8u %8u\n", key, s->sent, s->lat.count, s->timeouts, s->errors, s->lost,
+		s->retries, s->mad_status, s->lat.min, lat_hist_percentile(&s->lat, 50), lat_hist_percentile(&s->lat, 90),
+		lat_hist_percentile(&s->lat, 99), lat_hist_percentile(&s->lat, 99.9), s->lat.max);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void print_map(FILE *f, const char *title, const char *key_fmt, const struct stat_map *m)
+{
+	uint32_t *keys = xcalloc(m->n ? m->n : 1, sizeof(keys[0]));
+	char key[32];
+	uint32_t i, n = 0;
+
+	for (i = 0; i < m->cap; ++i)
+		if (m->vals[i])
+			keys[n++] = m->keys[i];
+	qsort(keys, n, sizeof(keys[0]), cmp_u32);
+
+	fprintf(f, "\n%s\n", title);
+	print_stats_hdr(f, "");
+	for (i = 0; i < n; ++i) {
+		snprintf(key, sizeof(key), key_fmt, keys[i]);
+		print_stats(f, key, map_get((struct stat_map *)m, keys[i]));
+	}
+	free(keys);
+}
+
+static int cmp_outlier(const void *a, const void *b)
+{
+	const struct outlier *x = a, *y = b;
+
+	return x->rec.latency_us > y->rec.latency_us ? -1 : x->rec.latency_us < y->rec.latency_us;
+}
+
+static void report(FILE *f, struct agg *a, uint64_t n_records, uint64_t end_us)
+{
+	double span_s = end_us > g_start_us ? (end_us - g_start_us) / 1e6 : 0;
+	double interval_s = g_interval_us / 1e6;
+	struct outlier *o;
+	struct stats *s;
+	char key[32];
+	uint64_t i;
+	int j;
+
+	fprintf(f, "Trace files: %d , records: %" PRIu64 " , span: %.2f s\n", g_nfiles, n_records, span_s);
+
+	fprintf(f, "\nTotal\n");
+	print_stats_hdr(f, "");
+	print_stats(f, "all", &a->total);
+	if (span_s > 0)
+		fprintf(f, "mad/s: %.0f\n", a->total.lat.count / span_s);
+
+	print_map(f, "Per attribute", "0x%x", &a->by_attr);
+	print_map(f, "Per target", "lid %u", &a->by_lid);
+
+	fprintf(f, "\nTimeline, interval %.3f s\n", interval_s);
+	print_stats_hdr(f, "time (s)");
+	for (i = 0; i < a->n_intervals; ++i) {
+		s = a->intervals[i];
+		if (!s)
+			continue;
+		snprintf(key, sizeof(key), "%.3f", i * interval_s);
+		print_stats(f, key, s);
+	}
+
+	fprintf(f, "\nThroughput timeline (completed mad/s)\n");
+	for (i = 0; i < a->n_intervals; ++i)
+		if (a->intervals[i])
+			fprintf(f, "%10.3f %12.0f\n", i * interval_s, a->intervals[i]->lat.count / interval_s);
+
+	o = a->outliers;
+	qsort(o, a->n_outliers, sizeof(o[0]), cmp_outlier);
+	fprintf(f, "\nOutliers, top %d by latency\n", a->n_outliers);
+	fprintf(f, "%12s %6s %6s %6s %10s %10s %10s %6s %8s\n", "time (s)", "worker", "lid", "attr", "mod", "tid",
+		"latency", "status", "mad_stat");
+	for (j = 0; j < a->n_outliers; ++j)
+		fprintf(f, "%12.6f %6d %6u %#6x %10u %#10x %10u %6u %#8x %s\n",
+			(o[j].rec.ts_us - g_start_us) / 1e6, o[j].worker, o[j].rec.lid, o[j].rec.attr,
+			o[j].rec.attr_mod, o[j].rec.tid, o[j].rec.latency_us, o[j].rec.status,
+			o[j].rec.mad_status, o[j].rec.event == mad_trace_lost ? "lost" : "");
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "\nUsage: %s [options] <trace file>...\n\n", prog);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  -j <threads>     number of analysis threads, default: number of cpus\n");
+	fprintf(stderr, "  -i <ms>          timeline interval, default: 1000\n");
+	fprintf(stderr, "  -o <n>           number of outliers to list, default: 20\n");
+	fprintf(stderr, "\nExamples:\n");
+	fprintf(stderr, "  %s run1.*.trace\n\n", prog);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t threads[MAX_THREADS];
+	struct agg *aggs;
+	uint64_t n_records = 0, end_us = 0;
+	int i, ch, nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((ch = getopt(argc, argv, "j:i:o:h")) != -1) {
+		switch (ch) {
+		case 'j':
+			nthreads = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			g_interval_us = strtoull(optarg, NULL, 0) * 1000;
+			break;
+		case 'o':
+			g_max_outliers = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind >= argc || !g_interval_us)
+		usage(argv[0]);
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > MAX_THREADS)
+		nthreads = MAX_THREADS;
+
+	g_nfiles = argc - optind;
+	g_files = xcalloc(g_nfiles, sizeof(g_files[0]));
+	g_start_us = ~0ULL;
+
+	for (i = 0; i < g_nfiles; ++i) {
+		struct trace_file *f = &g_files[i];
+
+		if (open_trace(f, argv[optind + i]))
+			return 1;
+		if (!f->n)
+			continue;
+
+		n_records += f->n;
+		if (f->recs[f->first].ts_us < g_start_us)
+			g_start_us = f->recs[f->first].ts_us;
+		if (f->recs[(f->first + f->n - 1) & f->mask].ts_us > end_us)
+			end_us = f->recs[(f->first + f->n - 1) & f->mask].ts_us;
+	}
+
+	if (!n_records) {
+		fprintf(stderr, "no records\n");
+		return 1;
+	}
+
+	make_chunks();
+	if (nthreads > g_nchunks)
+		nthreads = g_nchunks;
+
+	aggs = xcalloc(nthreads, sizeof(aggs[0]));
+	for (i = 0; i < nthreads; ++i) {
+		aggs[i].outliers = xcalloc(g_max_outliers ? g_max_outliers : 1, sizeof(struct outlier));
+		if (pthread_create(&threads[i], NULL, analyze_thread, &aggs[i])) {
+			fprintf(stderr, "failed to create a thread: %d %m\n", i);
+			return 1;
+		}
+	}
+
+	for (i = 0; i < nthreads; ++i) {
+		pthread_join(threads[i], NULL);
+		if (i)
+			merge_agg(&aggs[0], &aggs[i]);
+	}
+
+	report(stdout, &aggs[0], n_records, end_us);
+	return 0;
+}
@@ -48,51 +48,414 @@
 #include <sys/time.h>
 
 #include "ibdiag_common.h"
+#include "iba_types.h"
+#include "mad_hist.h"
+#include "mad_metrics.h"
+#include "mad_status.h"
+#include "mad_trace.h"
+#include "mad_transport.h"
 //#include <infiniband/ibnetdisc.h>
 
 #define MAX_TARGET_QUEUE_DEPTH 512
 #define MAX_SOURCE_QUEUE_DEPTH 2048
 #define MAX_WORKERS 64
-#define MAX_LIDS 64
+#define MAX_LIDS 16384
+#define MAX_ENDPOINTS 16
+
+/*
+ * Low 32 bit of a TID, the kernel owns the high ones: generation, worker,
+ * slot in mads_on_wire. A responce maps straight to its slot, the
+ * generation tells a responce to an older mad of the slot.
+ */
+#define TID_SLOT_BITS 11 // MAX_SOURCE_QUEUE_DEPTH
+#define TID_WORKER_BITS 6 // MAX_WORKERS
+#define TID_GEN_MASK 0x7fff
+#define RETIRED_PER_SLOT 4 // last mads of a slot a late responce is recognized for
+#if (1 << TID_SLOT_BITS) < MAX_SOURCE_QUEUE_DEPTH || (1 << TID_WORKER_BITS) < MAX_WORKERS
+#error "TID fields are too small"
+#endif
+#define SW_TIMEOUT_SLACK_MS 1000
+#define MAX_LOGGED_MISMATCHES 10 // per target
+#define PREFETCH_TIMEOUT_MS 1000
+#define PREFETCH_RETRIES 3
+#define METRICS_PUBLISH_MS 500
+#define MAX_TOOL_RETRIES 15
+#define HEALTH_WINDOW 16 // completions a target is judged on by --quarantine
+#define QUARANTINE_PROBE_MS 1000
+#define SEQ_MAX_STEPS 4
+#define PM_MAX_PORTS 255
+#define PM_ATTR_PORT_COUNTERS 0x0012
+#define PM_ATTR_PORT_COUNTERS_EXT 0x001D
+#define SA_ATTR_NODE_RECORD 0x0011
+#define SA_ATTR_PORTINFO_RECORD 0x0012
+#define SA_ATTR_PATH_RECORD 0x0035
+#define SA_DATA_OFFSET 56 // SA header, records follow
+#define SA_SEGMENT_DATA 200 // SA data of one RMPP segment
+#define RMPP_PREALLOC (64 * 1024) // receive buffer of --sa_table, grows to the largest transfer
+#define CC_MIX_MAX 8
+#define CLASS_MIX_MAX 8
+#define ATTR_ROWS_MAX (2 * CC_MIX_MAX) // of the CC mix or the class mix
+#define MAX_CLASS_AGENTS 5 // SMI, DR SMI, PerfMgt, SA, CC
+#define CC_DATA_OFFSET 64 // mgt_data of CC mads, after CC_Key and log data
+#define SMP_ATTR_NODE_INFO 0x0011
+#define SMP_ATTR_VENDOR_FIRST 0xFF00 // vendor specific range, up to 0xFFFF
 
 enum mngt_methods {
 	mngt_method_get = 1,
 	mngt_method_set = 2
 };
 
+/* option codes for long-only options */
+enum long_opts {
+	opt_sw_timeout = 1,
+	opt_trace,
+	opt_trace_size,
+	opt_verify,
+	opt_sim,
+	opt_json,
+	opt_csv,
+	opt_metrics,
+	opt_tool_retries,
+	opt_retry_backoff,
+	opt_warmup,
+	opt_warmup_mads,
+	opt_count,
+	opt_scenario,
+	opt_perfmgt,
+	opt_sa,
+	opt_sa_table,
+	opt_cc,
+	opt_cc_key,
+	opt_classes,
+	opt_endpoint,
+	opt_quarantine,
+};
+
 float timedifference_msec(struct timeval t0, struct timeval t1);
 int timedifference_usec(struct timeval t0, struct timeval t1);
 float timedifference_sec(struct timeval t0, struct timeval t1);
 const char *get_attribute_name(int attr);
+const char *pm_attribute_name(int attr);
+const char *sa_attribute_name(int attr);
+const char *cc_attribute_name(int attr);
+const char *class_attribute_name(int mgmt_class, int attr);
+static int parse_cc_mix(char *str);
+static int parse_class_mix(char *str, int attr, int mod);
+static const char *class_name(int mgmt_class);
 
-static int drmad_tid = 0x123;
 static int g_nworkers = 1;
+static const struct mad_transport *g_transport = &umad_transport;
+static char *g_trace_prefix;
+static uint64_t g_trace_records = MAD_TRACE_DEFAULT_RECORDS;
+static char *g_json_path; // "-" - stdout, text report goes to stderr then
+static char *g_csv_path;
+static char *g_metrics_addr;
+static uint8_t g_pm_ports[PM_MAX_PORTS]; // --perfmgt ports, a sweep reads every one
+static uint8_t g_pm_port_idx[256]; // port number to index in g_pm_ports
+static int g_n_pm_ports;
+static int g_sa_lid; // --sa, SM lid every query goes to
+static int g_sa_slid; // source lid of PathRecord queries
+static int g_sa_table; // SubnAdmGetTable, multi segment RMPP responces
+static int g_cc; // --cc, the attr argument is a mix
+static uint64_t g_cc_key;
+static char *g_classes; // --classes, parsed once attr and mod are known
+
+/* local CA port workers send from, worker n is on endpoint n % g_n_endpoints */
+struct endpoint {
+	char ca[UMAD_CA_NAME_LEN]; // "" - default
+	int port;
+	uint32_t *lids; // own targets, NULL - a share of the command line lids
+	int n_lids;
+};
+
+static struct endpoint g_endpoints[MAX_ENDPOINTS];
+static int g_n_endpoints;
+
+/*
+ * CC workload: every target sends the attributes of the mix round robin.
+ * A Set writes back the value the last Get of the attribute read from the
+ * target, until there is one the Set is replaced by that Get. Counters are
+ * kept per attribute and method (row), Gets of Set attributes have a row
+ * even if they are not in the mix.
+ */
+struct cc_entry {
+	uint16_t attr;
+	uint8_t method;
+	int8_t set_idx; // in cc_data of a target, -1 for Gets
+	uint8_t row;
+	uint8_t get_row; // Set entries, row of the replacing Get
+};
+
+/* counters of one class, attribute and method (row) of a mix */
+struct attr_stats {
+	uint8_t mgmt_class;
+	uint16_t attr;
+	uint8_t method;
+	uint64_t ok;
+	uint64_t errors;
+	uint64_t timeouts;
+	struct lat_hist latency;
+};
+
+static struct cc_entry g_cc_mix[CC_MIX_MAX];
+static int g_n_cc_mix;
+static int g_n_cc_set; // Set entries
+static struct attr_stats g_attr_rows[ATTR_ROWS_MAX]; // class, attr and method of rows, counters are per worker
+static int g_n_attr_rows;
+
+/*
+ * Class mix: a worker registers an agent for every class of the mix on its
+ * port and every target sends the entries round robin, so all classes
+ * share the source queue and the target credits. Responces are dispatched
+ * by the agent they arrive on.
+ */
+struct class_entry {
+	uint8_t mgmt_class;
+	uint16_t attr;
+	uint32_t mod;
+};
+
+static struct class_entry g_class_mix[CLASS_MIX_MAX];
+static int g_n_class_mix;
+
+typedef uint64_t v8u64 __attribute__((vector_size(64)));
+
+/*
+ * Volatile fields of SMP attributes, ignored by response verification.
+ * bits - mask of volatile bits in every byte of the range.
+ */
+struct volatile_field {
+	int attr;
+	uint8_t offset;
+	uint8_t len;
+	uint8_t bits;
+};
+
+static const struct volatile_field volatile_fields[] = {
+	{0x0011, 36, 1, 0xff},	// NodeInfo.LocalPortNum, depends on ingress port
+	{0x0012, 11, 1, 0x04},	// SwitchInfo.PortStateChange
+	{0x0015, 24, 2, 0xff},	// PortInfo.DiagCode
+	{0x0015, 44, 6, 0xff},	// PortInfo.M_Key/P_Key/Q_KeyViolations
+	{0x0015, 56, 4, 0xff},	// PortInfo.LinkRoundTripLatency
+	{0x0020, 16, 4, 0xff},	// SMInfo.ActCount
+	{}
+};
 static pthread_barrier_t g_barrier;
 
+/*
+ * Scenarios: every target runs a sequence of dependent steps, the next
+ * step starts when every mad of the previous one completed ok. A sequence
+ * which is over starts again. Sequences of different targets are
+ * pipelined through the usual queue depth limits.
+ */
+enum seq_mod {
+	seq_mod_fixed,	// attribute modifier from the command line
+	seq_mod_ports,	// one mad per port 1..NumPorts of NodeInfo got by the previous step
+};
+
+struct seq_step {
+	uint16_t attr;	// 0 - attribute from the command line
+	uint8_t method;
+	uint8_t mod;	// enum seq_mod
+	uint8_t check;	// responce must match data of the previous step
+};
+
+struct scenario {
+	const char *name;
+	struct seq_step steps[SEQ_MAX_STEPS];
+	int n_steps;
+};
+
+/* data of a single mad Get step is the input of the next step */
+static const struct scenario scenarios[] = {
+	{"set_confirm", {			// Get, Set the same value, Get to confirm
+		{0, mngt_method_get, seq_mod_fixed, 0},
+		{0, mngt_method_set, seq_mod_fixed, 0},
+		{0, mngt_method_get, seq_mod_fixed, 1},
+	}, 3},
+	{"discover", {				// NodeInfo, PortInfo of every port it reports
+		{0x0011, mngt_method_get, seq_mod_fixed, 0},
+		{0x0015, mngt_method_get, seq_mod_ports, 0},
+	}, 2},
+	{}
+};
+
 typedef struct {
 	char path[64];
 	int hop_cnt;
 } DRPath;
 
+static DRPath g_local_path; // 0 hops, DR SMPs of the class mix go to the local port
+
+/*
+ * Target state is split by access pattern, all arrays are indexed by target:
+ *   mad_worker.on_wire  - credits in use, the only thing send_mads scans
+ *   mad_worker.stats    - counters updated on completion, a cache line each
+ *   mad_worker.lat_log2 - latency distribution
+ *   mad_worker.mad_status - MAD status breakdown and retransmits, touched only by errors
+ *   mad_worker.targets  - address and pre-fetch result, read when a mad is built
+ *   mad_worker.mlnx_epi - decoded MLNX ExtendedPortInfo, runs of that attribute only
+ */
 struct mad_target {
 	uint32_t lid;
 	DRPath * path;
-	int on_wire_mads;
-	int send_mads;
-	int timeouts;	// number of timeout responces from driver
-	int errors;
-	int ok_mads;	// number of ok responces from device
-	int min_latency_us;
-	int max_latency_us;
-	int avrg_latency_us;
-	uint64_t total_time_us; // total time of all mads on wire
+	int excluded; // pre-fetch failed, the target is not used in the run
+	int prefetch_status; // umad status, negative MAD status of pre-fetch Get, ENOTSUP - vendor probe
+	uint32_t vendor_id; // NodeInfo of the vendor probe
+	uint16_t device_id;
 	uint8_t data[64]; // data for set operation
 };
 
-struct mad_operation {
-	be64_t tid; // Network order, valid high 32 bit
-	struct mad_target *target;
+/* last ok responce of a target */
+struct mlnx_epi {
+	uint8_t valid;
+	uint8_t state_change_enable;
+	uint8_t link_speed_supported;
+	uint8_t link_speed_enabled;
+	uint8_t link_speed_active;
+	uint64_t changes; // ok responces which differ from the one before
+};
+
+/* circuit breaker of a target, see health_done */
+struct target_health {
+	uint16_t done; // completions of the current window
+	uint16_t failed; // timed out, lost, umad error or BUSY
+	int quarantined;
+	uint64_t probe_us; // next probe not before
+	uint64_t since_us; // start of the open quarantine
+	uint64_t quarantined_us; // of closed quarantines
+	uint64_t quarantines;
+	uint64_t probes;
+};
+
+struct target_stats {
+	uint64_t send_mads;
+	uint64_t ok_mads;	// responces with MAD status 0
+	uint64_t timeouts;	// number of timeout responces from driver
+	uint64_t errors;	// other umad errors and responces with MAD status
+	uint64_t lost;		// mads reclaimed by software deadline, no responce from driver
+	uint64_t mismatches;	// ok responces which differ from data snapshot
+	uint64_t total_time_us; // total time of all mads on wire
+	uint32_t min_latency_us;
+	uint32_t max_latency_us;
+} __attribute__((aligned(64)));
+
+struct target_hist {
+	uint64_t n[LAT_LOG2_BUCKETS]; // see lat_log2_bucket
+} __attribute__((aligned(64)));
+
+/*
+ * PerfMgt sweep: every sweep reads PortCounters or PortCountersExtended of
+ * every --perfmgt port of every target. Counters are kept per port, the
+ * difference to the previous sweep is added to the target deltas.
+ */
+enum pm_counter {
+	pm_xmit_data,
+	pm_rcv_data,
+	pm_xmit_pkts,
+	pm_rcv_pkts,
+	pm_xmit_wait,
+	pm_symbol_errors,
+	pm_link_recovers,
+	pm_link_downed,
+	pm_rcv_errors,
+	pm_xmit_discards,
+	PM_COUNTERS
+};
+
+static const char * const pm_counter_names[PM_COUNTERS] = {
+	"xmit_data", "rcv_data", "xmit_pkts", "rcv_pkts", "xmit_wait",
+	"symbol_errors", "link_recovers", "link_downed", "rcv_errors", "xmit_discards",
+};
+
+struct target_pm {
+	int sweep; // the target is done with it when < mad_worker.pm_sweep
+	int next_port; // index in g_pm_ports of the next Get of the sweep
+	int in_flight;
+	uint64_t delta[PM_COUNTERS]; // sum of differences between sweeps
+};
+
+/* state of the sequence a target runs and its counters */
+struct target_seq {
+	int step; // -1 - idle, a new sequence starts on next send
+	int pending; // mads of the step not sent yet
+	int in_flight;
+	int next_mod; // of seq_mod_ports step
+	int failed;
+	int epoch; // mad_worker.epoch when the sequence started
 	struct timeval start;
+	uint64_t started;
+	uint64_t completed;
+	uint64_t aborted; // a mad failed or a check mismatched
+	uint8_t data[64]; // responce of the last single mad Get
+};
+
+struct target_status {
+	uint64_t retransmits; // attempts timed out and sent again by the tool
+	uint64_t mad_errors; // responces with non zero MAD status, part of errors
+	uint64_t late; // responces after their mad timed out or was reclaimed
+	uint64_t duplicates; // responces to a mad which was already answered
+	uint64_t n[MAD_STATUS_COUNTERS]; // see mad_status_count
+} __attribute__((aligned(64)));
+
+struct mad_operation {
+	be64_t tid; // Network order, 0 - free slot, see TID_SLOT_BITS
+	uint16_t gen; // of the last mad sent from the slot
+	int target; // index in target arrays
+	struct timeval start; // first attempt, latency is measured from it
+	struct timeval attempt_start;
+	uint64_t deadline_us; // software deadline, slot is reclaimed after it
+	int heap_idx; // position in deadline heap
+	int attempt; // 1 - first, more only with tool retries
+	int retry_pending; // waiting for backoff, deadline_us is the retransmit time
+	int epoch; // mad_worker.epoch when sent, older mads are not accounted
+	uint8_t mgmt_class; // of the agent it is sent on
+	uint16_t attr;
+	uint8_t method;
+	uint32_t mod;
+	uint8_t *data; // of Set, target or sequence data
+	int answered; // a responce arrived, not only a umad completion
+	int probe; // of a quarantined target, kept over tool retries
+};
+
+/* a mad which left its slot, a responce may still come for it */
+struct retired_mad {
+	uint32_t tid; // 0 - none
+	int target;
+	uint64_t start_us; // of the attempt
+	int answered;
+};
+
+/*
+ * Counters published by a worker for the metrics server. Seqlock: seq is
+ * odd while the worker copies, a reader retries when seq changed under it.
+ * The worker never waits for readers.
+ */
+struct mad_snapshot {
+	unsigned seq;
+	int cap; // size of the arrays, set before the first publish
+	int n_targets;
+	int n_excluded;
+	uint64_t run_us;
+	const struct mad_target *targets; // worker's, read only after pre-fetch
+	struct target_stats *stats;
+	struct target_hist *lat_log2;
+	struct target_status *mad_status;
+	uint16_t *on_wire;
+	struct lat_hist latency;
+	struct lat_hist *lat_outcome;
+	uint64_t umad_status[256];
+	struct lat_hist lat_first;
+	struct lat_hist lat_retried;
+	uint64_t seq_completed;
+	uint64_t seq_aborted;
+	struct lat_hist seq_latency;
+	uint64_t pm_sweeps;
+	struct lat_hist pm_sweep_time;
+	uint64_t pm_delta[PM_COUNTERS];
+	uint64_t sa_records;
+	uint64_t sa_bytes;
+	struct attr_stats *attr_stats;
 };
 
 struct mad_buffer {
@@ -102,16 +465,22 @@ struct mad_buffer {
 };
 
 struct mad_worker {
+	int id;
+
 	/*
 	umad params
 	*/
 	int ibd_timeout;
 	int ibd_retries;
+	int sw_timeout_ms; // 0 - derive from umad timeout and retries
+	int tool_retries; // retransmits by the tool, the kernel doesn't retry then
+	int backoff_ms; // before the first retransmit, doubled for every next one
+	int backoff_max_ms; // 0 - no limit
 
 	/*
 	mad attributes
 	*/
-	int mgmt_class; // IB_SMI_DIRECT_CLASS , IB_SMI_CLASS
+	int mgmt_class; // IB_SMI_DIRECT_CLASS , IB_SMI_CLASS , IB_PERFORMANCE_CLASS (--perfmgt) , IB_SA_CLASS (--sa)
 	int mngt_method; // 1 - Get, 2 - Set
 	int smp_attr;
 	int smp_mod;
@@ -119,8 +488,10 @@ struct mad_worker {
 	/*
 	IB Device
 	*/
+	const struct mad_transport *tr;
 	char ibd_ca[UMAD_CA_NAME_LEN];
 	int ibd_ca_port;
+	int endpoint; // index in g_endpoints
 	int mad_agent;
 	int portid;
 
@@ -128,23 +499,148 @@ struct mad_worker {
 	target devices
 	*/
 	struct mad_target *targets;
+	struct target_stats *stats;
+	struct target_hist *lat_log2;
+	struct target_status *mad_status;
+	struct target_seq *seq; // scenario runs only
+	struct target_pm *pm; // perfmgt runs only
+	uint64_t *pm_last; // [target][port][PM_COUNTERS + 1], counters of the last sweep, valid if [PM_COUNTERS]
+	uint16_t *on_wire; // mads on wire per target, < target_queue_depth
 	int n_targets;
+	int n_excluded; // excluded targets follow n_targets in targets array
+	int prefetch_us;
 	/*
 	runtime
 	*/
 	int target_queue_depth;
 	int source_queue_depth;
 	void *umad;
+	int umad_len; // mad bytes umad holds, more than IB_MAD_SIZE for RMPP responces
+	int recv_len; // of the last received mad
 	//struct mad_buffer mad;
 	int last_device;
-	int timeout_ms;
-	struct timeval start;
+	int timeout_ms; // run time, with mad_count 0 is no limit
+	struct timeval start; // end of warmup
 	struct timeval end;
 
+	/*
+	warmup, counters are reset when it is over
+	*/
+	int warmup_ms;
+	uint64_t warmup_mads; // completed mads of the worker
+	int warming;
+	int warmup_us; // how long warmup actually took
+	uint64_t warmup_completed;
+	int epoch; // 1 after warmup
+
+	/*
+	fixed count run: every target gets mad_count mads, then in-flight mads are drained
+	*/
+	uint64_t mad_count;
+	uint64_t send_limit; // mad_count once warmup is over, 0 - no limit
+	int n_counted; // targets which got all mad_count mads
+
+	/*
+	optional scenario, mad_count is then sequences per target
+	*/
+	const struct scenario *scenario;
+	int n_active_seqs;
+	uint64_t seq_completed;
+	uint64_t seq_aborted;
+	struct lat_hist seq_latency; // first send to last completion of a sequence
+
+	/*
+	optional perfmgt sweep, mad_count is then sweeps
+	*/
+	int pm_sweep; // current, from 1
+	int pm_sweep_epoch;
+	int pm_done; // targets done with the current sweep
+	struct timeval pm_sweep_start;
+	uint64_t pm_sweeps; // completed
+	struct lat_hist pm_sweep_time; // us
+	uint64_t pm_delta[PM_COUNTERS]; // of all targets
+
+	/*
+	SA responces, records and bytes of the SA data
+	*/
+	uint64_t sa_records;
+	uint64_t sa_bytes;
+	uint64_t rmpp_transfers; // responces of more than one segment
+	uint64_t rmpp_segments; // of these
+
+	/*
+	optional CC mix, see struct cc_entry
+	*/
+	uint8_t *cc_next; // entry of the next mad of a target
+	uint8_t *cc_data; // [target][g_n_cc_set][IB_CC_MGT_DATA_SIZE + 1], last byte: valid
+	struct attr_stats *attr_stats; // g_n_attr_rows, CC or class mix
+
+	/*
+	optional class mix, see struct class_entry
+	*/
+	uint8_t *mix_next; // entry of the next mad of a target
+	int agents[MAX_CLASS_AGENTS]; // [0] is mad_agent, of mgmt_class
+	uint8_t agent_class[MAX_CLASS_AGENTS];
+	int n_agents;
+	int recv_class; // of the agent the last mad arrived on
+	uint64_t agent_mismatches; // responces on another agent than their mad was sent on
+
+	/*
+	vendor specific attribute: targets are probed with NodeInfo first, those
+	which can't support it are excluded
+	*/
+	int vendor_probe;
+	int prefetching; // mads on wire are pre-fetch Gets, not workload mads
+	struct mlnx_epi *mlnx_epi;
+
+	/*
+	circuit breaker, --quarantine: a target which fails too often gets only
+	one probe mad at a time until one is answered
+	*/
+	int quarantine_pct; // 0 - off
+	int probe_ms;
+	struct target_health *health;
+	uint64_t now_us; // of the current loop, send_mads doesn't read the clock
+	uint64_t next_probe_us; // earliest probe send_mads waits for
+
 	/*
 	queue
 	*/
 	struct mad_operation *mads_on_wire;
+	int *deadline_heap; // min-heap of mads_on_wire indexes by deadline_us
+	int n_deadlines;
+	int lost_mads;
+	uint64_t stale_tids; // responces to an older generation of their slot
+	uint64_t unknown_tids; // of another worker or no slot at all
+	struct retired_mad *retired; // RETIRED_PER_SLOT per slot, by generation
+	struct lat_hist lat_late; // of late responces, from the attempt
+	struct lat_hist latency; // all completed mads
+	struct lat_hist *lat_outcome; // MAD_OUTCOMES histograms, by mad_outcome
+	uint64_t umad_status[256]; // completions by umad status
+
+	/*
+	tool retries, completed mads by the attempt they ended on
+	*/
+	uint64_t attempts[MAX_TOOL_RETRIES + 2]; // [0] is unused
+	struct lat_hist lat_first; // answered by the first attempt
+	struct lat_hist lat_retried; // answered by a retransmit, from the first send
+
+	/*
+	optional per-mad event trace
+	*/
+	struct mad_trace trace;
+
+	/*
+	optional verification of responce data against the snapshot
+	*/
+	int verify;
+	v8u64 verify_mask; // 0 bits are ignored
+
+	/*
+	optional live metrics
+	*/
+	struct mad_snapshot *snap;
+	uint64_t next_publish_us;
 };
 
 int init_mad_worker(struct mad_worker *w);
@@ -156,6 +652,8 @@ void set_lid_routet_targets(struct mad_worker *w, uint32_t *lids, int n);
 int send_mads(struct mad_worker *w);
 void report_worker_params(struct mad_worker *w, FILE *f);
 void print_statistics(struct mad_worker *workers, int nworkers, FILE *f);
+void print_json(struct mad_worker *workers, int nworkers, FILE *f);
+void print_csv(struct mad_worker *workers, int nworkers, FILE *f);
 int fetch_attribute(struct mad_worker *w);
 
 struct drsmp {
@@ -192,8 +690,6 @@ static void drsmp_get_init(void *umad, DRPath * path, int attr, int mod, int mng
 	smp->method = mngt_method;
 	smp->attr_id = htons(attr);
 	smp->attr_mod = htonl(mod);
-	smp->tid = htobe64(drmad_tid);
-	drmad_tid++;
 	smp->dr_slid = htobe16(0xffff);
 	smp->dr_dlid = htobe16(0xffff);
 
@@ -221,8 +717,6 @@ static void smp_get_init(void *umad, int lid, int attr, int mod, int mngt_method
 	smp->method = mngt_method;
 	smp->attr_id = htons(attr);
 	smp->attr_mod = htonl(mod);
-	smp->tid = htobe64(drmad_tid);
-	drmad_tid++;
 
 	if (mngt_method == mngt_method_set && data)
 		memcpy(smp->data, data, 64);
@@ -230,6 +724,115 @@ static void smp_get_init(void *umad, int lid, int attr, int mod, int mngt_method
 	umad_set_addr(umad, lid, 0, 0, 0);
 }
 
+/* PortCounters(Extended) Get of one port, GMP to QP1 */
+static void pm_get_init(void *umad, int lid, int attr, int port)
+{
+	ib_perfmgt_mad_t *pm = (ib_perfmgt_mad_t *)(umad_get_mad(umad));
+
+	memset(pm, 0, sizeof(*pm));
+
+	pm->header.base_ver = 1;
+	pm->header.mgmt_class = IB_PERFORMANCE_CLASS;
+	pm->header.class_ver = 1;
+	pm->header.method = mngt_method_get;
+	pm->header.attr_id = htons(attr);
+
+	/* port_select is at the same place in both attributes */
+	((ib_port_counters_t *)pm->data)->port_select = port;
+
+	umad_set_addr(umad, lid, 1, 0, be32toh(IB_QP1_WELL_KNOWN_Q_KEY));
+}
+
+/*
+ * SubnAdmGet(Table) of the record of lid, sent to the SM. port is the
+ * PortInfoRecord port, PathRecords are from g_sa_slid to lid.
+ */
+static void sa_get_init(void *umad, int attr, int lid, int port)
+{
+	ib_sa_mad_t *sa = (ib_sa_mad_t *)(umad_get_mad(umad));
+
+	memset(sa, 0, sizeof(*sa));
+
+	sa->base_ver = 1;
+	sa->mgmt_class = IB_SA_CLASS;
+	sa->class_ver = 2;
+	sa->method = g_sa_table ? IB_MAD_METHOD_GETTABLE : mngt_method_get;
+	sa->attr_id = htons(attr);
+
+	switch (attr) {
+	case SA_ATTR_NODE_RECORD:
+		/* a table is every node of the subnet */
+		((ib_node_record_t *)sa->data)->lid = htons(lid);
+		sa->comp_mask = g_sa_table ? 0 : IB_NR_COMPMASK_LID;
+		break;
+	case SA_ATTR_PORTINFO_RECORD:
+		/* a table is every port of lid */
+		((ib_portinfo_record_t *)sa->data)->lid = htons(lid);
+		((ib_portinfo_record_t *)sa->data)->port_num = port;
+		sa->comp_mask = g_sa_table ? IB_PIR_COMPMASK_LID : IB_PIR_COMPMASK_LID | IB_PIR_COMPMASK_PORTNUM;
+		break;
+	case SA_ATTR_PATH_RECORD:
+		((ib_path_rec_t *)sa->data)->dlid = htons(lid);
+		((ib_path_rec_t *)sa->data)->slid = htons(g_sa_slid);
+		sa->comp_mask = IB_PR_COMPMASK_DLID | IB_PR_COMPMASK_SLID;
+		break;
+	}
+
+	umad_set_addr(umad, g_sa_lid, 1, 0, be32toh(IB_QP1_WELL_KNOWN_Q_KEY));
+}
+
+/* CC class mad, data of a Set is the attribute in mgt_data */
+static void cc_init(void *umad, int lid, int attr, int mod, int method, const uint8_t *data)
+{
+	ib_cc_mad_t *cc = (ib_cc_mad_t *)(umad_get_mad(umad));
+
+	memset(cc, 0, sizeof(*cc));
+
+	cc->header.base_ver = 1;
+	cc->header.mgmt_class = IB_CC_CLASS;
+	cc->header.class_ver = 2;
+	cc->header.method = method;
+	cc->header.attr_id = htons(attr);
+	cc->header.attr_mod = htonl(mod);
+	cc->cc_key = htobe64(g_cc_key);
+
+	if (method == mngt_method_set && data)
+		memcpy(cc->mgt_data, data, IB_CC_MGT_DATA_SIZE);
+
+	umad_set_addr(umad, lid, 1, 0, be32toh(IB_QP1_WELL_KNOWN_Q_KEY));
+}
+
+/* counters of a PortCounters(Extended) responce, 32 bit ones saturate */
+static void pm_parse(int attr, const uint8_t *data, uint64_t *v)
+{
+	const ib_port_counters_ext_t *e = (const ib_port_counters_ext_t *)data;
+	const ib_port_counters_t *c = (const ib_port_counters_t *)data;
+
+	if (attr == PM_ATTR_PORT_COUNTERS_EXT) {
+		v[pm_xmit_data] = be64toh(e->xmit_data);
+		v[pm_rcv_data] = be64toh(e->rcv_data);
+		v[pm_xmit_pkts] = be64toh(e->xmit_pkts);
+		v[pm_rcv_pkts] = be64toh(e->rcv_pkts);
+		v[pm_xmit_wait] = be64toh(e->xmit_wait);
+		v[pm_symbol_errors] = be64toh(e->symbol_err_cnt);
+		v[pm_link_recovers] = be64toh(e->link_err_recover);
+		v[pm_link_downed] = be64toh(e->link_downed);
+		v[pm_rcv_errors] = be64toh(e->rcv_err);
+		v[pm_xmit_discards] = be64toh(e->xmit_discards);
+	} else {
+		v[pm_xmit_data] = be32toh(c->xmit_data);
+		v[pm_rcv_data] = be32toh(c->rcv_data);
+		v[pm_xmit_pkts] = be32toh(c->xmit_pkts);
+		v[pm_rcv_pkts] = be32toh(c->rcv_pkts);
+		v[pm_xmit_wait] = be32toh(c->xmit_wait);
+		v[pm_symbol_errors] = be16toh(c->symbol_err_cnt);
+		v[pm_link_recovers] = c->link_err_recover;
+		v[pm_link_downed] = c->link_downed;
+		v[pm_rcv_errors] = be16toh(c->rcv_err);
+		v[pm_xmit_discards] = be16toh(c->xmit_discards);
+	}
+}
+
 static int str2DRPath(char *str, DRPath * path)
 {
 	char *s;
@@ -249,15 +852,24 @@ static int str2DRPath(char *str, DRPath * path)
 	return path->hop_cnt;
 }
 
+/* comma separated list of lids and ranges: 1,4,10-20 */
 static int parseLIDs(char *str, uint32_t *lids, int n)
 {
-	char *s;
+	char *s, *end;
+	uint32_t lid, last;
 	int i = -1;
 
-	while (str && *str && i < n) {
+	while (str && *str) {
 		if ((s = strchr(str, ',')))
 			*s = 0;
-		lids[++i] = strtoul(str, NULL, 0);
+		lid = last = strtoul(str, &end, 0);
+		if (*end == '-')
+			last = strtoul(end + 1, NULL, 0);
+		for (; lid <= last; ++lid) {
+			if (i + 1 >= n)
+				return -1;
+			lids[++i] = lid;
+		}
 		if (!s)
 			break;
 		str = s + 1;
@@ -266,6 +878,31 @@ static int parseLIDs(char *str, uint32_t *lids, int n)
 	return i + 1;
 }
 
+/* <ca>:<port>[@<lids>] */
+static int parse_endpoint(char *str, struct endpoint *ep)
+{
+	char *port, *lids, *end;
+
+	if ((lids = strchr(str, '@')))
+		*lids++ = 0;
+	port = strrchr(str, ':');
+	if (!port || port == str || port - str >= UMAD_CA_NAME_LEN)
+		return -1;
+	*port++ = 0;
+	ep->port = strtoul(port, &end, 0);
+	if (*end || ep->port < 1)
+		return -1;
+	strcpy(ep->ca, str);
+
+	if (!lids)
+		return 0;
+	ep->lids = (uint32_t *)calloc(MAX_LIDS, sizeof(ep->lids[0]));
+	if (!ep->lids)
+		IBPANIC("can't allocate endpoint lids");
+	ep->n_lids = parseLIDs(lids, ep->lids, MAX_LIDS);
+	return ep->n_lids > 0 ? 0 : -1;
+}
+
 static int dump_char;
 
 static int process_opt(void *context, int ch)
@@ -306,6 +943,100 @@ static int process_opt(void *context, int ch)
 	case 'p':
 		 g_nworkers = (uint64_t) strtoull(optarg, NULL, 0);
 		break;
+	case opt_sw_timeout:
+		w->sw_timeout_ms = (uint64_t) strtoull(optarg, NULL, 0);
+		break;
+	case opt_trace:
+		g_trace_prefix = optarg;
+		break;
+	case opt_trace_size:
+		g_trace_records = (uint64_t) strtoull(optarg, NULL, 0);
+		break;
+	case opt_verify:
+		w->verify = 1;
+		break;
+	case opt_json:
+		g_json_path = optarg;
+		break;
+	case opt_csv:
+		g_csv_path = optarg;
+		break;
+	case opt_metrics:
+		g_metrics_addr = optarg;
+		break;
+	case opt_warmup:
+		w->warmup_ms = strtod(optarg, NULL) * 1000;
+		break;
+	case opt_warmup_mads:
+		w->warmup_mads = (uint64_t) strtoull(optarg, NULL, 0);
+		break;
+	case opt_count:
+		w->mad_count = (uint64_t) strtoull(optarg, NULL, 0);
+		break;
+	case opt_scenario:
+		for (w->scenario = scenarios; w->scenario->name; ++w->scenario)
+			if (!strcmp(w->scenario->name, optarg))
+				break;
+		if (!w->scenario->name)
+			IBPANIC("unknown scenario '%s'", optarg);
+		break;
+	case opt_perfmgt: {
+		uint32_t ports[PM_MAX_PORTS];
+		int i;
+
+		g_n_pm_ports = parseLIDs(optarg, ports, PM_MAX_PORTS);
+		if (g_n_pm_ports <= 0)
+			IBPANIC("bad perfmgt ports '%s'", optarg);
+		for (i = 0; i < g_n_pm_ports; ++i) {
+			if (!ports[i] || ports[i] > PM_MAX_PORTS)
+				IBPANIC("bad perfmgt port %u", ports[i]);
+			g_pm_ports[i] = ports[i];
+			g_pm_port_idx[ports[i]] = i;
+		}
+		break;
+	}
+	case opt_sa: {
+		char *end;
+
+		g_sa_lid = strtoul(optarg, &end, 0);
+		g_sa_slid = *end == ':' ? strtoul(end + 1, &end, 0) : g_sa_lid;
+		if (*end || !g_sa_lid || g_sa_lid >= 0xc000 || !g_sa_slid || g_sa_slid >= 0xc000)
+			IBPANIC("bad SA lids '%s'", optarg);
+		break;
+	}
+	case opt_sa_table:
+		g_sa_table = 1;
+		break;
+	case opt_cc:
+		g_cc = 1;
+		break;
+	case opt_cc_key:
+		g_cc_key = strtoull(optarg, NULL, 0);
+		break;
+	case opt_classes:
+		g_classes = optarg;
+		break;
+	case opt_endpoint:
+		if (g_n_endpoints == MAX_ENDPOINTS || parse_endpoint(optarg, &g_endpoints[g_n_endpoints]))
+			IBPANIC("bad endpoint '%s' or more than %d endpoints", optarg, MAX_ENDPOINTS);
+		g_n_endpoints++;
+		break;
+	case opt_tool_retries:
+		w->tool_retries = (uint64_t) strtoull(optarg, NULL, 0);
+		break;
+	case opt_quarantine:
+		if (sscanf(optarg, "%d:%d", &w->quarantine_pct, &w->probe_ms) < 1)
+			IBPANIC("bad quarantine '%s'", optarg);
+		break;
+	case opt_retry_backoff:
+		if (sscanf(optarg, "%d:%d", &w->backoff_ms, &w->backoff_max_ms) < 1)
+			IBPANIC("bad retry backoff '%s'", optarg);
+		break;
+	case opt_sim:
+		if (sim_transport_config(optarg))
+			IBPANIC("bad simulated SMA config '%s'", optarg);
+		g_transport = &sim_transport;
+		break;
 	default:
 		return -1;
 	}
@@ -318,8 +1049,15 @@ static int process_opt(void *context, int ch)
 
 int init_mad_worker(struct mad_worker *w)
 {
+	w->id = 0;
 	w->ibd_timeout = 200;
 	w->ibd_retries = 3;
+	w->sw_timeout_ms = 0;
+	w->tool_retries = 0;
+	w->backoff_ms = 0;
+	w->backoff_max_ms = 0;
+	w->quarantine_pct = 0;
+	w->probe_ms = QUARANTINE_PROBE_MS;
 	w->mgmt_class = IB_SMI_CLASS;
 	w->mngt_method = 1; // Get
 	w->smp_attr = 0;
@@ -329,34 +1067,139 @@ int init_mad_worker(struct mad_worker *w)
 	w->last_device = 0;
 
 	w->targets = NULL;
+	w->stats = NULL;
+	w->lat_log2 = NULL;
+	w->mad_status = NULL;
+	w->on_wire = NULL;
+	w->health = NULL;
 	w->n_targets = 0;
+	w->n_excluded = 0;
+	w->prefetch_us = 0;
 
 	w->ibd_ca[0] = 0;
+	w->endpoint = 0;
 	w->ibd_ca_port = 0;
 	w->portid = -1;
 
 	w->timeout_ms = 0;
+	w->warmup_ms = 0;
+	w->warmup_mads = 0;
+	w->warming = 0;
+	w->warmup_us = 0;
+	w->warmup_completed = 0;
+	w->epoch = 0;
+	w->mad_count = 0;
+	w->send_limit = 0;
+	w->n_counted = 0;
+	w->scenario = NULL;
+	w->seq = NULL;
+	w->pm = NULL;
+	w->pm_last = NULL;
+	w->cc_next = NULL;
+	w->cc_data = NULL;
+	w->attr_stats = NULL;
+	w->vendor_probe = 0;
+	w->prefetching = 0;
+	w->mlnx_epi = NULL;
+	w->mix_next = NULL;
+	w->n_agents = 0;
+	w->recv_class = 0;
+	w->agent_mismatches = 0;
+	w->stale_tids = w->unknown_tids = 0;
+	w->pm_sweep = 0;
+	w->pm_sweep_epoch = 0;
+	w->pm_done = 0;
+	w->pm_sweeps = 0;
+	lat_hist_init(&w->pm_sweep_time);
+	memset(w->pm_delta, 0, sizeof(w->pm_delta));
+	w->sa_records = w->sa_bytes = w->rmpp_transfers = w->rmpp_segments = 0;
+	w->n_active_seqs = 0;
+	w->seq_completed = 0;
+	w->seq_aborted = 0;
+	lat_hist_init(&w->seq_latency);
+
+	w->mads_on_wire = NULL;
+	w->retired = NULL;
+	w->deadline_heap = NULL;
+	memset(&w->trace, 0, sizeof(w->trace));
+	lat_hist_init(&w->latency);
+	w->lat_outcome = NULL;
+	memset(w->umad_status, 0, sizeof(w->umad_status));
+	memset(w->attempts, 0, sizeof(w->attempts));
+	lat_hist_init(&w->lat_first);
+	lat_hist_init(&w->lat_retried);
+	lat_hist_init(&w->lat_late);
+
+	w->verify = 0;
+	w->snap = NULL;
 	return 0;
 }
 
+/* one agent per class on the worker port */
+static void register_class_agent(struct mad_worker *w, int mgmt_class)
+{
+	int i, agent;
+
+	for (i = 0; i < w->n_agents; ++i)
+		if (w->agent_class[i] == mgmt_class)
+			return;
+
+	/* SA and CC are class version 2, the kernel reassembles RMPP responces of SA agents */
+	agent = w->tr->register_agent(w->portid, mgmt_class,
+				      mgmt_class == IB_SA_CLASS || mgmt_class == IB_CC_CLASS ? 2 : 1,
+				      mgmt_class == IB_SA_CLASS, NULL);
+	if (agent < 0)
+		IBPANIC("Couldn't register agent for class 0x%x", mgmt_class);
+	w->agents[w->n_agents] = agent;
+	w->agent_class[w->n_agents++] = mgmt_class;
+}
+
 int init_ib_device(struct mad_worker *w, const char *ca, int ca_port)
 {
-	if (ca)
-		strncpy(w->ibd_ca, ibd_ca,UMAD_CA_NAME_LEN -1);
-	w->ibd_ca_port = ibd_ca_port;
+	int i;
+
+	/* placed workers pass their own ibd_ca */
+	if (ca && ca != w->ibd_ca)
+		strncpy(w->ibd_ca, ca, UMAD_CA_NAME_LEN - 1);
+	w->ibd_ca_port = ca_port;
 
-	if ((w->portid = umad_open_port(ibd_ca, ibd_ca_port)) < 0)
-		IBPANIC("can't open UMAD port (%s:%d)", ibd_ca, ibd_ca_port);
+	w->tr = g_transport;
 
-	if ((w->mad_agent = umad_register(w->portid, w->mgmt_class, 1, 0, NULL)) < 0)
-		IBPANIC("Couldn't register agent for SMPs");
+	if ((w->portid = w->tr->open_port(ca, ca_port)) < 0)
+		IBPANIC("can't open UMAD port (%s:%d)", ca ? ca : "Default", ca_port);
 
-	if ( !( w->umad = umad_alloc(1, umad_size() + IB_MAD_SIZE)))
+	register_class_agent(w, w->mgmt_class);
+	for (i = 0; i < g_n_class_mix; ++i)
+		register_class_agent(w, g_class_mix[i].mgmt_class);
+	w->mad_agent = w->agents[0];
+
+	w->umad_len = g_sa_table ? RMPP_PREALLOC : IB_MAD_SIZE;
+	if ( !( w->umad = umad_alloc(1, umad_size() + w->umad_len)))
 		IBPANIC("can't alloc MAD");
 
 	w->mads_on_wire = (struct mad_operation *)calloc(1, w->source_queue_depth * sizeof(w->mads_on_wire[0]));
 	if (!w->mads_on_wire)
 		IBPANIC("Can't allocate mad queue");
+
+	w->retired = (struct retired_mad *)calloc(w->source_queue_depth * RETIRED_PER_SLOT, sizeof(w->retired[0]));
+	if (!w->retired)
+		IBPANIC("Can't allocate retired mads");
+
+	w->deadline_heap = (int *)calloc(1, w->source_queue_depth * sizeof(w->deadline_heap[0]));
+	if (!w->deadline_heap)
+		IBPANIC("Can't allocate deadline heap");
+
+	w->lat_outcome = (struct lat_hist *)calloc(MAD_OUTCOMES, sizeof(w->lat_outcome[0]));
+	if (!w->lat_outcome)
+		IBPANIC("Can't allocate latency histograms");
+	w->n_deadlines = 0;
+	w->lost_mads = 0;
+
+	if (g_trace_prefix) {
+		int rc = mad_trace_open(&w->trace, g_trace_prefix, w->id, g_trace_records);
+		if (rc)
+			IBPANIC("can't open trace file %s.%d.trace: %s", g_trace_prefix, w->id, strerror(-rc));
+	}
 	return 0;
 }
 
@@ -368,213 +1211,1732 @@ void set_lid_routet_targets(struct mad_worker *w, uint32_t *lids, int n)
 	if(!w->targets)
 		IBPANIC("can't allocate list of devices");
 
-	w->n_targets = n;
-
-	for (i = 0; i < n; ++i)
-		w->targets[i].lid = lids[i];
-}
-
-int fetch_attribute(struct mad_worker *w)
-{
-	int i, rc, length, status;
-	struct drsmp *smp;
+	if (posix_memalign((void **)&w->stats, 64, n * sizeof(w->stats[0])) ||
+	    posix_memalign((void **)&w->lat_log2, 64, n * sizeof(w->lat_log2[0])) ||
+	    posix_memalign((void **)&w->mad_status, 64, n * sizeof(w->mad_status[0])) ||
+	    posix_memalign((void **)&w->on_wire, 64, n * sizeof(w->on_wire[0])))
+		IBPANIC("can't allocate target counters");
+	memset(w->stats, 0, n * sizeof(w->stats[0]));
+	memset(w->lat_log2, 0, n * sizeof(w->lat_log2[0]));
+	memset(w->mad_status, 0, n * sizeof(w->mad_status[0]));
+	memset(w->on_wire, 0, n * sizeof(w->on_wire[0]));
+
+	if (w->scenario) {
+		w->seq = (struct target_seq *)calloc(n, sizeof(w->seq[0]));
+		if (!w->seq)
+			IBPANIC("can't allocate scenario state");
+	}
 
-	if(w->mngt_method != mngt_method_set)
-		return -1;
+	if (w->mgmt_class == IB_CC_CLASS) {
+		w->cc_next = (uint8_t *)calloc(n, sizeof(w->cc_next[0]));
+		w->cc_data = (uint8_t *)calloc((size_t)n * g_n_cc_set + 1, IB_CC_MGT_DATA_SIZE + 1);
+		w->attr_stats = (struct attr_stats *)malloc(g_n_attr_rows * sizeof(w->attr_stats[0]));
+		if (!w->cc_next || !w->cc_data || !w->attr_stats)
+			IBPANIC("can't allocate CC state");
+		memcpy(w->attr_stats, g_attr_rows, g_n_attr_rows * sizeof(w->attr_stats[0]));
+	}
 
-	for (i = 0; i < w->n_targets; i++) {
-		if (w->mgmt_class == IB_SMI_DIRECT_CLASS)
-				drsmp_get_init(w->umad, w->targets[i].path, w->smp_attr, w->smp_mod, mngt_method_get, NULL); // TODO: Fix
-			else
-				smp_get_init(w->umad, w->targets[i].lid, w->smp_attr, w->smp_mod, mngt_method_get, NULL); // Get attribute
+	if (g_n_class_mix) {
+		w->mix_next = (uint8_t *)calloc(n, sizeof(w->mix_next[0]));
+		w->attr_stats = (struct attr_stats *)malloc(g_n_attr_rows * sizeof(w->attr_stats[0]));
+		if (!w->mix_next || !w->attr_stats)
+			IBPANIC("can't allocate class mix state");
+		memcpy(w->attr_stats, g_attr_rows, g_n_attr_rows * sizeof(w->attr_stats[0]));
+	}
 
-			rc = umad_send(w->portid, w->mad_agent, w->umad, IB_MAD_SIZE, 1000, 3); // hardcoded timeout and retries. This send is only preprocessing
-			if (rc)
-				IBPANIC("send failed rc : %d", rc);
+	if (w->smp_attr == be16toh(IB_MAD_ATTR_MLNX_EXTENDED_PORT_INFO) &&
+	    (w->mgmt_class == IB_SMI_CLASS || w->mgmt_class == IB_SMI_DIRECT_CLASS)) {
+		w->mlnx_epi = (struct mlnx_epi *)calloc(n, sizeof(w->mlnx_epi[0]));
+		if (!w->mlnx_epi)
+			IBPANIC("can't allocate ext port info state");
+	}
 
-			length = IB_MAD_SIZE;
-			rc = umad_recv(w->portid, w->umad, &length, -1);
-			if (rc != w->mad_agent)
-				IBPANIC("recv error: %d %m", rc);
+	if (w->quarantine_pct) {
+		w->health = (struct target_health *)calloc(n, sizeof(w->health[0]));
+		if (!w->health)
+			IBPANIC("can't allocate target health");
+	}
 
-			status = umad_status(w->umad);
-			if (status == ETIMEDOUT)
-				IBPANIC("mad timeout");
+	if (w->mgmt_class == IB_PERFORMANCE_CLASS) {
+		w->pm = (struct target_pm *)calloc(n, sizeof(w->pm[0]));
+		w->pm_last = (uint64_t *)calloc((size_t)n * g_n_pm_ports * (PM_COUNTERS + 1), sizeof(w->pm_last[0]));
+		if (!w->pm || !w->pm_last)
+			IBPANIC("can't allocate perfmgt counters");
+	}
 
-			smp = (struct drsmp *)(umad_get_mad(w->umad));
+	w->n_targets = n;
 
-			memcpy(w->targets[i].data, smp->data, 64);
+	for (i = 0; i < n; ++i) {
+		w->targets[i].lid = lids[i];
+		if (w->seq)
+			w->seq[i].step = -1;
 	}
-
-	return 0;
 }
 
-int send_mads(struct mad_worker *w)
+static inline uint64_t timeval_to_us(const struct timeval *tv)
 {
-	int i, j, rc;
-	struct mad_target *target;
-	int idx;
-	struct drsmp *smp = (struct drsmp *)(umad_get_mad(w->umad));
+	return (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
 
-	for (i = 0; i < w->source_queue_depth; ++i) {
-		if (!w->mads_on_wire[i].tid) {
+/*
+ * Min-heap of in-flight slots ordered by software deadline.
+ * Every slot with non-zero tid is in the heap exactly once.
+ */
+static void deadline_heap_swap(struct mad_worker *w, int a, int b)
+{
+	int t = w->deadline_heap[a];
 
-			for(j = 0; j < w->n_targets; ++j) {
-				idx = (w->last_device + 1 +j) % w->n_targets;
-				target = &w->targets[idx];
-				if (target->on_wire_mads < w->target_queue_depth)
-					break;
-			}
+	w->deadline_heap[a] = w->deadline_heap[b];
+	w->deadline_heap[b] = t;
+	w->mads_on_wire[w->deadline_heap[a]].heap_idx = a;
+	w->mads_on_wire[w->deadline_heap[b]].heap_idx = b;
+}
 
-			if (j == w->n_targets)
-				continue;
+static inline uint64_t deadline_at(struct mad_worker *w, int heap_idx)
+{
+	return w->mads_on_wire[w->deadline_heap[heap_idx]].deadline_us;
+}
 
-			if (w->mgmt_class == IB_SMI_DIRECT_CLASS)
-				drsmp_get_init(w->umad, w->targets[idx].path, w->smp_attr, w->smp_mod, w->mngt_method, w->targets[idx].data); // TODO: Fix
-			else
-				smp_get_init(w->umad, w->targets[idx].lid, w->smp_attr, w->smp_mod, w->mngt_method, w->targets[idx].data);
+static void deadline_heap_up(struct mad_worker *w, int i)
+{
+	while (i > 0 && deadline_at(w, (i - 1) / 2) > deadline_at(w, i)) {
+		deadline_heap_swap(w, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
 
-			rc = umad_send(w->portid, w->mad_agent, w->umad, IB_MAD_SIZE, w->ibd_timeout, w->ibd_retries);
-			if (rc)
-				IBPANIC("send failed rc : %d", rc);
+static void deadline_heap_down(struct mad_worker *w, int i)
+{
+	int l, r, m;
 
-			gettimeofday(&w->mads_on_wire[i].start, NULL);
-			w->mads_on_wire[i].tid = smp->tid;
-			w->mads_on_wire[i].target = target;
-			w->last_device = idx;
-			target->on_wire_mads++;
-			target->send_mads++;
-		}
+	while (1) {
+		l = 2 * i + 1;
+		r = l + 1;
+		m = i;
+		if (l < w->n_deadlines && deadline_at(w, l) < deadline_at(w, m))
+			m = l;
+		if (r < w->n_deadlines && deadline_at(w, r) < deadline_at(w, m))
+			m = r;
+		if (m == i)
+			break;
+		deadline_heap_swap(w, i, m);
+		i = m;
 	}
-	return 0;
 }
 
-inline float timedifference_msec(struct timeval t0, struct timeval t1)
+static void deadline_heap_push(struct mad_worker *w, int slot)
 {
-    return (t1.tv_sec - t0.tv_sec) * 1000.0f + (t1.tv_usec - t0.tv_usec) / 1000.0f;
+	int i = w->n_deadlines++;
+
+	w->deadline_heap[i] = slot;
+	w->mads_on_wire[slot].heap_idx = i;
+	deadline_heap_up(w, i);
 }
 
-inline int timedifference_usec(struct timeval t0, struct timeval t1)
+static void deadline_heap_remove(struct mad_worker *w, int slot)
 {
-	return timedifference_msec(t0, t1) * 1000;
+	int i = w->mads_on_wire[slot].heap_idx;
+	int last = --w->n_deadlines;
+
+	if (i != last) {
+		deadline_heap_swap(w, i, last);
+		deadline_heap_down(w, i);
+		deadline_heap_up(w, i);
+	}
 }
 
-inline float timedifference_sec(struct timeval t0, struct timeval t1)
+static void release_mad(struct mad_worker *w, int slot)
 {
-	return timedifference_msec(t0, t1) / 1000;
+	struct mad_operation *op = &w->mads_on_wire[slot];
+	struct retired_mad *r = &w->retired[slot * RETIRED_PER_SLOT + op->gen % RETIRED_PER_SLOT];
+
+	r->tid = (uint32_t)be64toh(op->tid);
+	r->target = op->target;
+	r->start_us = timeval_to_us(&op->attempt_start);
+	r->answered = op->answered;
+	op->answered = 0;
+
+	deadline_heap_remove(w, slot);
+	w->on_wire[op->target]--;
+	op->tid = 0;
+	op->target = -1;
 }
 
-
-int process_mads(struct mad_worker *w)
+static inline void trace_mad(struct mad_worker *w, int event, const struct mad_operation *op,
+			     const struct timeval *ts, int latency, int status, uint16_t mad_status)
 {
-	float time_left_ms;
-	struct timeval current;
-	int i, rc ,status, length;
-	be64_t tid;
-	int latency;
-	struct mad_target *target;
+	struct mad_trace_rec r;
+
+	if (!w->trace.hdr)
+		return;
+
+	r.ts_us = timeval_to_us(ts);
+	r.tid = (uint32_t)be64toh(op->tid);
+	r.latency_us = latency;
+	r.attr_mod = op->mod;
+	r.lid = w->targets[op->target].lid;
+	r.attr = op->attr;
+	r.queue = w->n_deadlines;
+	r.mad_status = mad_status;
+	r.event = event;
+	r.status = status;
+	r.mgmt_class = op->mgmt_class;
+	r.method = op->method;
+	mad_trace_append(&w->trace, &r);
+}
+
+static void resend_mad(struct mad_worker *w, int slot);
+static void seq_mad_done(struct mad_worker *w, int t, int outcome, const uint8_t *data, const struct timeval *now);
+static void pm_mad_done(struct mad_worker *w, int t, int port, const uint8_t *data, const struct timeval *now);
+static void cc_mad_done(struct mad_worker *w, int t, const struct mad_operation *op, int outcome,
+			const uint8_t *mad, uint32_t latency, int counted);
+static void account_attr(struct mad_worker *w, const struct mad_operation *op, int outcome, uint32_t latency);
+
+/*
+ * Every HEALTH_WINDOW completions a target is quarantined when at least
+ * quarantine_pct % of them failed. A quarantined target gets a probe every
+ * probe_ms once its mads on wire are drained, the first answered probe
+ * ends the quarantine. Other completions don't count while quarantined.
+ */
+static void health_done(struct mad_worker *w, const struct mad_operation *op, int outcome, const struct timeval *now)
+{
+	struct target_health *h = &w->health[op->target];
+	int failed = outcome == mad_outcome_timeout || outcome == mad_outcome_error || outcome == mad_outcome_busy;
+
+	if (h->quarantined) {
+		if (op->probe && !failed) {
+			h->quarantined = 0;
+			h->quarantined_us += timeval_to_us(now) - h->since_us;
+		}
+		return;
+	}
+
+	h->done++;
+	h->failed += failed;
+	if (h->done < HEALTH_WINDOW)
+		return;
+	if (h->failed * 100 >= w->quarantine_pct * h->done) {
+		h->quarantined = 1;
+		h->quarantines++;
+		h->since_us = timeval_to_us(now);
+		h->probe_us = h->since_us + w->probe_ms * 1000ULL;
+	}
+	h->done = h->failed = 0;
+}
+
+/* open quarantines are counted up to now, at the end of warmup and of the run */
+static void health_cut(struct mad_worker *w, const struct timeval *now)
+{
+	int i;
+
+	for (i = 0; i < w->n_targets; ++i)
+		if (w->health[i].quarantined) {
+			w->health[i].quarantined_us += timeval_to_us(now) - w->health[i].since_us;
+			w->health[i].since_us = timeval_to_us(now);
+		}
+}
+
+/*
+ * Reclaim slots whose responce was never delivered by the driver,
+ * retransmit mads whose retry backoff is over.
+ * Returns number of ms until the next deadline, -1 if nothing is on wire.
+ */
+static int reclaim_lost_mads(struct mad_worker *w, const struct timeval *now)
+{
+	uint64_t now_us = timeval_to_us(now);
+	struct mad_operation *op;
+	int slot;
+
+	while (w->n_deadlines) {
+		slot = w->deadline_heap[0];
+		op = &w->mads_on_wire[slot];
+		if (op->deadline_us > now_us)
+			return (op->deadline_us - now_us + 999) / 1000;
+
+		if (op->retry_pending) {
+			resend_mad(w, slot);
+			continue;
+		}
+
+		trace_mad(w, mad_trace_lost, op, now, timedifference_usec(op->start, *now), ETIMEDOUT, 0);
+		if (op->epoch == w->epoch) {
+			w->stats[op->target].lost++;
+			w->lost_mads++;
+		}
+		/* a lost pre-fetch Get only excludes its target */
+		if (w->prefetching) {
+			release_mad(w, slot);
+			continue;
+		}
+		if (w->health)
+			health_done(w, op, mad_outcome_timeout, now);
+		if (w->seq)
+			seq_mad_done(w, op->target, mad_outcome_timeout, NULL, now);
+		if (w->pm)
+			pm_mad_done(w, op->target, op->mod, NULL, now);
+		if (w->cc_next)
+			cc_mad_done(w, op->target, op, mad_outcome_timeout, NULL,
+				    timedifference_usec(op->start, *now), op->epoch == w->epoch);
+		if (w->mix_next && op->epoch == w->epoch)
+			account_attr(w, op, mad_outcome_timeout, timedifference_usec(op->start, *now));
+		release_mad(w, slot);
+	}
+
+	return -1;
+}
+
+/* ms until the earliest deadline in the heap, -1 if nothing is on wire */
+static inline int next_deadline(const struct mad_worker *w, uint64_t now_us)
+{
+	uint64_t d;
+
+	if (!w->n_deadlines)
+		return -1;
+	d = w->mads_on_wire[w->deadline_heap[0]].deadline_us;
+	return d > now_us ? (d - now_us + 999) / 1000 : 0;
+}
+
+static void init_verify_mask(struct mad_worker *w)
+{
+	uint8_t mask[64];
+	const struct volatile_field *f;
+	int i;
+
+	memset(mask, 0xff, sizeof(mask));
+	for (f = volatile_fields; f->len; ++f)
+		if (f->attr == w->smp_attr)
+			for (i = f->offset; i < f->offset + f->len; ++i)
+				mask[i] &= ~f->bits;
+
+	memcpy(&w->verify_mask, mask, sizeof(mask));
+}
+
+/* compare 64 bytes of responce data to the snapshot, ignoring volatile bits */
+static inline int verify_data(const struct mad_worker *w, const uint8_t *data, const uint8_t *expected)
+{
+	v8u64 a, b, d;
+
+	memcpy(&a, data, sizeof(a));
+	memcpy(&b, expected, sizeof(b));
+	d = (a ^ b) & w->verify_mask;
+
+	return !!(d[0] | d[1] | d[2] | d[3] | d[4] | d[5] | d[6] | d[7]);
+}
+
+static void report_mismatch(const struct mad_worker *w, int t, const uint8_t *data, const uint8_t *expected)
+{
+	const uint8_t *mask = (const uint8_t *)&w->verify_mask;
+	const struct mad_target *target = &w->targets[t];
+	uint64_t mismatches = w->stats[t].mismatches;
+	int i;
+
+	if (mismatches > MAX_LOGGED_MISMATCHES)
+		return;
+
+	for (i = 0; i < 64; ++i)
+		if ((data[i] ^ expected[i]) & mask[i])
+			break;
+
+	IBWARN("lid %d attr 0x%x: responce data differs from snapshot at byte %d: expected 0x%02x got 0x%02x%s",
+	       target->lid, w->smp_attr, i, expected[i], data[i],
+	       mismatches == MAX_LOGGED_MISMATCHES ? " , not logging more mismatches for this target" : "");
+}
+
+/* agent registered for mgmt_class, mad_agent if there is none */
+static inline int class_agent(const struct mad_worker *w, int mgmt_class)
+{
+	int i;
+
+	for (i = 0; i < w->n_agents; ++i)
+		if (w->agent_class[i] == mgmt_class)
+			return w->agents[i];
+	return w->mad_agent;
+}
+
+static inline uint32_t mad_tid(const struct mad_worker *w, int slot, int gen)
+{
+	return (uint32_t)gen << (TID_WORKER_BITS + TID_SLOT_BITS) | w->id << TID_SLOT_BITS | slot;
+}
+
+/*
+ * Build and send mad for target using free slot of mads_on_wire.
+ * The slot is released by release_mad or reclaimed by reclaim_lost_mads.
+ */
+static void post_class_mad(struct mad_worker *w, int slot, int t, int mgmt_class, int attr, int mod, int method,
+			   uint8_t *data, int timeout_ms, int retries, int sw_timeout_ms)
+{
+	struct mad_operation *op = &w->mads_on_wire[slot];
 	struct drsmp *smp = (struct drsmp *)(umad_get_mad(w->umad));
+	struct mad_target *target = &w->targets[t];
+	int rc;
+
+	if (mgmt_class == IB_SMI_DIRECT_CLASS)
+		drsmp_get_init(w->umad, target->path ? target->path : &g_local_path, attr, mod, method, data); // TODO: Fix
+	else if (mgmt_class == IB_PERFORMANCE_CLASS)
+		pm_get_init(w->umad, target->lid, attr, mod);
+	else if (mgmt_class == IB_SA_CLASS)
+		sa_get_init(w->umad, attr, target->lid, mod);
+	else if (mgmt_class == IB_CC_CLASS)
+		cc_init(w->umad, target->lid, attr, mod, method, data);
+	else
+		smp_get_init(w->umad, target->lid, attr, mod, method, data);
+
+	/* never 0, a free slot has tid 0 */
+	op->gen = (op->gen & TID_GEN_MASK) + 1;
+	if (op->gen > TID_GEN_MASK)
+		op->gen = 1;
+	smp->tid = htobe64(mad_tid(w, slot, op->gen));
+
+	rc = w->tr->send(w->portid, class_agent(w, mgmt_class), w->umad, IB_MAD_SIZE, timeout_ms, retries);
+	if (rc)
+		IBPANIC("send failed rc : %d", rc);
+
+	gettimeofday(&op->start, NULL);
+	op->attempt_start = op->start;
+	op->attempt = 1;
+	op->retry_pending = 0;
+	op->probe = 0;
+	op->epoch = w->epoch;
+	op->mgmt_class = mgmt_class;
+	op->attr = attr;
+	op->mod = mod;
+	op->method = method;
+	op->data = data;
+	op->tid = smp->tid;
+	op->target = t;
+	op->deadline_us = timeval_to_us(&op->start) + sw_timeout_ms * 1000ULL;
+	deadline_heap_push(w, slot);
+	w->on_wire[t]++;
+}
+
+static inline void post_mad(struct mad_worker *w, int slot, int t, int attr, int mod, int method, uint8_t *data,
+			    int timeout_ms, int retries, int sw_timeout_ms)
+{
+	post_class_mad(w, slot, t, w->mgmt_class, attr, mod, method, data, timeout_ms, retries, sw_timeout_ms);
+}
+
+/* next attempt of a mad, same slot and target credit, new tid */
+static void resend_mad(struct mad_worker *w, int slot)
+{
+	struct mad_operation *op = &w->mads_on_wire[slot];
+	struct timeval start = op->start;
+	int t = op->target, attempt = op->attempt, epoch = op->epoch, probe = op->probe;
+
+	release_mad(w, slot);
+	post_class_mad(w, slot, t, op->mgmt_class, op->attr, op->mod, op->method, op->data, w->ibd_timeout, 0, w->sw_timeout_ms);
+	op->start = start;
+	op->attempt = attempt + 1;
+	op->epoch = epoch;
+	op->probe = probe;
+}
+
+/*
+ * An attempt timed out and the tool has retries left for the mad:
+ * retransmit it now, or park the slot in the deadline heap until the
+ * backoff is over.
+ */
+static void retry_mad(struct mad_worker *w, int slot, const struct timeval *now)
+{
+	struct mad_operation *op = &w->mads_on_wire[slot];
+	uint64_t backoff_ms = (uint64_t)w->backoff_ms << (op->attempt - 1);
+
+	if (w->backoff_max_ms && backoff_ms > w->backoff_max_ms)
+		backoff_ms = w->backoff_max_ms;
+
+	trace_mad(w, mad_trace_retry, op, now, timedifference_usec(op->attempt_start, *now), ETIMEDOUT, 0);
+	w->mad_status[op->target].retransmits++;
+
+	if (!backoff_ms) {
+		resend_mad(w, slot);
+		return;
+	}
+
+	deadline_heap_remove(w, slot);
+	op->retry_pending = 1;
+	op->deadline_us = timeval_to_us(now) + backoff_ms * 1000;
+	deadline_heap_push(w, slot);
+}
+
+/* a reassembled RMPP responce is larger than umad, grow it, the responce stays queued */
+static void grow_umad(struct mad_worker *w, int length)
+{
+	while (w->umad_len < length)
+		w->umad_len *= 2;
+	umad_free(w->umad);
+	if (!(w->umad = umad_alloc(1, umad_size() + w->umad_len)))
+		IBPANIC("can't alloc %d bytes MAD", w->umad_len);
+}
+
+/*
+ * A responce to a mad which already left its slot: late when the mad timed
+ * out or was reclaimed, a duplicate when it was answered. A kernel timeout
+ * of a reclaimed mad or a mad older than RETIRED_PER_SLOT is only stale.
+ */
+static void retired_responce(struct mad_worker *w, int slot, uint32_t tid, int status, const struct timeval *now)
+{
+	struct retired_mad *r = &w->retired[slot * RETIRED_PER_SLOT +
+					    (tid >> (TID_WORKER_BITS + TID_SLOT_BITS)) % RETIRED_PER_SLOT];
+
+	if (status || r->tid != tid) {
+		w->stale_tids++;
+		return;
+	}
+	if (r->answered) {
+		w->mad_status[r->target].duplicates++;
+		return;
+	}
+	r->answered = 1;
+	w->mad_status[r->target].late++;
+	lat_hist_add(&w->lat_late, timeval_to_us(now) - r->start_us);
+}
+
+/*
+ * Receive one mad. Returns index of its slot in mads_on_wire,
+ * -1 if tid is unknown.
+ * umad may move, pointers into it are not valid after.
+ */
+static int recv_mad(struct mad_worker *w, int *status, struct timeval *now)
+{
+	struct drsmp *smp;
+	int i, rc, length, slot;
+	uint32_t tid;
+
+	do {
+		length = w->umad_len;
+		rc = w->tr->recv(w->portid, w->umad, &length, -1);
+		if (rc == -ENOSPC)
+			grow_umad(w, length);
+	} while (rc == -ENOSPC);
+	if (rc < 0)
+		IBPANIC("recv error: %d %m", rc);
+	for (i = 0; i < w->n_agents && w->agents[i] != rc; ++i)
+		;
+	if (i == w->n_agents)
+		IBPANIC("recv on unknown agent %d", rc);
+	w->recv_class = w->agent_class[i];
+
+	smp = (struct drsmp *)(umad_get_mad(w->umad));
+	w->recv_len = length;
+
+	gettimeofday(now, NULL);
+	*status = umad_status(w->umad);
+
+	tid = (uint32_t)be64toh(smp->tid);
+	slot = tid & ((1 << TID_SLOT_BITS) - 1);
+
+	if (slot >= w->source_queue_depth || (tid >> TID_SLOT_BITS & ((1 << TID_WORKER_BITS) - 1)) != w->id) {
+		w->unknown_tids++;
+		IBWARN("tid 0x%x is not found", tid);
+		return -1;
+	}
+	/* the slot was reclaimed or retransmitted since */
+	if ((uint32_t)be64toh(w->mads_on_wire[slot].tid) != tid) {
+		retired_responce(w, slot, tid, *status, now);
+		return -1;
+	}
+	if (w->mads_on_wire[slot].mgmt_class != w->recv_class) {
+		w->agent_mismatches++;
+		IBWARN("tid 0x%x of class 0x%x arrived on the agent of class 0x%x", tid,
+		       w->mads_on_wire[slot].mgmt_class, w->recv_class);
+		return -1;
+	}
+	if (!*status)
+		w->mads_on_wire[slot].answered = 1;
+	return slot;
+}
+
+static inline int prefetch_needed(const struct mad_worker *w)
+{
+	return w->mngt_method == mngt_method_set || w->verify || w->vendor_probe;
+}
+
+/*
+ * Get attr of every target which is not excluded yet. Get mads are pipelined
+ * through mads_on_wire like in the main loop, one mad per target. done gets
+ * the umad status, or negative MAD status, and data of every responce.
+ * Targets which don't answer at all are excluded.
+ */
+static void prefetch_targets(struct mad_worker *w, int attr, int mod,
+			     void (*done)(struct mad_worker *w, struct mad_target *target, int status, const uint8_t *data))
+{
+	struct drsmp *smp;
+	struct timeval current;
+	int i, n = 0, rc, status, slot, next = 0, done_n = 0, lost = 0, next_deadline_ms, lost_at_start = w->lost_mads;
+	int sw_timeout_ms = PREFETCH_TIMEOUT_MS * (PREFETCH_RETRIES + 1) + SW_TIMEOUT_SLACK_MS;
+
+	for (i = 0; i < w->n_targets; ++i)
+		n += !w->targets[i].excluded;
+
+	w->prefetching = 1;
+	while (done_n + lost < n) {
+		gettimeofday(&current, NULL);
+
+		next_deadline_ms = reclaim_lost_mads(w, &current);
+
+		for (i = 0; i < w->source_queue_depth; ++i) {
+			while (next < w->n_targets && w->targets[next].excluded)
+				next++;
+			if (next == w->n_targets)
+				break;
+			if (w->mads_on_wire[i].tid)
+				continue;
+			post_mad(w, i, next, attr, mod, mngt_method_get, w->targets[next].data,
+				 PREFETCH_TIMEOUT_MS, PREFETCH_RETRIES, sw_timeout_ms);
+			next++;
+		}
+
+		lost = w->lost_mads - lost_at_start;
+		if (done_n + lost == n)
+			break;
+
+		rc = w->tr->poll(w->portid, next_deadline_ms >= 0 ? next_deadline_ms : sw_timeout_ms);
+		if (rc == -ETIMEDOUT)
+			continue;
+		else if (rc)
+			IBPANIC("umad_poll failed: %d %m", rc);
+
+		slot = recv_mad(w, &status, &current);
+		if (slot < 0)
+			continue;
+		smp = (struct drsmp *)(umad_get_mad(w->umad));
+
+		if (!status && (ntohs(smp->status) & MAD_STATUS_MASK))
+			status = -(int)(ntohs(smp->status) & MAD_STATUS_MASK);
+		done(w, &w->targets[w->mads_on_wire[slot].target], status, smp->data);
 
-	if(w->mngt_method == mngt_method_set) {
+		release_mad(w, slot);
+		done_n++;
+	}
+	w->prefetching = 0;
+
+	for (i = 0; i < w->n_targets; ++i)
+		if (w->stats[i].lost && !w->targets[i].excluded) {
+			w->targets[i].excluded = 1;
+			w->targets[i].prefetch_status = ETIMEDOUT;
+		}
+}
+
+static void prefetch_done(struct mad_worker *w, struct mad_target *target, int status, const uint8_t *data)
+{
+	target->prefetch_status = status;
+	if (!status)
+		memcpy(target->data, data, 64);
+	else
+		target->excluded = 1;
+}
+
+/* NodeInfo tells the device, only known devices implement a vendor attribute */
+static void probe_done(struct mad_worker *w, struct mad_target *target, int status, const uint8_t *data)
+{
+	const ib_node_info_t *ni = (const ib_node_info_t *)data;
+
+	if (status) {
+		target->prefetch_status = status;
+		target->excluded = 1;
+		return;
+	}
+
+	target->vendor_id = be32toh(ib_node_info_get_vendor_id(ni));
+	target->device_id = be16toh(ni->device_id);
+	if (w->mlnx_epi && !is_mlnx_ext_port_info_supported(target->vendor_id, target->device_id)) {
+		target->prefetch_status = ENOTSUP;
+		target->excluded = 1;
+	}
+}
+
+/*
+ * Snapshot attribute of every target, after the NodeInfo probe of a vendor
+ * attribute. Targets which don't answer or answer with an error are
+ * excluded from the run.
+ */
+int fetch_attribute(struct mad_worker *w)
+{
+	struct timeval start, current;
+	int i, n;
+
+	if (!prefetch_needed(w))
+		return -1;
+
+	gettimeofday(&start, NULL);
+
+	if (w->vendor_probe)
+		prefetch_targets(w, SMP_ATTR_NODE_INFO, 0, probe_done);
+	prefetch_targets(w, w->smp_attr, w->smp_mod, prefetch_done);
+
+	/* move excluded targets to the end, they are reported but never scheduled */
+	for (i = 0, n = 0; i < w->n_targets; ++i) {
+		if (!w->targets[i].excluded) {
+			if (i != n) {
+				struct mad_target t = w->targets[n];
+				w->targets[n] = w->targets[i];
+				w->targets[i] = t;
+			}
+			n++;
+		}
+	}
+	w->n_excluded = w->n_targets - n;
+	w->n_targets = n;
+	memset(w->retired, 0, w->source_queue_depth * RETIRED_PER_SLOT * sizeof(w->retired[0]));
+	if (w->health)
+		memset(w->health, 0, (w->n_targets + w->n_excluded) * sizeof(w->health[0]));
+
+	/* pre-fetch mads are not part of the run, everything is released */
+	memset(w->stats, 0, (w->n_targets + w->n_excluded) * sizeof(w->stats[0]));
+
+	gettimeofday(&current, NULL);
+	w->prefetch_us = timedifference_usec(start, current);
+
+	for (i = n; i < n + w->n_excluded; ++i)
+		if (w->targets[i].prefetch_status == ENOTSUP)
+			IBWARN("lid %d is excluded, device 0x%x of vendor 0x%x doesn't support attr 0x%x", w->targets[i].lid,
+			       w->targets[i].device_id, w->targets[i].vendor_id, w->smp_attr);
+		else
+			IBWARN("lid %d is excluded, attr 0x%x pre-fetch failed, status %d", w->targets[i].lid, w->smp_attr, w->targets[i].prefetch_status);
+
+	return 0;
+}
+
+static void mlnx_epi_decode(struct mlnx_epi *e, const uint8_t *data)
+{
+	const ib_mlnx_ext_port_info_t *epi = (const ib_mlnx_ext_port_info_t *)data;
+
+	if (e->valid && (e->state_change_enable != epi->state_change_enable ||
+			 e->link_speed_supported != epi->link_speed_supported ||
+			 e->link_speed_enabled != epi->link_speed_enabled ||
+			 e->link_speed_active != epi->link_speed_active))
+		e->changes++;
+	e->state_change_enable = epi->state_change_enable;
+	e->link_speed_supported = epi->link_speed_supported;
+	e->link_speed_enabled = epi->link_speed_enabled;
+	e->link_speed_active = epi->link_speed_active;
+	e->valid = 1;
+}
+
+/*
+ * Scenario engine, see struct scenario
+ */
+static void seq_start_step(struct mad_worker *w, struct target_seq *q)
+{
+	const struct seq_step *step = &w->scenario->steps[q->step];
+
+	q->next_mod = 1;
+	q->pending = step->mod == seq_mod_ports ? q->data[3] : 1; // NodeInfo.NumPorts
+}
+
+static void seq_end(struct mad_worker *w, int t, const struct timeval *now)
+{
+	struct target_seq *q = &w->seq[t];
+
+	if (q->epoch == w->epoch) {
+		if (q->failed) {
+			q->aborted++;
+			w->seq_aborted++;
+		} else {
+			q->completed++;
+			w->seq_completed++;
+			lat_hist_add(&w->seq_latency, timedifference_usec(q->start, *now));
+		}
+	}
+	q->step = -1;
+	w->n_active_seqs--;
+}
+
+/* a mad of the current step of target t is over, data - its responce, NULL if none */
+static void seq_mad_done(struct mad_worker *w, int t, int outcome, const uint8_t *data, const struct timeval *now)
+{
+	struct target_seq *q = &w->seq[t];
+	const struct seq_step *step = &w->scenario->steps[q->step];
+
+	q->in_flight--;
+	if (outcome != mad_outcome_ok) {
+		q->failed = 1;
+	} else if (step->check && verify_data(w, data, q->data)) {
+		q->failed = 1;
+		if (q->epoch == w->epoch) {
+			report_mismatch(w, t, data, q->data);
+			w->stats[t].mismatches++;
+		}
+	} else if (step->method == mngt_method_get && step->mod == seq_mod_fixed) {
+		memcpy(q->data, data, 64);
+	}
+
+	if (q->in_flight || (q->pending && !q->failed))
+		return;
+
+	/* the step is over, steps without mads (no ports) are skipped */
+	while (!q->failed && ++q->step < w->scenario->n_steps) {
+		seq_start_step(w, q);
+		if (q->pending)
+			return;
+	}
+	seq_end(w, t, now);
+}
+
+/* target t has a mad to send: next mad of its step, or a new sequence */
+static inline int seq_ready(const struct mad_worker *w, int t)
+{
+	const struct target_seq *q = &w->seq[t];
+
+	if (q->step < 0)
+		return !w->send_limit || q->started < w->send_limit;
+	return q->pending && !q->failed;
+}
+
+static void seq_post(struct mad_worker *w, int slot, int t)
+{
+	struct target_seq *q = &w->seq[t];
+	const struct seq_step *step;
+	int start = q->step < 0;
+
+	if (start) {
+		q->step = 0;
+		q->failed = 0;
+		q->epoch = w->epoch;
+		seq_start_step(w, q);
+		if (++q->started == w->send_limit)
+			w->n_counted++;
+		w->n_active_seqs++;
+	}
+
+	step = &w->scenario->steps[q->step];
+	post_mad(w, slot, t, step->attr ? step->attr : w->smp_attr,
+		 step->mod == seq_mod_ports ? q->next_mod++ : w->smp_mod, step->method, q->data,
+		 w->ibd_timeout, w->ibd_retries, w->sw_timeout_ms);
+	q->pending--;
+	q->in_flight++;
+	if (start)
+		q->start = w->mads_on_wire[slot].start;
+	/* mads of a sequence started in warmup are warmup mads */
+	w->mads_on_wire[slot].epoch = q->epoch;
+}
+
+/*
+ * PerfMgt sweep engine, see struct target_pm
+ */
+static void pm_start_sweep(struct mad_worker *w, const struct timeval *now)
+{
+	int i;
+
+	w->pm_sweep++;
+	w->pm_sweep_epoch = w->epoch;
+	w->pm_sweep_start = *now;
+	w->pm_done = 0;
+	for (i = 0; i < w->n_targets; ++i) {
+		w->pm[i].sweep = w->pm_sweep;
+		w->pm[i].next_port = 0;
+	}
+}
+
+static void pm_end_sweep(struct mad_worker *w, const struct timeval *now)
+{
+	if (w->pm_sweep_epoch == w->epoch) {
+		w->pm_sweeps++;
+		lat_hist_add(&w->pm_sweep_time, timedifference_usec(w->pm_sweep_start, *now));
+		if (w->pm_sweeps == w->send_limit) {
+			w->n_counted = w->n_targets; // no more sweeps, drain
+			return;
+		}
+	}
+	pm_start_sweep(w, now);
+}
+
+/* Get of port of target t is over, data - the responce, NULL if none */
+static void pm_mad_done(struct mad_worker *w, int t, int port, const uint8_t *data, const struct timeval *now)
+{
+	struct target_pm *pm = &w->pm[t];
+	uint64_t *last = &w->pm_last[((size_t)t * g_n_pm_ports + g_pm_port_idx[port]) * (PM_COUNTERS + 1)];
+	uint64_t v[PM_COUNTERS], d;
+	int i;
+
+	if (data) {
+		pm_parse(w->smp_attr, data, v);
+		/* a sweep started in warmup only sets the base for the next one */
+		for (i = 0; last[PM_COUNTERS] && w->pm_sweep_epoch == w->epoch && i < PM_COUNTERS; ++i) {
+			/* counters only go back when somebody cleared them */
+			d = v[i] >= last[i] ? v[i] - last[i] : v[i];
+			pm->delta[i] += d;
+			w->pm_delta[i] += d;
+		}
+		memcpy(last, v, sizeof(v));
+		last[PM_COUNTERS] = 1;
+	}
+
+	pm->in_flight--;
+	if (pm->in_flight || pm->next_port < g_n_pm_ports || pm->sweep != w->pm_sweep)
+		return;
+
+	pm->sweep = 0;
+	if (++w->pm_done == w->n_targets)
+		pm_end_sweep(w, now);
+}
+
+static inline int pm_ready(const struct mad_worker *w, int t)
+{
+	return w->pm[t].sweep == w->pm_sweep && w->pm[t].next_port < g_n_pm_ports && w->n_counted < w->n_targets;
+}
+
+static void pm_post(struct mad_worker *w, int slot, int t)
+{
+	struct target_pm *pm = &w->pm[t];
+
+	post_mad(w, slot, t, w->smp_attr, g_pm_ports[pm->next_port++], mngt_method_get, NULL,
+		 w->ibd_timeout, w->ibd_retries, w->sw_timeout_ms);
+	pm->in_flight++;
+}
+
+/*
+ * CC mix, see struct cc_entry
+ */
+static inline uint8_t *cc_set_data(struct mad_worker *w, int t, int set_idx)
+{
+	return &w->cc_data[((size_t)t * g_n_cc_set + set_idx) * (IB_CC_MGT_DATA_SIZE + 1)];
+}
+
+static void cc_post(struct mad_worker *w, int slot, int t)
+{
+	const struct cc_entry *e = &g_cc_mix[w->cc_next[t]];
+	int method = e->method;
+	uint8_t *data = NULL;
+
+	if (++w->cc_next[t] == g_n_cc_mix)
+		w->cc_next[t] = 0;
+
+	if (e->set_idx >= 0) {
+		data = cc_set_data(w, t, e->set_idx);
+		if (!data[IB_CC_MGT_DATA_SIZE])
+			method = mngt_method_get; // nothing to write back yet
+	}
+	post_mad(w, slot, t, e->attr, w->smp_mod, method, data, w->ibd_timeout, w->ibd_retries, w->sw_timeout_ms);
+}
+
+/* counters of the row of the mad, every row of a mix is in attr_stats */
+static void account_attr(struct mad_worker *w, const struct mad_operation *op, int outcome, uint32_t latency)
+{
+	struct attr_stats *a = w->attr_stats, *end = w->attr_stats + g_n_attr_rows;
+
+	while (a < end && (a->mgmt_class != op->mgmt_class || a->attr != op->attr || a->method != op->method))
+		a++;
+	if (a == end)
+		return;
+	if (outcome == mad_outcome_ok)
+		a->ok++;
+	else if (outcome == mad_outcome_timeout)
+		a->timeouts++;
+	else
+		a->errors++;
+	lat_hist_add(&a->latency, latency);
+}
+
+/* a CC mad of target t completed, counted is 0 for warmup mads */
+static void cc_mad_done(struct mad_worker *w, int t, const struct mad_operation *op, int outcome,
+			const uint8_t *mad, uint32_t latency, int counted)
+{
+	int i;
+
+	if (outcome == mad_outcome_ok && op->method == mngt_method_get)
+		for (i = 0; i < g_n_cc_mix; ++i)
+			if (g_cc_mix[i].set_idx >= 0 && g_cc_mix[i].attr == op->attr) {
+				memcpy(cc_set_data(w, t, g_cc_mix[i].set_idx), mad + CC_DATA_OFFSET, IB_CC_MGT_DATA_SIZE);
+				cc_set_data(w, t, g_cc_mix[i].set_idx)[IB_CC_MGT_DATA_SIZE] = 1;
+			}
+
+	if (counted)
+		account_attr(w, op, outcome, latency);
+}
+
+/*
+ * Class mix workload, see struct class_entry
+ */
+static void mix_post(struct mad_worker *w, int slot, int t)
+{
+	const struct class_entry *e = &g_class_mix[w->mix_next[t]];
+
+	if (++w->mix_next[t] == g_n_class_mix)
+		w->mix_next[t] = 0;
+	post_class_mad(w, slot, t, e->mgmt_class, e->attr, e->mod, mngt_method_get, NULL,
+		       w->ibd_timeout, w->ibd_retries, w->sw_timeout_ms);
+}
+
+/* a quarantined target gets one probe at a time, every probe_ms */
+static inline int health_ready(struct mad_worker *w, int t)
+{
+	const struct target_health *h = &w->health[t];
+
+	if (!h->quarantined)
+		return 1;
+	if (w->on_wire[t])
+		return 0;
+	if (h->probe_us > w->now_us) {
+		if (h->probe_us < w->next_probe_us)
+			w->next_probe_us = h->probe_us;
+		return 0;
+	}
+	return 1;
+}
+
+int send_mads(struct mad_worker *w)
+{
+	int i, j;
+	int idx;
+
+	if (!w->n_targets)
+		return 0;
+	w->next_probe_us = UINT64_MAX;
+
+	for (i = 0; i < w->source_queue_depth; ++i) {
+		if (!w->mads_on_wire[i].tid) {
+
+			idx = w->last_device;
+			for(j = 0; j < w->n_targets; ++j) {
+				if (++idx == w->n_targets)
+					idx = 0;
+				if (w->on_wire[idx] < w->target_queue_depth &&
+				    (!w->health || health_ready(w, idx)) &&
+				    (w->seq ? seq_ready(w, idx) : w->pm ? pm_ready(w, idx) :
+				     !w->send_limit || w->stats[idx].send_mads < w->send_limit))
+					break;
+			}
+
+			/* every target is out of credits, other free slots won't find one either */
+			if (j == w->n_targets)
+				break;
+
+			if (w->seq)
+				seq_post(w, i, idx);
+			else if (w->pm)
+				pm_post(w, i, idx);
+			else if (w->cc_next)
+				cc_post(w, i, idx);
+			else if (w->mix_next)
+				mix_post(w, i, idx);
+			else
+				post_mad(w, i, idx, w->smp_attr, w->smp_mod, w->mngt_method, w->targets[idx].data,
+					 w->ibd_timeout, w->ibd_retries, w->sw_timeout_ms);
+			trace_mad(w, mad_trace_send, &w->mads_on_wire[i], &w->mads_on_wire[i].start, 0, 0, 0);
+			if (w->health && w->health[idx].quarantined) {
+				w->mads_on_wire[i].probe = 1;
+				w->health[idx].probe_us = w->now_us + w->probe_ms * 1000ULL;
+				w->health[idx].probes++;
+			}
+			w->last_device = idx;
+			if (w->mads_on_wire[i].epoch != w->epoch)
+				continue;
+			if (++w->stats[idx].send_mads == w->send_limit && !w->seq && !w->pm)
+				w->n_counted++;
+		}
+	}
+	return 0;
+}
+
+inline float timedifference_msec(struct timeval t0, struct timeval t1)
+{
+    return (t1.tv_sec - t0.tv_sec) * 1000.0f + (t1.tv_usec - t0.tv_usec) / 1000.0f;
+}
+
+inline int timedifference_usec(struct timeval t0, struct timeval t1)
+{
+	return timedifference_msec(t0, t1) * 1000;
+}
+
+inline float timedifference_sec(struct timeval t0, struct timeval t1)
+{
+	return timedifference_msec(t0, t1) / 1000;
+}
+
+
+/* returns enum mad_outcome of the completion */
+static inline int account_mad(struct mad_worker *w, int t, int mgmt_class, int status, uint16_t mad_status, int latency)
+{
+	struct target_stats *s = &w->stats[t];
+	uint32_t l = latency > 0 ? latency : 0;
+	int outcome = mad_outcome(status, mad_status);
+
+	if (outcome == mad_outcome_ok) {
+		s->ok_mads++;
+	} else if (outcome == mad_outcome_timeout) {
+		s->timeouts++;
+	} else {
+		s->errors++;
+		if (!status) {
+			w->mad_status[t].mad_errors++;
+			mad_status_count(w->mad_status[t].n, mgmt_class, mad_status);
+		}
+	}
+	if (status)
+		w->umad_status[status & 0xff]++;
+
+	if (l > s->max_latency_us)
+		s->max_latency_us = l;
+	if (l < s->min_latency_us || !s->min_latency_us)
+		s->min_latency_us = l;
+
+	s->total_time_us += l;
+	w->lat_log2[t].n[lat_log2_bucket(l)]++;
+	lat_hist_add(&w->lat_outcome[outcome], l);
+	return outcome;
+}
+
+/* records and data of an ok SA responce, RMPP transfers are w->recv_len long */
+static void account_sa(struct mad_worker *w, const ib_sa_mad_t *sa)
+{
+	int data = w->recv_len - SA_DATA_OFFSET, rec = ntohs(sa->attr_offset) * 8;
+
+	if (data <= 0)
+		return;
+	w->sa_bytes += data;
+	if (rec)
+		w->sa_records += data / rec;
+	if (data > SA_SEGMENT_DATA) {
+		w->rmpp_transfers++;
+		w->rmpp_segments += (data + SA_SEGMENT_DATA - 1) / SA_SEGMENT_DATA;
+	}
+}
+
+static inline uint64_t target_completed(const struct target_stats *s)
+{
+	return s->ok_mads + s->timeouts + s->errors;
+}
+
+static inline uint64_t target_avg_latency(const struct target_stats *s)
+{
+	uint64_t n = target_completed(s);
+
+	return n ? s->total_time_us / n : 0;
+}
+
+/* p in [0, 100] of a target, upper bound of the log2 bucket clamped to [min, max] */
+static uint32_t target_percentile(const struct target_stats *s, const struct target_hist *h, double p)
+{
+	uint64_t n = 0, rank, seen = 0;
+	uint32_t v;
+	int b;
+
+	for (b = 0; b < LAT_LOG2_BUCKETS; ++b)
+		n += h->n[b];
+	if (!n)
+		return 0;
+
+	rank = (uint64_t)(p / 100.0 * n);
+	if (rank >= n)
+		rank = n - 1;
+	for (b = 0; b < LAT_LOG2_BUCKETS - 1; ++b) {
+		seen += h->n[b];
+		if (seen > rank)
+			break;
+	}
+
+	v = b < LAT_LOG2_BUCKETS - 1 ? (1u << b) - 1 : s->max_latency_us;
+	if (v < s->min_latency_us)
+		v = s->min_latency_us;
+	if (v > s->max_latency_us)
+		v = s->max_latency_us;
+	return v;
+}
+
+static int alloc_snapshot(struct mad_snapshot *snap, int cap)
+{
+	snap->cap = cap++;
+	snap->stats = (struct target_stats *)calloc(cap, sizeof(snap->stats[0]));
+	snap->lat_log2 = (struct target_hist *)calloc(cap, sizeof(snap->lat_log2[0]));
+	snap->mad_status = (struct target_status *)calloc(cap, sizeof(snap->mad_status[0]));
+	snap->on_wire = (uint16_t *)calloc(cap, sizeof(snap->on_wire[0]));
+	snap->lat_outcome = (struct lat_hist *)calloc(MAD_OUTCOMES, sizeof(snap->lat_outcome[0]));
+	snap->attr_stats = (struct attr_stats *)calloc(g_n_attr_rows + 1, sizeof(snap->attr_stats[0]));
+	return snap->stats && snap->lat_log2 && snap->mad_status && snap->on_wire && snap->lat_outcome &&
+		snap->attr_stats ? 0 : -1;
+}
+
+static void free_snapshot(struct mad_snapshot *snap)
+{
+	free(snap->stats);
+	free(snap->lat_log2);
+	free(snap->mad_status);
+	free(snap->on_wire);
+	free(snap->lat_outcome);
+	free(snap->attr_stats);
+}
+
+static void publish_snapshot(struct mad_worker *w, const struct timeval *now)
+{
+	struct mad_snapshot *snap = w->snap;
+	int n = w->n_targets < snap->cap ? w->n_targets : snap->cap;
+
+	__atomic_store_n(&snap->seq, snap->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	snap->n_targets = n;
+	snap->n_excluded = w->n_excluded;
+	snap->run_us = timeval_to_us(now) - timeval_to_us(&w->start);
+	memcpy(snap->stats, w->stats, n * sizeof(w->stats[0]));
+	memcpy(snap->lat_log2, w->lat_log2, n * sizeof(w->lat_log2[0]));
+	memcpy(snap->mad_status, w->mad_status, n * sizeof(w->mad_status[0]));
+	memcpy(snap->on_wire, w->on_wire, n * sizeof(w->on_wire[0]));
+	memcpy(&snap->latency, &w->latency, sizeof(w->latency));
+	memcpy(snap->lat_outcome, w->lat_outcome, MAD_OUTCOMES * sizeof(w->lat_outcome[0]));
+	memcpy(snap->umad_status, w->umad_status, sizeof(w->umad_status));
+	memcpy(&snap->lat_first, &w->lat_first, sizeof(w->lat_first));
+	memcpy(&snap->lat_retried, &w->lat_retried, sizeof(w->lat_retried));
+	snap->seq_completed = w->seq_completed;
+	snap->seq_aborted = w->seq_aborted;
+	memcpy(&snap->seq_latency, &w->seq_latency, sizeof(w->seq_latency));
+	snap->pm_sweeps = w->pm_sweeps;
+	memcpy(&snap->pm_sweep_time, &w->pm_sweep_time, sizeof(w->pm_sweep_time));
+	memcpy(snap->pm_delta, w->pm_delta, sizeof(w->pm_delta));
+	snap->sa_records = w->sa_records;
+	snap->sa_bytes = w->sa_bytes;
+	if (w->attr_stats)
+		memcpy(snap->attr_stats, w->attr_stats, g_n_attr_rows * sizeof(w->attr_stats[0]));
+
+	__atomic_store_n(&snap->seq, snap->seq + 1, __ATOMIC_RELEASE);
+	w->next_publish_us = timeval_to_us(now) + METRICS_PUBLISH_MS * 1000;
+}
+
+/* copy of a published snapshot, returns -1 if nothing is published yet */
+static int read_snapshot(struct mad_snapshot *snap, struct mad_snapshot *copy)
+{
+	unsigned seq;
+
+	do {
+		seq = __atomic_load_n(&snap->seq, __ATOMIC_ACQUIRE);
+		if (!seq)
+			return -1;
+		if (seq & 1)
+			continue;
+
+		copy->n_targets = snap->n_targets;
+		if (copy->n_targets > snap->cap)
+			copy->n_targets = snap->cap;
+		copy->n_excluded = snap->n_excluded;
+		copy->run_us = snap->run_us;
+		copy->targets = snap->targets;
+		memcpy(copy->stats, snap->stats, copy->n_targets * sizeof(copy->stats[0]));
+		memcpy(copy->lat_log2, snap->lat_log2, copy->n_targets * sizeof(copy->lat_log2[0]));
+		memcpy(copy->mad_status, snap->mad_status, copy->n_targets * sizeof(copy->mad_status[0]));
+		memcpy(copy->on_wire, snap->on_wire, copy->n_targets * sizeof(copy->on_wire[0]));
+		memcpy(&copy->latency, &snap->latency, sizeof(copy->latency));
+		memcpy(copy->lat_outcome, snap->lat_outcome, MAD_OUTCOMES * sizeof(copy->lat_outcome[0]));
+		memcpy(copy->umad_status, snap->umad_status, sizeof(copy->umad_status));
+		memcpy(&copy->lat_first, &snap->lat_first, sizeof(copy->lat_first));
+		memcpy(&copy->lat_retried, &snap->lat_retried, sizeof(copy->lat_retried));
+		copy->seq_completed = snap->seq_completed;
+		copy->seq_aborted = snap->seq_aborted;
+		memcpy(&copy->seq_latency, &snap->seq_latency, sizeof(copy->seq_latency));
+		copy->pm_sweeps = snap->pm_sweeps;
+		memcpy(&copy->pm_sweep_time, &snap->pm_sweep_time, sizeof(copy->pm_sweep_time));
+		memcpy(copy->pm_delta, snap->pm_delta, sizeof(copy->pm_delta));
+		copy->sa_records = snap->sa_records;
+		copy->sa_bytes = snap->sa_bytes;
+		memcpy(copy->attr_stats, snap->attr_stats, g_n_attr_rows * sizeof(copy->attr_stats[0]));
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (seq != __atomic_load_n(&snap->seq, __ATOMIC_RELAXED));
+
+	copy->seq = seq;
+	return 0;
+}
+
+/*
+ * Warmup is over: forget everything counted so far and restart the clock.
+ * Mads sent in warmup keep their slots and credits, but are not accounted
+ * when they complete.
+ */
+static void end_warmup(struct mad_worker *w, const struct timeval *now)
+{
+	int i, n = w->n_targets + w->n_excluded;
+
+	memset(w->stats, 0, n * sizeof(w->stats[0]));
+	memset(w->lat_log2, 0, n * sizeof(w->lat_log2[0]));
+	memset(w->mad_status, 0, n * sizeof(w->mad_status[0]));
+	lat_hist_init(&w->latency);
+	for (i = 0; i < MAD_OUTCOMES; ++i)
+		lat_hist_init(&w->lat_outcome[i]);
+	memset(w->umad_status, 0, sizeof(w->umad_status));
+	memset(w->attempts, 0, sizeof(w->attempts));
+	lat_hist_init(&w->lat_first);
+	lat_hist_init(&w->lat_retried);
+	lat_hist_init(&w->lat_late);
+	w->lost_mads = 0;
+	w->n_counted = 0;
+	w->send_limit = w->mad_count;
+	for (i = 0; w->seq && i < n; ++i)
+		w->seq[i].started = w->seq[i].completed = w->seq[i].aborted = 0;
+	w->seq_completed = w->seq_aborted = 0;
+	lat_hist_init(&w->seq_latency);
+	for (i = 0; w->pm && i < n; ++i)
+		memset(w->pm[i].delta, 0, sizeof(w->pm[i].delta));
+	w->pm_sweeps = 0;
+	lat_hist_init(&w->pm_sweep_time);
+	memset(w->pm_delta, 0, sizeof(w->pm_delta));
+	w->sa_records = w->sa_bytes = w->rmpp_transfers = w->rmpp_segments = 0;
+	if (w->attr_stats)
+		memcpy(w->attr_stats, g_attr_rows, g_n_attr_rows * sizeof(w->attr_stats[0]));
+	w->agent_mismatches = 0;
+	w->stale_tids = w->unknown_tids = 0;
+	if (w->health) {
+		health_cut(w, now);
+		for (i = 0; i < n; ++i)
+			w->health[i].quarantined_us = w->health[i].quarantines = w->health[i].probes = 0;
+	}
+	for (i = 0; w->mlnx_epi && i < n; ++i)
+		w->mlnx_epi[i].changes = 0;
+
+	w->warmup_us = timedifference_usec(w->start, *now);
+	w->warming = 0;
+	w->epoch++;
+	w->start = *now;
+}
+
+int process_mads(struct mad_worker *w)
+{
+	float time_left_ms;
+	struct timeval current;
+	int i, rc ,status, poll_ms, next_deadline_ms;
+	int latency, outcome;
+	int target;
+	struct mad_operation *op;
+	struct drsmp *smp = (struct drsmp *)(umad_get_mad(w->umad));
+
+	if (prefetch_needed(w)) {
 		rc = fetch_attribute(w);
 		if (rc)
 			IBPANIC("fetch attribute value is failed");
+		if (!w->n_targets)
+			IBWARN("worker %d: all targets are excluded", w->id);
 	}
 
+	if (w->verify || w->scenario)
+		init_verify_mask(w);
+
 	gettimeofday(&w->start, NULL);
+	w->warming = w->warmup_ms || w->warmup_mads;
+	w->send_limit = w->warming ? 0 : w->mad_count;
+	if (w->pm && w->n_targets)
+		pm_start_sweep(w, &w->start);
+
+	if (w->snap) {
+		/* seq is still 0, readers don't look at the arrays yet */
+		if (alloc_snapshot(w->snap, w->n_targets))
+			IBPANIC("can't allocate metrics snapshot");
+		w->snap->targets = w->targets;
+		publish_snapshot(w, &w->start);
+	}
 
 	while (1) {
 		gettimeofday(&current, NULL);
 
-		time_left_ms = w->timeout_ms - timedifference_msec(w->start, current);
-		if (time_left_ms <= 0)
-			goto exit;
+		if (w->snap && timeval_to_us(&current) >= w->next_publish_us)
+			publish_snapshot(w, &current);
+
+		if (w->warming)
+			time_left_ms = w->warmup_ms ? w->warmup_ms - timedifference_msec(w->start, current) : 1000;
+		else if (w->mad_count && !w->timeout_ms)
+			time_left_ms = 1000;
+		else
+			time_left_ms = w->timeout_ms - timedifference_msec(w->start, current);
+		if (time_left_ms <= 0) {
+			if (!w->warming)
+				goto exit;
+			end_warmup(w, &current);
+			continue;
+		}
+
+		/* fixed count run is over when the last mad is drained */
+		if (w->send_limit && w->n_counted == w->n_targets && !w->n_deadlines && !w->n_active_seqs)
+			goto exit;
+
+		reclaim_lost_mads(w, &current);
+
+		w->now_us = timeval_to_us(&current);
+		send_mads(w);
+
+		/* mads just sent count too, with -N 1 the heap was empty before */
+		next_deadline_ms = next_deadline(w, w->now_us);
+		poll_ms = (int)time_left_ms;
+		if (next_deadline_ms >= 0 && next_deadline_ms < poll_ms)
+			poll_ms = next_deadline_ms;
+		if (w->health && w->next_probe_us != UINT64_MAX && (w->next_probe_us - w->now_us + 999) / 1000 < poll_ms)
+			poll_ms = (w->next_probe_us - w->now_us + 999) / 1000;
+
+		rc = w->tr->poll(w->portid, poll_ms);
+		if (rc == -ETIMEDOUT)
+			continue;
+		else if (rc)
+			IBPANIC("umad_poll failed: %d %m", rc);
+
+		i = recv_mad(w, &status, &current);
+		if (i >= 0) {
+			smp = (struct drsmp *)(umad_get_mad(w->umad));
+			op = &w->mads_on_wire[i];
+			if (status == ETIMEDOUT && op->attempt <= w->tool_retries) {
+				retry_mad(w, i, &current);
+				continue;
+			}
+			if (w->health)
+				health_done(w, op, mad_outcome(status, ntohs(smp->status)), &current);
+			if (op->epoch != w->epoch) {
+				if (w->seq)
+					seq_mad_done(w, op->target, mad_outcome(status, ntohs(smp->status)), smp->data, &current);
+				if (w->pm)
+					pm_mad_done(w, op->target, op->mod,
+						    mad_outcome(status, ntohs(smp->status)) == mad_outcome_ok ? smp->data : NULL, &current);
+				if (w->cc_next)
+					cc_mad_done(w, op->target, op, mad_outcome(status, ntohs(smp->status)), (uint8_t *)smp, 0, 0);
+				trace_mad(w, mad_trace_complete, op, &current, timedifference_usec(op->start, current),
+					  status, ntohs(smp->status));
+				release_mad(w, i);
+				continue;
+			}
+
+			target = op->target;
+			latency = timedifference_usec(op->start, current);
+			outcome = account_mad(w, target, op->mgmt_class, status, ntohs(smp->status), latency);
+			lat_hist_add(&w->latency, latency);
+			if (op->mgmt_class == IB_SA_CLASS && outcome == mad_outcome_ok)
+				account_sa(w, (const ib_sa_mad_t *)smp);
+			if (w->tool_retries) {
+				w->attempts[op->attempt]++;
+				if (!status)
+					lat_hist_add(op->attempt == 1 ? &w->lat_first : &w->lat_retried, latency);
+			}
+
+			/* data of BUSY and error responces is not an attribute value */
+			if (w->verify && outcome == mad_outcome_ok && verify_data(w, smp->data, w->targets[target].data)) {
+				w->stats[target].mismatches++;
+				report_mismatch(w, target, smp->data, w->targets[target].data);
+			}
+
+			if (w->seq)
+				seq_mad_done(w, target, outcome, smp->data, &current);
+			if (w->pm)
+				pm_mad_done(w, target, op->mod, outcome == mad_outcome_ok ? smp->data : NULL, &current);
+			if (w->cc_next)
+				cc_mad_done(w, target, op, outcome, (uint8_t *)smp, latency, 1);
+			if (w->mix_next)
+				account_attr(w, op, outcome, latency);
+			if (w->mlnx_epi && outcome == mad_outcome_ok)
+				mlnx_epi_decode(&w->mlnx_epi[target], smp->data);
+
+			trace_mad(w, mad_trace_complete, &w->mads_on_wire[i], &current, latency, status, ntohs(smp->status));
+			release_mad(w, i);
+
+			if (w->warming && w->warmup_mads && ++w->warmup_completed == w->warmup_mads)
+				end_warmup(w, &current);
+		}
+	}
+exit:
+	gettimeofday(&w->end, NULL);
+	if (w->health)
+		health_cut(w, &w->end);
+	if (w->snap)
+		publish_snapshot(w, &w->end);
+	return 0;
+}
+
+void finalize_mad_worker(struct mad_worker *w)
+{
+	int i;
+
+	umad_free(w->umad);
+
+	for (i = 0; i < w->n_agents; ++i)
+		w->tr->unregister_agent(w->portid, w->agents[i]);
+	w->tr->close_port(w->portid);
+
+	mad_trace_close(&w->trace, timeval_to_us(&w->end));
+
+	free(w->mads_on_wire);
+	free(w->retired);
+	free(w->deadline_heap);
+	free(w->targets);
+	free(w->stats);
+	free(w->lat_log2);
+	free(w->mad_status);
+	free(w->seq);
+	free(w->pm);
+	free(w->pm_last);
+	free(w->cc_next);
+	free(w->cc_data);
+	free(w->attr_stats);
+	free(w->mix_next);
+	free(w->mlnx_epi);
+	free(w->health);
+	free(w->lat_outcome);
+	free(w->on_wire);
+	if (w->snap) {
+		free_snapshot(w->snap);
+		free(w->snap);
+	}
+}
+
+void report_worker_params(struct mad_worker *w, FILE *f)
+{
+	fprintf(f, "transport: %s\n", g_transport->name);
+	if (g_n_endpoints > 1) {
+		int i;
+
+		fprintf(f, "endpoints:");
+		for (i = 0; i < g_n_endpoints; ++i)
+			fprintf(f, " %s:%d%s", g_endpoints[i].ca[0] ? g_endpoints[i].ca : "Default", g_endpoints[i].port,
+				g_endpoints[i].lids ? " (own lids)" : "");
+		fprintf(f, " , workers round robin\n");
+	} else
+		fprintf(f, "device: %s port %d\n", w->ibd_ca, w->ibd_ca_port);
+	fprintf(f, "umad timeout: %d  retries: %d\n ", w->ibd_timeout, w->ibd_retries);
+	fprintf(f, "software timeout: %d\n ", w->sw_timeout_ms);
+	if (w->warmup_ms || w->warmup_mads)
+		fprintf(f, "warmup: %d ms , %" PRIu64 " mads\n ", w->warmup_ms, w->warmup_mads);
+	if (w->scenario)
+		fprintf(f, "scenario: %s\n ", w->scenario->name);
+	if (w->mad_count && w->mgmt_class == IB_PERFORMANCE_CLASS)
+		fprintf(f, "perfmgt sweeps: %" PRIu64 "\n ", w->mad_count);
+	else if (w->mad_count)
+		fprintf(f, "%s per target: %" PRIu64 "\n ", w->scenario ? "sequences" : "mads", w->mad_count);
+	if (w->tool_retries)
+		fprintf(f, "tool retries: %d , backoff: %d ms , max backoff: %d ms\n ", w->tool_retries, w->backoff_ms, w->backoff_max_ms);
+	if (w->quarantine_pct)
+		fprintf(f, "quarantine: %d%% of %d mads failed , probe every %d ms\n ", w->quarantine_pct, HEALTH_WINDOW, w->probe_ms);
+	fprintf(f, "mngt class %s (%d)\n ", w->mgmt_class ==  IB_SMI_CLASS? "IB_SMI_CLASS" :
+		w->mgmt_class == IB_PERFORMANCE_CLASS ? "IB_PERFORMANCE_CLASS" :
+		w->mgmt_class == IB_CC_CLASS ? "IB_CC_CLASS" :
+		w->mgmt_class == IB_SA_CLASS ? "IB_SA_CLASS" : "IB_SMI_DIRECT_CLASS", w->mgmt_class);
+	fprintf(f, "mngt method %s (%d)\n ", w->mngt_method == 1 ? "GET" : "SET", w->mngt_method);
+	if (w->mgmt_class == IB_PERFORMANCE_CLASS)
+		fprintf(f, "perfmgt attr %s (0x%x) , ports per target: %d\n ", pm_attribute_name(w->smp_attr), w->smp_attr, g_n_pm_ports);
+	else if (w->mgmt_class == IB_CC_CLASS)
+		fprintf(f, "cc mix: %d attributes , %d of them Set , cc key: 0x%" PRIx64 "\n ", g_n_cc_mix, g_n_cc_set, g_cc_key);
+	else if (w->mgmt_class == IB_SA_CLASS)
+		fprintf(f, "sa attr %s (0x%x) %s, sm lid: %d , path source lid: %d\n ", class_attribute_name(w->mgmt_class, w->smp_attr),
+			w->smp_attr, g_sa_table ? "table " : "", g_sa_lid, g_sa_slid);
+	else
+		fprintf(f, "smp attr %s (0x%x)\n ", get_attribute_name(w->smp_attr) , w->smp_attr);
+	if (g_n_class_mix) {
+		int i;
+
+		fprintf(f, "class mix:");
+		for (i = 0; i < g_n_class_mix; ++i)
+			fprintf(f, "%s%s %s", i ? " ," : " ", class_name(g_class_mix[i].mgmt_class),
+				class_attribute_name(g_class_mix[i].mgmt_class, g_class_mix[i].attr));
+		fprintf(f, "\n ");
+	}
+	if (w->vendor_probe)
+		fprintf(f, "vendor probe: NodeInfo Get first, %s\n ", w->smp_attr == be16toh(IB_MAD_ATTR_MLNX_EXTENDED_PORT_INFO) ?
+			"devices without MLNX ExtendedPortInfo are excluded" : "targets failing the attr Get are excluded");
+	fprintf(f, "source queue depth: %d , target queue depth: %d\n", w->source_queue_depth, w->target_queue_depth);
+	if (w->verify)
+		fprintf(f, "verify responce data: on\n");
+}
+
+/* non zero MAD status counters: " busy: 10 , unsup_attr: 2" */
+static void print_status_counts(FILE *f, int mgmt_class, const uint64_t *n)
+{
+	const char *sep = "";
+	int i;
+
+	for (i = 0; i < MAD_STATUS_COUNTERS; ++i) {
+		if (!n[i])
+			continue;
+		fprintf(f, "%s %s: %" PRIu64, sep, mad_status_name(mgmt_class, i), n[i]);
+		sep = " ,";
+	}
+}
+
+static void sum_status(const struct mad_worker *w, struct target_status *sum)
+{
+	int i, j;
+
+	for (i = 0; i < w->n_targets; ++i) {
+		sum->retransmits += w->mad_status[i].retransmits;
+		sum->mad_errors += w->mad_status[i].mad_errors;
+		sum->late += w->mad_status[i].late;
+		sum->duplicates += w->mad_status[i].duplicates;
+		for (j = 0; j < MAD_STATUS_COUNTERS; ++j)
+			sum->n[j] += w->mad_status[i].n[j];
+	}
+}
+
+/* completions by outcome and transport status, only when something failed */
+static void print_outcomes(FILE *f, const struct mad_worker *w)
+{
+	const struct lat_hist *h;
+	struct target_status st;
+	int i;
+
+	if (w->lat_outcome[mad_outcome_ok].count == w->latency.count)
+		return;
+
+	for (i = 0; i < MAD_OUTCOMES; ++i) {
+		h = &w->lat_outcome[i];
+		if (!h->count)
+			continue;
+		fprintf(f, "	outcome %s: %" PRIu64 " , latency (us) p50: %u , p99: %u , max: %u\n", mad_outcome_names[i],
+			h->count, lat_hist_percentile(h, 50), lat_hist_percentile(h, 99), h->max);
+	}
+
+	for (i = 1; i < 256; ++i)
+		if (w->umad_status[i])
+			fprintf(f, "	umad status %d (%s): %" PRIu64 "\n", i, strerror(i), w->umad_status[i]);
+
+	memset(&st, 0, sizeof(st));
+	sum_status(w, &st);
+	if (st.mad_errors) {
+		fprintf(f, "	mad status errors, attr %s (0x%x): %" PRIu64 " ,", class_attribute_name(w->mgmt_class, w->smp_attr), w->smp_attr, st.mad_errors);
+		print_status_counts(f, w->mgmt_class, st.n);
+		fprintf(f, "\n");
+	}
+}
 
-		send_mads(w);
+/* responces which came after their mad left its slot */
+static void print_late(FILE *f, const struct mad_worker *w)
+{
+	struct target_status st;
+
+	memset(&st, 0, sizeof(st));
+	sum_status(w, &st);
+	if (st.late)
+		fprintf(f, "	late responces: %" PRIu64 " , latency (us) p50: %u , p99: %u , max: %u\n", st.late,
+			lat_hist_percentile(&w->lat_late, 50), lat_hist_percentile(&w->lat_late, 99), w->lat_late.max);
+	if (st.duplicates)
+		fprintf(f, "	duplicate responces: %" PRIu64 "\n", st.duplicates);
+	if (w->stale_tids || w->unknown_tids)
+		fprintf(f, "	stale responces (older mad of the slot): %" PRIu64 " , unknown tids: %" PRIu64 "\n",
+			w->stale_tids, w->unknown_tids);
+}
 
-		rc = umad_poll(w->portid, (int)time_left_ms);
-		if (rc == -ETIMEDOUT)
-			goto exit;
-		else if (rc)
-			IBPANIC("umad_poll failed: %d %m", rc);
+/* targets which were quarantined and for how long */
+static void print_quarantine(FILE *f, const struct mad_worker *w)
+{
+	uint64_t n = 0, us = 0, probes = 0;
+	int i;
 
-		length = IB_MAD_SIZE;
-		rc = umad_recv(w->portid, w->umad, &length, -1);
-		if (rc != w->mad_agent) {
-			IBPANIC("recv error: %d %m", rc);
+	for (i = 0; w->health && i < w->n_targets; ++i)
+		if (w->health[i].quarantines || w->health[i].quarantined) {
+			n++;
+			us += w->health[i].quarantined_us;
+			probes += w->health[i].probes;
 		}
+	if (n)
+		fprintf(f, "	quarantined targets: %" PRIu64 " , quarantine time: %.2f ms , probes: %" PRIu64 "\n",
+			n, us / 1000.0, probes);
+}
 
-		gettimeofday(&current, NULL);
-		status = umad_status(w->umad);
-
-		tid = smp->tid >> 32;
+/* retransmit rate and latency of first attempt vs retransmitted mads */
+static void print_retries(FILE *f, const struct mad_worker *w, uint64_t send_mads)
+{
+	struct target_status st;
+	int i;
 
-		for (i = 0; i < w->source_queue_depth; ++i) {
-			be64_t t = w->mads_on_wire[i].tid >> 32;
-			if (t == tid)
-				break;
-		}
+	if (!w->tool_retries)
+		return;
+
+	memset(&st, 0, sizeof(st));
+	sum_status(w, &st);
+	fprintf(f, "	retransmits: %" PRIu64 " (%.2f%% of sent mads) , completed by attempt", st.retransmits,
+		send_mads ? 100.0 * st.retransmits / send_mads : 0);
+	for (i = 1; i <= w->tool_retries + 1; ++i)
+		fprintf(f, "%s %d: %" PRIu64, i > 1 ? " ," : "", i, w->attempts[i]);
+	fprintf(f, "\n");
+	fprintf(f, "	first attempt latency (us) p50: %u , p99: %u , max: %u\n", lat_hist_percentile(&w->lat_first, 50),
+		lat_hist_percentile(&w->lat_first, 99), w->lat_first.max);
+	if (w->lat_retried.count)
+		fprintf(f, "	retransmitted latency (us) p50: %u , p99: %u , max: %u\n", lat_hist_percentile(&w->lat_retried, 50),
+			lat_hist_percentile(&w->lat_retried, 99), w->lat_retried.max);
+}
 
-		if (i < w->source_queue_depth) {
-			target = w->mads_on_wire[i].target;
-			target->on_wire_mads--;
-			if (status == ETIMEDOUT)
-				target->timeouts++;
-			else if (status)
-				target->errors++;
-			else
-				target->ok_mads++;
+static void print_scenario(FILE *f, const struct mad_worker *w)
+{
+	const struct lat_hist *h = &w->seq_latency;
 
-			latency = timedifference_usec(w->mads_on_wire[i].start, current);
+	if (!w->scenario)
+		return;
 
-			if (latency > target->max_latency_us)
-				target->max_latency_us = latency;
-			if (latency < target->min_latency_us || !target->min_latency_us)
-				target->min_latency_us = latency;
+	fprintf(f, "	scenario %s: sequences completed: %" PRIu64 " , aborted: %" PRIu64 " , active at exit: %d\n",
+		w->scenario->name, w->seq_completed, w->seq_aborted, w->n_active_seqs);
+	fprintf(f, "	sequence latency (us) min: %u , p50: %u , p99: %u , max: %u\n", h->min,
+		lat_hist_percentile(h, 50), lat_hist_percentile(h, 99), h->max);
+}
 
-			target->total_time_us += latency;
-			target->avrg_latency_us = target->total_time_us / (target->timeouts + target->errors + target->ok_mads);
+/* non zero counter deltas: " xmit_data: 10 , symbol_errors: 2" */
+static void print_pm_deltas(FILE *f, const uint64_t *delta)
+{
+	const char *sep = "";
+	int i;
 
-			w->mads_on_wire[i].tid = 0;
-			w->mads_on_wire[i].target = NULL;
-		} else {
-			IBWARN("tid %ld is not found", be64toh(tid));
-		}
+	for (i = 0; i < PM_COUNTERS; ++i) {
+		if (!delta[i])
+			continue;
+		fprintf(f, "%s %s: %" PRIu64, sep, pm_counter_names[i], delta[i]);
+		sep = " ,";
 	}
-exit:
-	gettimeofday(&w->end, NULL);
-	return 0;
 }
 
-void finalize_mad_worker(struct mad_worker *w)
+static void print_perfmgt(FILE *f, const struct mad_worker *w)
 {
-	umad_free(w->umad);
+	const struct lat_hist *h = &w->pm_sweep_time;
 
-	umad_unregister(w->portid, w->mad_agent);
-	umad_close_port(w->portid);
+	if (!w->pm)
+		return;
 
-	free(w->mads_on_wire);
-	free(w->targets);
+	fprintf(f, "	perfmgt %s: sweeps: %" PRIu64 " of %d ports, sweep time (us) min: %u , p50: %u , p99: %u , max: %u\n",
+		pm_attribute_name(w->smp_attr), w->pm_sweeps, w->n_targets * g_n_pm_ports, h->min,
+		lat_hist_percentile(h, 50), lat_hist_percentile(h, 99), h->max);
+	fprintf(f, "	counter deltas:");
+	print_pm_deltas(f, w->pm_delta);
+	fprintf(f, "\n");
 }
 
-void report_worker_params(struct mad_worker *w, FILE *f)
+static void print_sa(FILE *f, const struct mad_worker *w, float run_time_s)
 {
-	fprintf(f, "device: %s port %d\n", w->ibd_ca, w->ibd_ca_port);
-	fprintf(f, "umad timeout: %d  retries: %d\n ", w->ibd_timeout, w->ibd_retries);
-	fprintf(f, "mngt class %s (%d)\n ", w->mgmt_class ==  IB_SMI_CLASS? "IB_SMI_CLASS" : "IB_SMI_DIRECT_CLASS", w->mgmt_class);
-	fprintf(f, "mngt method %s (%d)\n ", w->mngt_method == 1 ? "GET" : "SET", w->mngt_method);
-	fprintf(f, "smp attr %s (0x%x)\n ", get_attribute_name(w->smp_attr) , w->smp_attr);
-	fprintf(f, "source queue depth: %d , target queue depth: %d\n", w->source_queue_depth, w->target_queue_depth);
+	if (w->mgmt_class != IB_SA_CLASS)
+		return;
+
+	fprintf(f, "	sa records: %" PRIu64 " , data: %" PRIu64 " bytes , %.2f MB/s\n", w->sa_records, w->sa_bytes,
+		run_time_s > 0 ? w->sa_bytes / run_time_s / 1e6 : 0);
+	if (w->rmpp_transfers)
+		fprintf(f, "	rmpp transfers: %" PRIu64 " , segments per transfer: %.1f\n", w->rmpp_transfers,
+			(double)w->rmpp_segments / w->rmpp_transfers);
+}
+
+static void print_attr_stats(FILE *f, const struct mad_worker *w)
+{
+	const struct attr_stats *a;
+	int i;
+
+	for (i = 0; w->attr_stats && i < g_n_attr_rows; ++i) {
+		a = &w->attr_stats[i];
+		fprintf(f, "	%s %s %s: ok: %" PRIu64 " , errors: %" PRIu64 " , timeouts: %" PRIu64 " , latency (us) p50: %u , p99: %u , max: %u\n",
+			class_name(a->mgmt_class), class_attribute_name(a->mgmt_class, a->attr), a->method == mngt_method_get ? "Get" : "Set",
+			a->ok, a->errors, a->timeouts, lat_hist_percentile(&a->latency, 50),
+			lat_hist_percentile(&a->latency, 99), a->latency.max);
+	}
+}
+
+static void sum_targets(const struct mad_worker *w, struct target_stats *sum, uint64_t *on_wire)
+{
+	const struct target_stats *t;
+	int i;
+
+	for (i = 0; i < w->n_targets; ++i) {
+		t = &w->stats[i];
+		sum->send_mads += t->send_mads;
+		sum->ok_mads += t->ok_mads;
+		sum->timeouts += t->timeouts;
+		sum->errors += t->errors;
+		sum->lost += t->lost;
+		sum->mismatches += t->mismatches;
+		*on_wire += w->on_wire[i];
+	}
 }
 
 void print_statistics(struct mad_worker *workers, int nworkers, FILE *f)
 {
 	int i, n;
 	struct mad_worker *w;
-	int send_mads = 0, ok_mads = 0, errors = 0, timeouts = 0 , recv_mads = 0;
-	int total_send_mads = 0, total_ok_mads = 0, total_errors = 0, total_timeouts = 0 , total_recv_mads = 0;
-	uint64_t total_time = 0;
-	int min_latency_us = 0, max_latency_us = 0, avrg_latency_us = 0;
+	const struct target_stats *t;
+	uint64_t send_mads = 0, ok_mads = 0, errors = 0, timeouts = 0 , recv_mads = 0, lost = 0, on_wire = 0;
+	uint64_t total_send_mads = 0, total_ok_mads = 0, total_errors = 0, total_timeouts = 0 , total_recv_mads = 0;
+	uint64_t total_lost = 0, total_on_wire = 0, mismatches = 0, total_mismatches = 0;
+	uint64_t total_time;
+	uint64_t min_latency_us, max_latency_us, avrg_latency_us;
 	float run_time_s;
 
 	run_time_s = timedifference_sec(workers[0].start, workers[0].end);
@@ -583,23 +2945,26 @@ void print_statistics(struct mad_worker *workers, int nworkers, FILE *f)
 	for (n = 0; n < g_nworkers; ++n) {
 		w = &workers[n];
 
-		send_mads = ok_mads = errors = timeouts = recv_mads = 0;
+		send_mads = ok_mads = errors = timeouts = recv_mads = lost = on_wire = mismatches = 0;
+		min_latency_us = max_latency_us = avrg_latency_us = 0;
+		total_time = 0;
 		for (i = 0; i < w->n_targets; ++ i) {
-
-			//if (!w->targets[i].send_mads)
-			//	continue;
-
-			send_mads += w->targets[i].send_mads;
-			ok_mads += w->targets[i].ok_mads;
-			errors += w->targets[i].errors;
-			timeouts += w->targets[i].timeouts;
-
-			if (!min_latency_us || min_latency_us > w->targets[i].min_latency_us)
-				min_latency_us = w->targets[i].min_latency_us;
-			if (max_latency_us < w->targets[i].max_latency_us)
-				max_latency_us = w->targets[i].max_latency_us;
-
-			total_time += w->targets[i].total_time_us;
+			t = &w->stats[i];
+
+			send_mads += t->send_mads;
+			ok_mads += t->ok_mads;
+			errors += t->errors;
+			timeouts += t->timeouts;
+			lost += t->lost;
+			mismatches += t->mismatches;
+			on_wire += w->on_wire[i];
+
+			if (!min_latency_us || min_latency_us > t->min_latency_us)
+				min_latency_us = t->min_latency_us;
+			if (max_latency_us < t->max_latency_us)
+				max_latency_us = t->max_latency_us;
+
+			total_time += t->total_time_us;
 		}
 
 		recv_mads = ok_mads + errors + timeouts;
@@ -611,30 +2976,716 @@ void print_statistics(struct mad_worker *workers, int nworkers, FILE *f)
 		total_errors += errors;
 		total_timeouts += timeouts;
 		total_recv_mads += recv_mads;
+		total_lost += lost;
+		total_mismatches += mismatches;
+		total_on_wire += on_wire;
 
 		fprintf(f, "Worker: %d , Local device: %s , port: %d\n", n, strlen(w->ibd_ca) ? w->ibd_ca : "Default", w->ibd_ca_port);
-		fprintf(f, "	send mads: %d , ok mads: %d , timeouts: %d , errors %d\n",  send_mads, ok_mads, timeouts, errors);
-		fprintf(f, "	latency (us) min: %d , max:%d , average: %d\n",  min_latency_us, max_latency_us, avrg_latency_us);
-		fprintf(f, "	mad/s: %d\n", (int)(recv_mads / run_time_s));
+		fprintf(f, "	send mads: %" PRIu64 " , ok mads: %" PRIu64 " , timeouts: %" PRIu64 " , errors %" PRIu64 "\n",  send_mads, ok_mads, timeouts, errors);
+		fprintf(f, "	lost mads: %" PRIu64 " , on wire at exit: %" PRIu64 "\n",  lost, on_wire);
+		if (w->verify)
+			fprintf(f, "	verify mismatches: %" PRIu64 "\n",  mismatches);
+		if (prefetch_needed(w))
+			fprintf(f, "	pre-fetch: %d targets in %.2f ms , excluded: %d\n",  w->n_targets + w->n_excluded,
+				w->prefetch_us / 1000.0, w->n_excluded);
+		fprintf(f, "	latency (us) min: %" PRIu64 " , max:%" PRIu64 " , average: %" PRIu64 "\n",  min_latency_us, max_latency_us, avrg_latency_us);
+		fprintf(f, "	mad/s: %" PRIu64 "\n", (uint64_t)(recv_mads / run_time_s));
+		if (w->warmup_ms || w->warmup_mads)
+			fprintf(f, "	warmup: %.2f ms , not counted\n", w->warmup_us / 1000.0);
+		print_outcomes(f, w);
+		print_retries(f, w, send_mads);
+		print_scenario(f, w);
+		print_perfmgt(f, w);
+		print_sa(f, w, run_time_s);
+		print_attr_stats(f, w);
+		if (w->agent_mismatches)
+			fprintf(f, "	responces on the agent of another class: %" PRIu64 "\n", w->agent_mismatches);
+		print_late(f, w);
+		print_quarantine(f, w);
+		if (w->trace.hdr)
+			fprintf(f, "	trace records: %" PRIu64 " , overhead: %.3f ms (%.2f%% of run time)\n", w->trace.head,
+				mad_trace_overhead_ns(&w->trace) / 1e6, mad_trace_overhead_ns(&w->trace) / (run_time_s * 1e7));
 		fprintf(f, "\n");
 
 		for (i = 0; i < w->n_targets; ++ i) {
-			recv_mads = w->targets[i].ok_mads + w->targets[i].timeouts + w->targets[i].errors;
+			t = &w->stats[i];
 			fprintf(f, "	lid: %d\n", w->targets[i].lid);
-			fprintf(f, "		send mads: %d , ok mads: %d , timeouts: %d , errors %d\n",  w->targets[i].send_mads, w->targets[i].ok_mads, w->targets[i].timeouts, w->targets[i].errors);
-			fprintf(f, "		latency (us) min: %d , max:%d , average: %d\n",  w->targets[i].min_latency_us, w->targets[i].max_latency_us, w->targets[i].avrg_latency_us);
-			fprintf(f, "		mas/s: %d\n",  (int)(recv_mads / run_time_s));
+			fprintf(f, "		send mads: %" PRIu64 " , ok mads: %" PRIu64 " , timeouts: %" PRIu64 " , errors %" PRIu64 "\n",  t->send_mads, t->ok_mads, t->timeouts, t->errors);
+			if (t->lost || w->on_wire[i])
+				fprintf(f, "		lost mads (reclaimed credits): %" PRIu64 " , on wire at exit: %d\n",  t->lost, w->on_wire[i]);
+			if (w->seq)
+				fprintf(f, "		sequences completed: %" PRIu64 " , aborted: %" PRIu64 "\n",
+					w->seq[i].completed, w->seq[i].aborted);
+			if (w->pm) {
+				fprintf(f, "		counter deltas:");
+				print_pm_deltas(f, w->pm[i].delta);
+				fprintf(f, "\n");
+			}
+			if (w->mad_status[i].retransmits)
+				fprintf(f, "		retransmits: %" PRIu64 "\n", w->mad_status[i].retransmits);
+			if (w->health && (w->health[i].quarantines || w->health[i].quarantined))
+				fprintf(f, "		quarantined: %" PRIu64 " times , %.2f ms%s , probes: %" PRIu64 "\n",
+					w->health[i].quarantines, w->health[i].quarantined_us / 1000.0,
+					w->health[i].quarantined ? " , still at exit" : "", w->health[i].probes);
+			if (w->mad_status[i].late || w->mad_status[i].duplicates)
+				fprintf(f, "		late responces: %" PRIu64 " , duplicates: %" PRIu64 "\n",
+					w->mad_status[i].late, w->mad_status[i].duplicates);
+			if (w->mad_status[i].mad_errors) {
+				fprintf(f, "		mad status errors: %" PRIu64 " ,", w->mad_status[i].mad_errors);
+				print_status_counts(f, w->mgmt_class, w->mad_status[i].n);
+				fprintf(f, "\n");
+			}
+			if (w->verify)
+				fprintf(f, "		verify mismatches: %" PRIu64 "\n",  t->mismatches);
+			if (w->mlnx_epi && w->mlnx_epi[i].valid)
+				fprintf(f, "		ext port info: link speed supported 0x%x , enabled 0x%x , active 0x%x%s , state change enable 0x%x , changes: %" PRIu64 "\n",
+					w->mlnx_epi[i].link_speed_supported, w->mlnx_epi[i].link_speed_enabled, w->mlnx_epi[i].link_speed_active,
+					w->mlnx_epi[i].link_speed_active & FDR10 ? " (FDR10)" : "", w->mlnx_epi[i].state_change_enable,
+					w->mlnx_epi[i].changes);
+			fprintf(f, "		latency (us) min: %u , max:%u , average: %" PRIu64 "\n",  t->min_latency_us, t->max_latency_us, target_avg_latency(t));
+			fprintf(f, "		mad/s: %" PRIu64 "\n",  (uint64_t)(target_completed(t) / run_time_s));
 			fprintf(f, "\n");
 		}
 
+		for (i = w->n_targets; i < w->n_targets + w->n_excluded; ++ i)
+			if (w->targets[i].prefetch_status == ENOTSUP)
+				fprintf(f, "	lid: %d excluded, attr not supported by device 0x%x of vendor 0x%x\n",
+					w->targets[i].lid, w->targets[i].device_id, w->targets[i].vendor_id);
+			else
+				fprintf(f, "	lid: %d excluded, pre-fetch status: %d\n", w->targets[i].lid, w->targets[i].prefetch_status);
+
+	}
+
+	for (i = 0; g_n_endpoints > 1 && i < g_n_endpoints; ++i) {
+		struct target_stats sum;
+		uint64_t sum_on_wire = 0;
+
+		memset(&sum, 0, sizeof(sum));
+		for (n = 0; n < nworkers; ++n)
+			if (workers[n].endpoint == i)
+				sum_targets(&workers[n], &sum, &sum_on_wire);
+		fprintf(f, "Endpoint: %s:%d , send mads: %" PRIu64 " , ok mads: %" PRIu64 " , timeouts: %" PRIu64 " , errors %" PRIu64 " , mad/s: %" PRIu64 "\n",
+			g_endpoints[i].ca[0] ? g_endpoints[i].ca : "Default", g_endpoints[i].port,
+			sum.send_mads, sum.ok_mads, sum.timeouts, sum.errors, (uint64_t)(target_completed(&sum) / run_time_s));
 	}
 
 	if (1 /*nworkers > 1*/) {
-		fprintf(f, "Total send mads: %d , ok mads: %d , timeouts: %d , errors %d , mad/s: %d\n",  total_send_mads, total_ok_mads, total_timeouts, total_errors,
-				(int)(total_recv_mads / run_time_s));
+		fprintf(f, "Total send mads: %" PRIu64 " , ok mads: %" PRIu64 " , timeouts: %" PRIu64 " , errors %" PRIu64 " , mad/s: %" PRIu64 "\n",
+			total_send_mads, total_ok_mads, total_timeouts, total_errors, (uint64_t)(total_recv_mads / run_time_s));
+		fprintf(f, "Total lost mads: %" PRIu64 " , on wire at exit: %" PRIu64 "\n", total_lost, total_on_wire);
+		if (workers[0].verify)
+			fprintf(f, "Total verify mismatches: %" PRIu64 "\n", total_mismatches);
+	}
+}
+
+/*
+ * Machine readable results, same counters as print_statistics
+ */
+static void json_str(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; ++s) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+static void json_counters(FILE *f, const struct target_stats *t, uint64_t on_wire, float run_time_s)
+{
+	fprintf(f, "\"send_mads\": %" PRIu64 ", \"ok_mads\": %" PRIu64 ", \"timeouts\": %" PRIu64 ", \"errors\": %" PRIu64 ", "
+		"\"lost\": %" PRIu64 ", \"on_wire\": %" PRIu64 ", \"mismatches\": %" PRIu64 ", \"mad_per_s\": %.1f",
+		t->send_mads, t->ok_mads, t->timeouts, t->errors, t->lost, on_wire,
+		t->mismatches, run_time_s > 0 ? target_completed(t) / run_time_s : 0);
+}
+
+static void json_latency(FILE *f, const struct lat_hist *h, const char *indent)
+{
+	int i, first = 1;
+
+	fprintf(f, "{\n%s\t\"count\": %" PRIu64 ", \"min\": %u, \"max\": %u, \"avg\": %u,\n", indent,
+		h->count, h->min, h->max, lat_hist_avg(h));
+	fprintf(f, "%s\t\"p50\": %u, \"p90\": %u, \"p99\": %u, \"p99_9\": %u, \"p99_99\": %u,\n", indent,
+		lat_hist_percentile(h, 50), lat_hist_percentile(h, 90), lat_hist_percentile(h, 99),
+		lat_hist_percentile(h, 99.9), lat_hist_percentile(h, 99.99));
+
+	/* non-empty buckets only, [lowest value of the bucket, count] */
+	fprintf(f, "%s\t\"histogram\": [", indent);
+	for (i = 0; i < LAT_HIST_BUCKETS; ++i) {
+		if (!h->n[i])
+			continue;
+		fprintf(f, "%s[%u, %" PRIu64 "]", first ? "" : ", ", lat_hist_bucket_low(i), h->n[i]);
+		first = 0;
+	}
+	fprintf(f, "]\n%s}", indent);
+}
+
+static void json_status(FILE *f, int mgmt_class, const struct target_status *st)
+{
+	int i;
+
+	fprintf(f, "\"retransmits\": %" PRIu64 ", \"mad_errors\": %" PRIu64 ", \"late\": %" PRIu64 ", \"duplicates\": %" PRIu64 ", \"mad_status\": {",
+		st->retransmits, st->mad_errors, st->late, st->duplicates);
+	for (i = 0; i < MAD_STATUS_COUNTERS; ++i)
+		fprintf(f, "%s\"%s\": %" PRIu64, i ? ", " : "", mad_status_name(mgmt_class, i), st->n[i]);
+	fprintf(f, "}");
+}
+
+static void json_pm_deltas(FILE *f, const uint64_t *delta)
+{
+	int i;
+
+	fprintf(f, "{");
+	for (i = 0; i < PM_COUNTERS; ++i)
+		fprintf(f, "%s\"%s\": %" PRIu64, i ? ", " : "", pm_counter_names[i], delta[i]);
+	fprintf(f, "}");
+}
+
+/* outcomes with their latency summary, umad statuses by errno */
+static void json_outcomes(FILE *f, const struct lat_hist *outcomes, const uint64_t *umad_status, const char *indent)
+{
+	const struct lat_hist *h;
+	const char *sep = "";
+	int i;
+
+	fprintf(f, "%s\"outcomes\": {\n", indent);
+	for (i = 0; i < MAD_OUTCOMES; ++i) {
+		h = &outcomes[i];
+		fprintf(f, "%s\t\"%s\": {\"count\": %" PRIu64 ", \"min\": %u, \"max\": %u, \"avg\": %u, "
+			"\"p50\": %u, \"p99\": %u, \"p99_9\": %u}%s\n", indent, mad_outcome_names[i],
+			h->count, h->min, h->max, lat_hist_avg(h), lat_hist_percentile(h, 50),
+			lat_hist_percentile(h, 99), lat_hist_percentile(h, 99.9), i + 1 < MAD_OUTCOMES ? "," : "");
+	}
+	fprintf(f, "%s},\n%s\"umad_status\": {", indent, indent);
+	for (i = 1; i < 256; ++i) {
+		if (!umad_status[i])
+			continue;
+		fprintf(f, "%s\"%d\": %" PRIu64, sep, i, umad_status[i]);
+		sep = ", ";
+	}
+	fprintf(f, "}");
+}
+
+void print_json(struct mad_worker *workers, int nworkers, FILE *f)
+{
+	const struct mad_worker *w = &workers[0];
+	const struct target_stats *t;
+	struct target_stats sum, total;
+	struct target_status st, total_st;
+	uint64_t sum_on_wire, total_on_wire = 0, umad_status[256], seq_completed = 0, seq_aborted = 0;
+	struct lat_hist *latency;
+	float run_time_s;
+	int i, n;
+
+	/* all mads, every outcome, first attempt, sequences */
+	latency = (struct lat_hist *)calloc(3 + MAD_OUTCOMES, sizeof(*latency));
+	if (!latency)
+		IBPANIC("can't allocate latency histogram");
+	memset(&total, 0, sizeof(total));
+	memset(&total_st, 0, sizeof(total_st));
+	memset(umad_status, 0, sizeof(umad_status));
+
+	run_time_s = timedifference_sec(workers[0].start, workers[0].end);
+
+	fprintf(f, "{\n");
+	fprintf(f, "\t\"config\": {\n");
+	fprintf(f, "\t\t\"transport\": \"%s\",\n", g_transport->name);
+	fprintf(f, "\t\t\"device\": ");
+	json_str(f, strlen(w->ibd_ca) ? w->ibd_ca : "Default");
+	fprintf(f, ", \"port\": %d,\n", w->ibd_ca_port);
+	fprintf(f, "\t\t\"umad_timeout_ms\": %d, \"umad_retries\": %d, \"sw_timeout_ms\": %d,\n",
+		w->ibd_timeout, w->ibd_retries, w->sw_timeout_ms);
+	fprintf(f, "\t\t\"scenario\": ");
+	if (w->scenario)
+		json_str(f, w->scenario->name);
+	else
+		fprintf(f, "null");
+	fprintf(f, ",\n");
+	fprintf(f, "\t\t\"warmup_ms\": %d, \"warmup_mads\": %" PRIu64 ", \"mad_count\": %" PRIu64 ",\n",
+		w->warmup_ms, w->warmup_mads, w->mad_count);
+	fprintf(f, "\t\t\"perfmgt_ports\": [");
+	for (i = 0; i < g_n_pm_ports; ++i)
+		fprintf(f, "%s%d", i ? ", " : "", g_pm_ports[i]);
+	fprintf(f, "],\n");
+	fprintf(f, "\t\t\"tool_retries\": %d, \"retry_backoff_ms\": %d, \"retry_backoff_max_ms\": %d,\n",
+		w->tool_retries, w->backoff_ms, w->backoff_max_ms);
+	fprintf(f, "\t\t\"quarantine_pct\": %d, \"quarantine_window\": %d, \"probe_ms\": %d,\n",
+		w->quarantine_pct, HEALTH_WINDOW, w->probe_ms);
+	fprintf(f, "\t\t\"mgmt_class\": %d, \"mgmt_method\": %d, \"attr\": %d, \"attr_name\": \"%s\", \"attr_mod\": %d,\n",
+		w->mgmt_class, w->mngt_method, w->smp_attr, class_attribute_name(w->mgmt_class, w->smp_attr), w->smp_mod);
+	fprintf(f, "\t\t\"sa_lid\": %d, \"sa_source_lid\": %d, \"sa_table\": %s,\n", g_sa_lid, g_sa_slid,
+		g_sa_table ? "true" : "false");
+	fprintf(f, "\t\t\"cc\": %s, \"cc_key\": %" PRIu64 ",\n", g_cc ? "true" : "false", g_cc_key);
+	fprintf(f, "\t\t\"source_queue_depth\": %d, \"target_queue_depth\": %d,\n",
+		w->source_queue_depth, w->target_queue_depth);
+	fprintf(f, "\t\t\"run_time_ms\": %d, \"workers\": %d, \"verify\": %s, \"trace\": ",
+		w->timeout_ms, nworkers, w->verify ? "true" : "false");
+	if (g_trace_prefix)
+		json_str(f, g_trace_prefix);
+	else
+		fprintf(f, "null");
+	fprintf(f, "\n\t},\n");
+	fprintf(f, "\t\"run_time_s\": %.3f,\n", run_time_s);
+
+	fprintf(f, "\t\"workers\": [\n");
+	for (n = 0; n < nworkers; ++n) {
+		w = &workers[n];
+
+		memset(&sum, 0, sizeof(sum));
+		sum_on_wire = 0;
+		sum_targets(w, &sum, &sum_on_wire);
+		sum_targets(w, &total, &total_on_wire);
+		lat_hist_merge(latency, &w->latency);
+		memset(&st, 0, sizeof(st));
+		sum_status(w, &st);
+		sum_status(w, &total_st);
+		for (i = 0; i < MAD_OUTCOMES; ++i)
+			lat_hist_merge(&latency[1 + i], &w->lat_outcome[i]);
+		lat_hist_merge(&latency[1 + MAD_OUTCOMES], &w->lat_first);
+		lat_hist_merge(&latency[2 + MAD_OUTCOMES], &w->seq_latency);
+		seq_completed += w->seq_completed;
+		seq_aborted += w->seq_aborted;
+		for (i = 0; i < 256; ++i)
+			umad_status[i] += w->umad_status[i];
+
+		fprintf(f, "\t\t{\n\t\t\t\"id\": %d, \"device\": ", w->id);
+		json_str(f, strlen(w->ibd_ca) ? w->ibd_ca : "Default");
+		fprintf(f, ", \"port\": %d, \"endpoint\": %d,\n\t\t\t", w->ibd_ca_port, w->endpoint);
+		json_counters(f, &sum, sum_on_wire, run_time_s);
+		fprintf(f, ",\n\t\t\t\"warmup_ms\": %.2f, \"attr\": %d, ", w->warmup_us / 1000.0, w->smp_attr);
+		json_status(f, w->mgmt_class, &st);
+		fprintf(f, ",\n");
+		json_outcomes(f, w->lat_outcome, w->umad_status, "\t\t\t");
+		fprintf(f, ",\n");
+		if (prefetch_needed(w))
+			fprintf(f, "\t\t\t\"prefetch\": {\"targets\": %d, \"ms\": %.2f, \"excluded\": %d},\n",
+				w->n_targets + w->n_excluded, w->prefetch_us / 1000.0, w->n_excluded);
+		if (w->trace.hdr)
+			fprintf(f, "\t\t\t\"trace\": {\"records\": %" PRIu64 ", \"overhead_ms\": %.3f},\n",
+				w->trace.head, mad_trace_overhead_ns(&w->trace) / 1e6);
+		fprintf(f, "\t\t\t\"latency_us\": ");
+		json_latency(f, &w->latency, "\t\t\t");
+		fprintf(f, ",\n");
+		if (w->tool_retries) {
+			fprintf(f, "\t\t\t\"attempts\": [");
+			for (i = 1; i <= w->tool_retries + 1; ++i)
+				fprintf(f, "%s%" PRIu64, i > 1 ? ", " : "", w->attempts[i]);
+			fprintf(f, "],\n\t\t\t\"first_attempt_latency_us\": ");
+			json_latency(f, &w->lat_first, "\t\t\t");
+			fprintf(f, ",\n\t\t\t\"retransmitted_latency_us\": ");
+			json_latency(f, &w->lat_retried, "\t\t\t");
+			fprintf(f, ",\n");
+		}
+		if (w->scenario) {
+			fprintf(f, "\t\t\t\"sequences\": {\"completed\": %" PRIu64 ", \"aborted\": %" PRIu64 ", \"active\": %d, \"latency_us\": ",
+				w->seq_completed, w->seq_aborted, w->n_active_seqs);
+			json_latency(f, &w->seq_latency, "\t\t\t");
+			fprintf(f, "},\n");
+		}
+		if (w->attr_stats) {
+			fprintf(f, "\t\t\t\"attributes\": [\n");
+			for (i = 0; i < g_n_attr_rows; ++i) {
+				const struct attr_stats *a = &w->attr_stats[i];
+
+				fprintf(f, "\t\t\t\t{\"mgmt_class\": %d, \"attr\": %d, \"name\": \"%s\", \"method\": %d, \"ok\": %" PRIu64
+					", \"errors\": %" PRIu64 ", \"timeouts\": %" PRIu64 ", \"latency_us\": ",
+					a->mgmt_class, a->attr, class_attribute_name(a->mgmt_class, a->attr), a->method,
+					a->ok, a->errors, a->timeouts);
+				json_latency(f, &a->latency, "\t\t\t\t");
+				fprintf(f, "}%s\n", i + 1 < g_n_attr_rows ? "," : "");
+			}
+			fprintf(f, "\t\t\t],\n");
+		}
+		if (w->mix_next)
+			fprintf(f, "\t\t\t\"agent_mismatches\": %" PRIu64 ",\n", w->agent_mismatches);
+		fprintf(f, "\t\t\t\"stale_tids\": %" PRIu64 ", \"unknown_tids\": %" PRIu64 ", \"late_latency_us\": ",
+			w->stale_tids, w->unknown_tids);
+		json_latency(f, &w->lat_late, "\t\t\t");
+		fprintf(f, ",\n");
+		if (w->mgmt_class == IB_SA_CLASS)
+			fprintf(f, "\t\t\t\"sa\": {\"records\": %" PRIu64 ", \"bytes\": %" PRIu64 ", \"bytes_per_s\": %.0f, "
+				"\"rmpp_transfers\": %" PRIu64 ", \"rmpp_segments\": %" PRIu64 "},\n",
+				w->sa_records, w->sa_bytes, run_time_s > 0 ? w->sa_bytes / run_time_s : 0,
+				w->rmpp_transfers, w->rmpp_segments);
+		if (w->pm) {
+			fprintf(f, "\t\t\t\"perfmgt\": {\"sweeps\": %" PRIu64 ", \"ports_per_sweep\": %d, \"deltas\": ",
+				w->pm_sweeps, w->n_targets * g_n_pm_ports);
+			json_pm_deltas(f, w->pm_delta);
+			fprintf(f, ", \"sweep_time_us\": ");
+			json_latency(f, &w->pm_sweep_time, "\t\t\t");
+			fprintf(f, "},\n");
+		}
+
+		fprintf(f, "\t\t\t\"targets\": [\n");
+		for (i = 0; i < w->n_targets; ++i) {
+			t = &w->stats[i];
+			fprintf(f, "\t\t\t\t{\"lid\": %u, ", w->targets[i].lid);
+			json_counters(f, t, w->on_wire[i], run_time_s);
+			fprintf(f, ", ");
+			json_status(f, w->mgmt_class, &w->mad_status[i]);
+			if (w->seq)
+				fprintf(f, ", \"sequences\": {\"completed\": %" PRIu64 ", \"aborted\": %" PRIu64 "}",
+					w->seq[i].completed, w->seq[i].aborted);
+			if (w->pm) {
+				fprintf(f, ", \"pm_deltas\": ");
+				json_pm_deltas(f, w->pm[i].delta);
+			}
+			if (w->health)
+				fprintf(f, ", \"quarantine\": {\"count\": %" PRIu64 ", \"ms\": %.2f, \"at_exit\": %s, \"probes\": %" PRIu64 "}",
+					w->health[i].quarantines, w->health[i].quarantined_us / 1000.0,
+					w->health[i].quarantined ? "true" : "false", w->health[i].probes);
+			if (w->mlnx_epi && w->mlnx_epi[i].valid)
+				fprintf(f, ", \"mlnx_ext_port_info\": {\"link_speed_supported\": %d, \"link_speed_enabled\": %d, "
+					"\"link_speed_active\": %d, \"state_change_enable\": %d, \"changes\": %" PRIu64 "}",
+					w->mlnx_epi[i].link_speed_supported, w->mlnx_epi[i].link_speed_enabled,
+					w->mlnx_epi[i].link_speed_active, w->mlnx_epi[i].state_change_enable, w->mlnx_epi[i].changes);
+			fprintf(f, ", \"latency_us\": {\"min\": %u, \"max\": %u, \"avg\": %" PRIu64 ", \"p99\": %u, \"p99_9\": %u}}%s\n",
+				t->min_latency_us, t->max_latency_us, target_avg_latency(t),
+				target_percentile(t, &w->lat_log2[i], 99), target_percentile(t, &w->lat_log2[i], 99.9),
+				i + 1 < w->n_targets ? "," : "");
+		}
+		fprintf(f, "\t\t\t],\n");
+
+		fprintf(f, "\t\t\t\"excluded\": [");
+		for (i = w->n_targets; i < w->n_targets + w->n_excluded; ++i)
+			fprintf(f, "%s{\"lid\": %u, \"prefetch_status\": %d, \"vendor_id\": %u, \"device_id\": %u}",
+				i > w->n_targets ? ", " : "", w->targets[i].lid, w->targets[i].prefetch_status,
+				w->targets[i].vendor_id, w->targets[i].device_id);
+		fprintf(f, "]\n\t\t}%s\n", n + 1 < nworkers ? "," : "");
+	}
+	fprintf(f, "\t],\n");
+
+	fprintf(f, "\t\"endpoints\": [\n");
+	for (i = 0; i < g_n_endpoints; ++i) {
+		memset(&sum, 0, sizeof(sum));
+		sum_on_wire = 0;
+		fprintf(f, "\t\t{\"device\": ");
+		json_str(f, g_endpoints[i].ca[0] ? g_endpoints[i].ca : "Default");
+		fprintf(f, ", \"port\": %d, \"workers\": [", g_endpoints[i].port);
+		for (n = i; n < nworkers; n += g_n_endpoints) {
+			fprintf(f, "%s%d", n > i ? ", " : "", n);
+			sum_targets(&workers[n], &sum, &sum_on_wire);
+		}
+		fprintf(f, "], ");
+		json_counters(f, &sum, sum_on_wire, run_time_s);
+		fprintf(f, "}%s\n", i + 1 < g_n_endpoints ? "," : "");
+	}
+	fprintf(f, "\t],\n");
+
+	fprintf(f, "\t\"total\": {\n\t\t");
+	json_counters(f, &total, total_on_wire, run_time_s);
+	fprintf(f, ",\n\t\t");
+	json_status(f, workers[0].mgmt_class, &total_st);
+	fprintf(f, ",\n");
+	json_outcomes(f, &latency[1], umad_status, "\t\t");
+	fprintf(f, ",\n\t\t\"latency_us\": ");
+	json_latency(f, latency, "\t\t");
+	if (workers[0].tool_retries) {
+		fprintf(f, ",\n\t\t\"first_attempt_latency_us\": ");
+		json_latency(f, &latency[1 + MAD_OUTCOMES], "\t\t");
+	}
+	if (workers[0].scenario) {
+		fprintf(f, ",\n\t\t\"sequences\": {\"completed\": %" PRIu64 ", \"aborted\": %" PRIu64 ", \"latency_us\": ",
+			seq_completed, seq_aborted);
+		json_latency(f, &latency[2 + MAD_OUTCOMES], "\t\t");
+		fprintf(f, "}");
+	}
+	fprintf(f, "\n\t}\n}\n");
+
+	free(latency);
+}
+
+/* one line per target, excluded targets included */
+void print_csv(struct mad_worker *workers, int nworkers, FILE *f)
+{
+	const struct mad_worker *w;
+	const struct target_stats *t;
+	const struct target_status *st;
+	float run_time_s;
+	int i, j, n;
+
+	run_time_s = timedifference_sec(workers[0].start, workers[0].end);
+
+	fprintf(f, "worker,lid,send_mads,ok_mads,timeouts,errors,lost,on_wire,mismatches,"
+		"min_latency_us,max_latency_us,avg_latency_us,mad_per_s,excluded,prefetch_status,retransmits,seq_completed,seq_aborted,mad_errors,late,duplicates,quarantines,quarantined_ms");
+	for (j = 0; j < MAD_STATUS_COUNTERS; ++j)
+		fprintf(f, ",%s", mad_status_name(workers[0].mgmt_class, j));
+	for (j = 0; workers[0].pm && j < PM_COUNTERS; ++j)
+		fprintf(f, ",pm_%s", pm_counter_names[j]);
+	fprintf(f, "\n");
+	for (n = 0; n < nworkers; ++n) {
+		w = &workers[n];
+		for (i = 0; i < w->n_targets + w->n_excluded; ++i) {
+			t = &w->stats[i];
+			st = &w->mad_status[i];
+			fprintf(f, "%d,%u,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%d,%" PRIu64 ",%u,%u,%" PRIu64 ",%.1f,%d,%d,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%.2f",
+				w->id, w->targets[i].lid, t->send_mads, t->ok_mads, t->timeouts, t->errors, t->lost,
+				w->on_wire[i], t->mismatches, t->min_latency_us, t->max_latency_us, target_avg_latency(t),
+				run_time_s > 0 ? target_completed(t) / run_time_s : 0,
+				i >= w->n_targets, w->targets[i].prefetch_status, st->retransmits,
+				w->seq ? w->seq[i].completed : 0, w->seq ? w->seq[i].aborted : 0, st->mad_errors,
+				st->late, st->duplicates, w->health ? w->health[i].quarantines : 0,
+				w->health ? w->health[i].quarantined_us / 1000.0 : 0);
+			for (j = 0; j < MAD_STATUS_COUNTERS; ++j)
+				fprintf(f, ",%" PRIu64, st->n[j]);
+			for (j = 0; w->pm && j < PM_COUNTERS; ++j)
+				fprintf(f, ",%" PRIu64, w->pm[i].delta[j]);
+			fprintf(f, "\n");
+		}
 	}
 }
 
+/*
+ * Prometheus text format of the published snapshots, runs on the metrics
+ * server thread. Histogram bounds are 2^b - 1 us, exact for both the worker
+ * histogram and the per target power of 2 buckets.
+ */
+#define METRIC(name, type, help) \
+	fprintf(f, "# HELP smp_mad_stress_" name " " help "\n# TYPE smp_mad_stress_" name " " type "\n")
+
+/* one series of a histogram from a lat_hist, labels without braces */
+static void prom_lat_hist(FILE *f, const char *name, const char *labels, const struct lat_hist *h)
+{
+	uint64_t cum = 0;
+	int b, j;
+
+	for (b = 0, j = 0; b < LAT_LOG2_BUCKETS - 1; ++b) {
+		for (; j < lat_hist_bucket((1u << b)); ++j)
+			cum += h->n[j];
+		fprintf(f, "smp_mad_stress_%s_bucket{%s,le=\"%u\"} %" PRIu64 "\n", name, labels, (1u << b) - 1, cum);
+	}
+	fprintf(f, "smp_mad_stress_%s_bucket{%s,le=\"+Inf\"} %" PRIu64 "\n", name, labels, h->count);
+	fprintf(f, "smp_mad_stress_%s_sum{%s} %" PRIu64 "\n", name, labels, h->sum);
+	fprintf(f, "smp_mad_stress_%s_count{%s} %" PRIu64 "\n", name, labels, h->count);
+}
+
+static void render_metrics(FILE *f, void *ctx)
+{
+	struct mad_worker *workers = (struct mad_worker *)ctx;
+	struct mad_snapshot *snaps;
+	const struct mad_snapshot *sn;
+	const struct target_stats *t;
+	char labels[64];
+	uint64_t cum;
+	uint32_t lid;
+	int i, n, b, j;
+
+	snaps = (struct mad_snapshot *)calloc(g_nworkers, sizeof(snaps[0]));
+	if (!snaps)
+		return;
+	for (n = 0; n < g_nworkers; ++n) {
+		if (!__atomic_load_n(&workers[n].snap->seq, __ATOMIC_ACQUIRE))
+			continue;
+		if (!alloc_snapshot(&snaps[n], workers[n].snap->cap))
+			read_snapshot(workers[n].snap, &snaps[n]);
+	}
+
+#define FOR_EACH_TARGET \
+	for (n = 0; n < g_nworkers; ++n) \
+		for (sn = &snaps[n], i = 0; sn->seq && i < sn->n_targets && \
+		     (t = &sn->stats[i], lid = sn->targets[i].lid, 1); ++i)
+
+	METRIC("run_seconds", "gauge", "Time since the worker started sending mads.");
+	for (n = 0; n < g_nworkers; ++n)
+		if (snaps[n].seq)
+			fprintf(f, "smp_mad_stress_run_seconds{worker=\"%d\"} %.3f\n", n, snaps[n].run_us / 1e6);
+
+	METRIC("excluded_targets", "gauge", "Targets excluded after a failed pre-fetch.");
+	for (n = 0; n < g_nworkers; ++n)
+		if (snaps[n].seq)
+			fprintf(f, "smp_mad_stress_excluded_targets{worker=\"%d\"} %d\n", n, snaps[n].n_excluded);
+
+	METRIC("mads_sent_total", "counter", "Mads sent.");
+	FOR_EACH_TARGET
+		fprintf(f, "smp_mad_stress_mads_sent_total{worker=\"%d\",lid=\"%u\"} %" PRIu64 "\n", n, lid, t->send_mads);
+
+	METRIC("mads_completed_total", "counter", "Mads completed by the driver, by result.");
+	FOR_EACH_TARGET {
+		fprintf(f, "smp_mad_stress_mads_completed_total{worker=\"%d\",lid=\"%u\",result=\"ok\"} %" PRIu64 "\n", n, lid, t->ok_mads);
+		fprintf(f, "smp_mad_stress_mads_completed_total{worker=\"%d\",lid=\"%u\",result=\"timeout\"} %" PRIu64 "\n", n, lid, t->timeouts);
+		fprintf(f, "smp_mad_stress_mads_completed_total{worker=\"%d\",lid=\"%u\",result=\"error\"} %" PRIu64 "\n", n, lid, t->errors);
+	}
+
+	METRIC("mads_lost_total", "counter", "Mads reclaimed by the software timeout.");
+	FOR_EACH_TARGET
+		fprintf(f, "smp_mad_stress_mads_lost_total{worker=\"%d\",lid=\"%u\"} %" PRIu64 "\n", n, lid, t->lost);
+
+	METRIC("mads_on_wire", "gauge", "Mads in flight.");
+	FOR_EACH_TARGET
+		fprintf(f, "smp_mad_stress_mads_on_wire{worker=\"%d\",lid=\"%u\"} %d\n", n, lid, sn->on_wire[i]);
+
+	if (workers[0].verify) {
+		METRIC("verify_mismatches_total", "counter", "Ok responces which differ from the data snapshot.");
+		FOR_EACH_TARGET
+			fprintf(f, "smp_mad_stress_verify_mismatches_total{worker=\"%d\",lid=\"%u\"} %" PRIu64 "\n", n, lid, t->mismatches);
+	}
+
+	if (workers[0].tool_retries) {
+		METRIC("retransmits_total", "counter", "Attempts timed out and sent again by the tool.");
+		FOR_EACH_TARGET
+			fprintf(f, "smp_mad_stress_retransmits_total{worker=\"%d\",lid=\"%u\"} %" PRIu64 "\n",
+				n, lid, sn->mad_status[i].retransmits);
+	}
+
+	METRIC("late_responces_total", "counter", "Responces after their mad timed out or was reclaimed.");
+	FOR_EACH_TARGET
+		fprintf(f, "smp_mad_stress_late_responces_total{worker=\"%d\",lid=\"%u\"} %" PRIu64 "\n",
+			n, lid, sn->mad_status[i].late);
+
+	METRIC("duplicate_responces_total", "counter", "Responces to a mad which was already answered.");
+	FOR_EACH_TARGET
+		fprintf(f, "smp_mad_stress_duplicate_responces_total{worker=\"%d\",lid=\"%u\"} %" PRIu64 "\n",
+			n, lid, sn->mad_status[i].duplicates);
+
+	METRIC("mad_status_errors_total", "counter", "Responces with a non zero MAD status.");
+	FOR_EACH_TARGET
+		fprintf(f, "smp_mad_stress_mad_status_errors_total{worker=\"%d\",lid=\"%u\",attr=\"%d\"} %" PRIu64 "\n",
+			n, lid, workers[n].smp_attr, sn->mad_status[i].mad_errors);
+
+	METRIC("mad_status_total", "counter", "Responces by MAD status bit or invalid field code.");
+	FOR_EACH_TARGET
+		for (j = 0; j < MAD_STATUS_COUNTERS; ++j)
+			if (sn->mad_status[i].n[j])
+				fprintf(f, "smp_mad_stress_mad_status_total{worker=\"%d\",lid=\"%u\",attr=\"%d\",status=\"%s\"} %" PRIu64 "\n",
+					n, lid, workers[n].smp_attr, mad_status_name(workers[n].mgmt_class, j), sn->mad_status[i].n[j]);
+
+	METRIC("umad_status_total", "counter", "Completions with a non zero umad status, by errno.");
+	for (n = 0; n < g_nworkers; ++n)
+		for (j = 1; snaps[n].seq && j < 256; ++j)
+			if (snaps[n].umad_status[j])
+				fprintf(f, "smp_mad_stress_umad_status_total{worker=\"%d\",errno=\"%d\"} %" PRIu64 "\n",
+					n, j, snaps[n].umad_status[j]);
+
+	METRIC("worker_latency_us", "histogram", "Latency of completed mads of a worker.");
+	for (n = 0; n < g_nworkers; ++n) {
+		if (!snaps[n].seq)
+			continue;
+		snprintf(labels, sizeof(labels), "worker=\"%d\"", n);
+		prom_lat_hist(f, "worker_latency_us", labels, &snaps[n].latency);
+	}
+
+	if (workers[0].tool_retries) {
+		METRIC("attempt_latency_us", "histogram", "Latency of mads answered by the first attempt or by a retransmit.");
+		for (n = 0; n < g_nworkers; ++n) {
+			if (!snaps[n].seq)
+				continue;
+			snprintf(labels, sizeof(labels), "worker=\"%d\",attempt=\"first\"", n);
+			prom_lat_hist(f, "attempt_latency_us", labels, &snaps[n].lat_first);
+			snprintf(labels, sizeof(labels), "worker=\"%d\",attempt=\"retransmit\"", n);
+			prom_lat_hist(f, "attempt_latency_us", labels, &snaps[n].lat_retried);
+		}
+	}
+
+	if (workers[0].scenario) {
+		METRIC("sequences_total", "counter", "Scenario sequences which are over, by result.");
+		for (n = 0; n < g_nworkers; ++n) {
+			if (!snaps[n].seq)
+				continue;
+			fprintf(f, "smp_mad_stress_sequences_total{worker=\"%d\",result=\"completed\"} %" PRIu64 "\n",
+				n, snaps[n].seq_completed);
+			fprintf(f, "smp_mad_stress_sequences_total{worker=\"%d\",result=\"aborted\"} %" PRIu64 "\n",
+				n, snaps[n].seq_aborted);
+		}
+
+		METRIC("sequence_latency_us", "histogram", "First send to last completion of completed sequences.");
+		for (n = 0; n < g_nworkers; ++n) {
+			if (!snaps[n].seq)
+				continue;
+			snprintf(labels, sizeof(labels), "worker=\"%d\",scenario=\"%s\"", n, workers[n].scenario->name);
+			prom_lat_hist(f, "sequence_latency_us", labels, &snaps[n].seq_latency);
+		}
+	}
+
+	if (workers[0].pm) {
+		METRIC("pm_sweeps_total", "counter", "Completed PerfMgt sweeps of every port of every target.");
+		for (n = 0; n < g_nworkers; ++n)
+			if (snaps[n].seq)
+				fprintf(f, "smp_mad_stress_pm_sweeps_total{worker=\"%d\"} %" PRIu64 "\n", n, snaps[n].pm_sweeps);
+
+		METRIC("pm_sweep_time_us", "histogram", "Time of a PerfMgt sweep, first Get to last completion.");
+		for (n = 0; n < g_nworkers; ++n) {
+			if (!snaps[n].seq)
+				continue;
+			snprintf(labels, sizeof(labels), "worker=\"%d\"", n);
+			prom_lat_hist(f, "pm_sweep_time_us", labels, &snaps[n].pm_sweep_time);
+		}
+
+		METRIC("pm_delta_total", "counter", "Growth of port counters between sweeps, all ports of all targets.");
+		for (n = 0; n < g_nworkers; ++n)
+			for (j = 0; snaps[n].seq && j < PM_COUNTERS; ++j)
+				fprintf(f, "smp_mad_stress_pm_delta_total{worker=\"%d\",counter=\"%s\"} %" PRIu64 "\n",
+					n, pm_counter_names[j], snaps[n].pm_delta[j]);
+	}
+
+	if (workers[0].attr_stats) {
+		METRIC("attr_mads_total", "counter", "Completed mads by class, attribute, method and result.");
+		for (n = 0; n < g_nworkers; ++n)
+			for (j = 0; snaps[n].seq && j < g_n_attr_rows; ++j) {
+				const struct attr_stats *a = &snaps[n].attr_stats[j];
+
+				fprintf(f, "smp_mad_stress_attr_mads_total{worker=\"%d\",class=\"%s\",attr=\"%d\",method=\"%d\",result=\"ok\"} %" PRIu64 "\n",
+					n, class_name(a->mgmt_class), a->attr, a->method, a->ok);
+				fprintf(f, "smp_mad_stress_attr_mads_total{worker=\"%d\",class=\"%s\",attr=\"%d\",method=\"%d\",result=\"error\"} %" PRIu64 "\n",
+					n, class_name(a->mgmt_class), a->attr, a->method, a->errors);
+				fprintf(f, "smp_mad_stress_attr_mads_total{worker=\"%d\",class=\"%s\",attr=\"%d\",method=\"%d\",result=\"timeout\"} %" PRIu64 "\n",
+					n, class_name(a->mgmt_class), a->attr, a->method, a->timeouts);
+			}
+
+		METRIC("attr_latency_us", "histogram", "Latency of completed mads by class, attribute and method.");
+		for (n = 0; n < g_nworkers; ++n)
+			for (j = 0; snaps[n].seq && j < g_n_attr_rows; ++j) {
+				snprintf(labels, sizeof(labels), "worker=\"%d\",class=\"%s\",attr=\"%d\",method=\"%d\"",
+					 n, class_name(snaps[n].attr_stats[j].mgmt_class), snaps[n].attr_stats[j].attr,
+					 snaps[n].attr_stats[j].method);
+				prom_lat_hist(f, "attr_latency_us", labels, &snaps[n].attr_stats[j].latency);
+			}
+	}
+
+	if (workers[0].mgmt_class == IB_SA_CLASS) {
+		METRIC("sa_records_total", "counter", "Records of ok SA responces.");
+		for (n = 0; n < g_nworkers; ++n)
+			if (snaps[n].seq)
+				fprintf(f, "smp_mad_stress_sa_records_total{worker=\"%d\",attr=\"%d\"} %" PRIu64 "\n",
+					n, workers[n].smp_attr, snaps[n].sa_records);
+
+		METRIC("sa_bytes_total", "counter", "SA data of ok responces, RMPP transfers reassembled.");
+		for (n = 0; n < g_nworkers; ++n)
+			if (snaps[n].seq)
+				fprintf(f, "smp_mad_stress_sa_bytes_total{worker=\"%d\",attr=\"%d\"} %" PRIu64 "\n",
+					n, workers[n].smp_attr, snaps[n].sa_bytes);
+	}
+
+	METRIC("outcome_latency_us", "histogram", "Latency of completed mads of a worker, by outcome.");
+	for (n = 0; n < g_nworkers; ++n)
+		for (j = 0; snaps[n].seq && j < MAD_OUTCOMES; ++j) {
+			snprintf(labels, sizeof(labels), "worker=\"%d\",attr=\"%d\",outcome=\"%s\"",
+				 n, workers[n].smp_attr, mad_outcome_names[j]);
+			prom_lat_hist(f, "outcome_latency_us", labels, &snaps[n].lat_outcome[j]);
+		}
+
+	METRIC("target_latency_us", "histogram", "Latency of completed mads of a target.");
+	FOR_EACH_TARGET {
+		for (b = 0, cum = 0; b < LAT_LOG2_BUCKETS - 1; ++b) {
+			cum += sn->lat_log2[i].n[b];
+			fprintf(f, "smp_mad_stress_target_latency_us_bucket{worker=\"%d\",lid=\"%u\",le=\"%u\"} %" PRIu64 "\n",
+				n, lid, (1u << b) - 1, cum);
+		}
+		cum += sn->lat_log2[i].n[b];
+		fprintf(f, "smp_mad_stress_target_latency_us_bucket{worker=\"%d\",lid=\"%u\",le=\"+Inf\"} %" PRIu64 "\n", n, lid, cum);
+		fprintf(f, "smp_mad_stress_target_latency_us_sum{worker=\"%d\",lid=\"%u\"} %" PRIu64 "\n", n, lid, t->total_time_us);
+		fprintf(f, "smp_mad_stress_target_latency_us_count{worker=\"%d\",lid=\"%u\"} %" PRIu64 "\n", n, lid, cum);
+	}
+#undef FOR_EACH_TARGET
+
+	for (n = 0; n < g_nworkers; ++n)
+		free_snapshot(&snaps[n]);
+	free(snaps);
+}
+
 void check_worker(const struct mad_worker *w)
 {
 	if (w->mngt_method != 1 && w->mngt_method != 2 )
@@ -643,12 +3694,195 @@ void check_worker(const struct mad_worker *w)
 		IBPANIC("mad queue depth for destination device is too big: %d , max : %d", w->target_queue_depth, MAX_TARGET_QUEUE_DEPTH);
 	if (w->source_queue_depth > MAX_SOURCE_QUEUE_DEPTH)
 		IBPANIC("mad queue for local device is tool long: %d , max : %d", w->source_queue_depth, MAX_SOURCE_QUEUE_DEPTH);
-	if (w->mgmt_class != IB_SMI_DIRECT_CLASS && w->mgmt_class != IB_SMI_CLASS)
+	if (w->mgmt_class != IB_SMI_DIRECT_CLASS && w->mgmt_class != IB_SMI_CLASS &&
+	    w->mgmt_class != IB_PERFORMANCE_CLASS && w->mgmt_class != IB_SA_CLASS && w->mgmt_class != IB_CC_CLASS)
 		IBPANIC("wrong mngt method : %d", w->mgmt_class);
+	if (w->mgmt_class == IB_PERFORMANCE_CLASS && (w->mngt_method != mngt_method_get || w->verify || w->scenario))
+		IBPANIC("perfmgt sweeps only Get counters, -m, --verify and --scenario don't apply");
+	if (w->mgmt_class == IB_SA_CLASS && (w->mngt_method != mngt_method_get || w->verify || w->scenario))
+		IBPANIC("SA queries are Gets of records, -m, --verify and --scenario don't apply");
+	if (w->mgmt_class == IB_CC_CLASS && (w->mngt_method != mngt_method_get || w->verify || w->scenario))
+		IBPANIC("the CC mix sets the methods, -m, --verify and --scenario don't apply");
+	if (g_classes && (w->mngt_method != mngt_method_get || w->verify || w->scenario))
+		IBPANIC("the class mix only Gets, -m, --verify and --scenario don't apply");
+	if (w->warmup_ms < 0)
+		IBPANIC("wrong warmup time: %d ms", w->warmup_ms);
+	if (!w->timeout_ms && !w->mad_count)
+		IBWARN("neither run time (-t) nor mads per target (--count) is set, nothing is sent");
+	if (w->scenario && (w->mngt_method != mngt_method_get || w->verify))
+		IBPANIC("scenario %s sets its own methods and checks, -m and --verify don't apply", w->scenario->name);
+	if (w->tool_retries < 0 || w->tool_retries > MAX_TOOL_RETRIES)
+		IBPANIC("tool retries must be 0..%d: %d", MAX_TOOL_RETRIES, w->tool_retries);
+	if (w->backoff_ms < 0 || w->backoff_max_ms < 0)
+		IBPANIC("wrong retry backoff: %d:%d", w->backoff_ms, w->backoff_max_ms);
+	if (w->quarantine_pct < 0 || w->quarantine_pct > 100 || w->probe_ms < 1)
+		IBPANIC("quarantine must be 1..100 %% with a probe interval of at least 1 ms: %d:%d", w->quarantine_pct, w->probe_ms);
 	if (w->source_queue_depth < w->target_queue_depth)
 		IBWARN("local queue depth is lower than target queue depth %d < %d", w->source_queue_depth, w->target_queue_depth);
 }
 
+const char *pm_attribute_name(int attr)
+{
+	return attr == PM_ATTR_PORT_COUNTERS_EXT ? "PortCountersExtended" : "PortCounters";
+}
+
+const char *sa_attribute_name(int attr)
+{
+	switch (attr) {
+	case SA_ATTR_NODE_RECORD:
+		return "NodeRecord";
+	case SA_ATTR_PORTINFO_RECORD:
+		return "PortInfoRecord";
+	case SA_ATTR_PATH_RECORD:
+		return "PathRecord";
+	}
+	return "Unknown";
+}
+
+#define CC_ATTRIBUTES 0x19
+static const struct {
+	const char *name;
+	const char *short_name;
+} cc_attributes[CC_ATTRIBUTES] = {
+	[0x11] = {"CongestionInfo", "info"},
+	[0x12] = {"CongestionKeyInfo", "key_info"},
+	[0x13] = {"CongestionLog", "log"},
+	[0x14] = {"SwitchCongestionSetting", "sw_setting"},
+	[0x15] = {"SwitchPortCongestionSetting", "sw_port_setting"},
+	[0x16] = {"CACongestionSetting", "ca_setting"},
+	[0x17] = {"CongestionControlTable", "table"},
+	[0x18] = {"TimeStamp", "timestamp"},
+};
+
+const char *cc_attribute_name(int attr)
+{
+	if (attr < 0 || attr >= CC_ATTRIBUTES || !cc_attributes[attr].name)
+		return "Unknown";
+	return cc_attributes[attr].name;
+}
+
+static const struct {
+	const char *name;
+	uint8_t mgmt_class;
+} mgmt_classes[] = {
+	{"smi", IB_SMI_CLASS},
+	{"dr", IB_SMI_DIRECT_CLASS},
+	{"pm", IB_PERFORMANCE_CLASS},
+	{"sa", IB_SA_CLASS},
+	{"cc", IB_CC_CLASS},
+	{}
+};
+
+static const char *class_name(int mgmt_class)
+{
+	int i;
+
+	for (i = 0; mgmt_classes[i].name; ++i)
+		if (mgmt_classes[i].mgmt_class == mgmt_class)
+			return mgmt_classes[i].name;
+	return "unknown";
+}
+
+static int attr_row(int mgmt_class, int attr, int method)
+{
+	int i;
+
+	for (i = 0; i < g_n_attr_rows; ++i)
+		if (g_attr_rows[i].mgmt_class == mgmt_class && g_attr_rows[i].attr == attr &&
+		    g_attr_rows[i].method == method)
+			return i;
+	g_attr_rows[i].mgmt_class = mgmt_class;
+	g_attr_rows[i].attr = attr;
+	g_attr_rows[i].method = method;
+	lat_hist_init(&g_attr_rows[i].latency);
+	return g_n_attr_rows++;
+}
+
+/* <attr>[:set],.. attr by number or short name */
+static int parse_cc_mix(char *str)
+{
+	struct cc_entry *e;
+	char *tok, *save, *m, *end;
+	int a;
+
+	for (tok = strtok_r(str, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		if (g_n_cc_mix == CC_MIX_MAX)
+			return -1;
+		e = &g_cc_mix[g_n_cc_mix++];
+
+		m = strchr(tok, ':');
+		if (m)
+			*m++ = 0;
+		e->attr = strtoul(tok, &end, 0);
+		if (*end || end == tok)
+			for (e->attr = 0, a = 0; a < CC_ATTRIBUTES; ++a)
+				if (cc_attributes[a].short_name && !strcmp(cc_attributes[a].short_name, tok))
+					e->attr = a;
+		if (!strcmp(cc_attribute_name(e->attr), "Unknown"))
+			return -1;
+
+		e->method = mngt_method_get;
+		e->set_idx = -1;
+		if (m && !strcmp(m, "set")) {
+			e->method = mngt_method_set;
+			e->set_idx = g_n_cc_set++;
+			e->get_row = attr_row(IB_CC_CLASS, e->attr, mngt_method_get);
+		} else if (m && strcmp(m, "get")) {
+			return -1;
+		}
+		e->row = attr_row(IB_CC_CLASS, e->attr, e->method);
+	}
+	return g_n_cc_mix ? 0 : -1;
+}
+
+/*
+ * smi and dr send attr/mod, dr to the SMA of the local port, pm
+ * PortCounters of port mod, sa the NodeRecord of the target, cc
+ * CongestionInfo
+ */
+static int parse_class_mix(char *str, int attr, int mod)
+{
+	struct class_entry *e;
+	char *tok, *save;
+	int i;
+
+	for (tok = strtok_r(str, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		if (g_n_class_mix == CLASS_MIX_MAX)
+			return -1;
+		e = &g_class_mix[g_n_class_mix++];
+
+		for (i = 0; mgmt_classes[i].name && strcmp(mgmt_classes[i].name, tok); ++i)
+			;
+		if (!mgmt_classes[i].name)
+			return -1;
+		e->mgmt_class = mgmt_classes[i].mgmt_class;
+		e->attr = attr;
+		e->mod = mod;
+		if (e->mgmt_class == IB_PERFORMANCE_CLASS) {
+			e->attr = PM_ATTR_PORT_COUNTERS;
+		} else if (e->mgmt_class == IB_SA_CLASS) {
+			e->attr = SA_ATTR_NODE_RECORD;
+			e->mod = 0;
+		} else if (e->mgmt_class == IB_CC_CLASS) {
+			e->attr = 0x11; // CongestionInfo
+			e->mod = 0;
+		}
+		attr_row(e->mgmt_class, e->attr, mngt_method_get);
+	}
+	return g_n_class_mix ? 0 : -1;
+}
+
+const char *class_attribute_name(int mgmt_class, int attr)
+{
+	if (mgmt_class == IB_PERFORMANCE_CLASS)
+		return pm_attribute_name(attr);
+	if (mgmt_class == IB_SA_CLASS)
+		return sa_attribute_name(attr);
+	if (mgmt_class == IB_CC_CLASS)
+		return cc_attribute_name(attr);
+	return get_attribute_name(attr);
+}
+
 const char *get_attribute_name(int attr)
 {
 	const char *res = "Unknown";
@@ -714,17 +3948,58 @@ const char *get_attribute_name(int attr)
 		case 0x0033:
 			res = "PortInfoExtended";
 			break;
+		case 0xFF90:
+			res = "MLNXExtendedPortInfo";
+			break;
 	};
 
 	return res;
 }
 
+/*
+ * Workers go round robin on the endpoints. An endpoint without lids of its
+ * own gets an even share of the command line lids, the lids of an endpoint
+ * are split evenly between its workers, the last one takes the remainder.
+ */
+static void place_workers(struct mad_worker *workers, uint32_t *lids, int n_lids)
+{
+	struct endpoint *ep;
+	uint32_t *ep_lids;
+	int i, e, n, k, shared = 0, n_shared = 0, ep_n_lids, per_worker;
+
+	for (e = 0; e < g_n_endpoints; ++e)
+		if (!g_endpoints[e].lids)
+			shared++;
+
+	for (e = 0; e < g_n_endpoints; ++e) {
+		ep = &g_endpoints[e];
+		if (ep->lids) {
+			ep_lids = ep->lids;
+			ep_n_lids = ep->n_lids;
+		} else {
+			ep_lids = lids + n_shared * (n_lids / shared);
+			ep_n_lids = ++n_shared < shared ? n_lids / shared : n_lids - (shared - 1) * (n_lids / shared);
+		}
+
+		n = (g_nworkers - e + g_n_endpoints - 1) / g_n_endpoints;
+		per_worker = ep_n_lids / n;
+		for (i = e, k = 0; i < g_nworkers; i += g_n_endpoints, ++k) {
+			if (ep->ca[0])
+				strcpy(workers[i].ibd_ca, ep->ca);
+			workers[i].ibd_ca_port = ep->port;
+			workers[i].endpoint = e;
+			set_lid_routet_targets(&workers[i], ep_lids + k * per_worker,
+					       k < n - 1 ? per_worker : ep_n_lids - (n - 1) * per_worker);
+		}
+	}
+}
+
 void *thread_worker(void *ctx)
 {
 	struct mad_worker *pw = (struct mad_worker *)ctx;
 	int ret;
 
-	init_ib_device(pw, ibd_ca, ibd_ca_port);
+	init_ib_device(pw, pw->ibd_ca[0] ? pw->ibd_ca : NULL, pw->ibd_ca_port);
 
 	ret = pthread_barrier_wait(&g_barrier);
 	process_mads(pw);
@@ -738,6 +4013,7 @@ int main(int argc, char *argv[])
 	pthread_t threads[MAX_WORKERS] = {};
 	uint32_t lids[MAX_LIDS] = {};
 	int i, ret, n_lids = 0;
+	FILE *report = stdout, *json = NULL, *csv = NULL;
 
 	const struct ibdiag_opt opts[] = {
 		{"string", 's', 0, NULL, ""},
@@ -748,6 +4024,28 @@ int main(int argc, char *argv[])
 		{"umad_retries", 'r', 1, "<retries>", ""},
 		{"umad_timeout", 'T', 1, "<timeout ms>", ""},
 		{"n_workers", 'p', 1, "<n workers>", ""},
+		{"trace", opt_trace, 1, "<prefix>", "record every mad to <prefix>.<worker>.trace"},
+		{"trace_size", opt_trace_size, 1, "<records>", "trace ring size per worker, default: 1M records"},
+		{"sim", opt_sim, 1, "<config>", "use simulated SMA instead of umad, config: service=exp:<us>,wire=<us>,capacity=<n>,queue=<n>,drop=<p>,lost=<p>,late=<p>,dup=<p>,dead=<lid>:..,unsup=<attr>:..,foreign=<lid>:..,payload=<file>,nodes=<n>,seed=<n>"},
+		{"verify", opt_verify, 0, NULL, "compare every ok responce to the data snapshot taken at start"},
+		{"sw_timeout", opt_sw_timeout, 1, "<ms>", "reclaim in-flight mad slot after this time, default: umad timeout * (retries + 1) + 1s"},
+		{"json", opt_json, 1, "<file>", "write configuration, counters and latency distributions as JSON, - for stdout"},
+		{"csv", opt_csv, 1, "<file>", "write per target counters as CSV, - for stdout"},
+		{"warmup", opt_warmup, 1, "<sec>", "run this long before counting, warmup mads are not in the results"},
+		{"warmup_mads", opt_warmup_mads, 1, "<n>", "count only after every worker completed <n> warmup mads"},
+		{"count", opt_count, 1, "<n>", "send exactly <n> mads (sequences with --scenario, sweeps with --perfmgt) per target, stop when they are completed, -t is then a time limit"},
+		{"scenario", opt_scenario, 1, "<name>", "every target runs a sequence of dependent mads: set_confirm - Get <attr>, Set it, Get to confirm; discover - NodeInfo, PortInfo of every port"},
+		{"perfmgt", opt_perfmgt, 1, "<ports>", "sweep PortCounters (attr 0x12) or PortCountersExtended (0x1d) of these ports of every lid, report counter deltas between sweeps"},
+		{"sa", opt_sa, 1, "<sm lid>[:<source lid>]", "query the SA of the SM at <sm lid> about every lid: NodeRecord (attr 0x11), PortInfoRecord (0x12, mod is the port) or PathRecord (0x35) from <source lid>, default: the SM lid"},
+		{"sa_table", opt_sa_table, 0, NULL, "SubnAdmGetTable instead of Get: every NodeRecord of the subnet, every PortInfoRecord of a lid, all PathRecords; the kernel reassembles the RMPP responce"},
+		{"cc", opt_cc, 0, NULL, "Congestion Control class, <attr> is a mix of attributes sent round robin: <attr>[:set],.. by number or name (info, key_info, log, sw_setting, sw_port_setting, ca_setting, table, timestamp), a Set writes back what the last Get read"},
+		{"cc_key", opt_cc_key, 1, "<key>", "CC_Key of CC mads, default: 0"},
+		{"classes", opt_classes, 1, "<class>,..", "every worker sends a mix of classes round robin, one agent each: smi, dr (to the local port), pm (PortCounters of port <mod>), sa (NodeRecord, needs --sa), cc (CongestionInfo)"},
+		{"endpoint", opt_endpoint, 1, "<ca>:<port>[@<lids>]", "send from this local port, repeat for more ports, workers go round robin on them; without own lids an endpoint gets a share of the command line lids"},
+		{"quarantine", opt_quarantine, 1, "<fail %>[:<probe ms>]", "quarantine a target when this share of its last 16 mads timed out, failed or was BUSY, it then gets one probe mad every <probe ms> (default 1000) until one is answered"},
+		{"tool_retries", opt_tool_retries, 1, "<retries>", "retry timed out mads in the tool instead of the kernel (umad retries become 0), up to 15"},
+		{"retry_backoff", opt_retry_backoff, 1, "<ms>[:<max ms>]", "wait before a tool retry, doubled for every next retry of a mad, default: 0"},
+		{"metrics", opt_metrics, 1, "<[addr:]port|path>", "serve live counters in Prometheus format on loopback port or unix socket"},
 		{}
 	};
 	char usage_args[] = "<dlid|dr_path> <attr> [mod]";
@@ -757,7 +4055,20 @@ int main(int argc, char *argv[])
 		"-D 0,1,2 0x15 2	# PORT INFO, port 2",
 		" -- LID routed examples:",
 		"3 0x15 2	# PORT INFO, lid 3 port 2",
+		"1-100 0xff90 1	# MLNX EXTENDED PORT INFO of port 1, devices which don't support it are excluded",
 		"0xa0 0x11	# NODE INFO, lid 0xa0",
+		" -- PerfMgt examples:",
+		"--perfmgt 1-36 1-100 0x12	# PortCounters of ports 1-36 of lids 1-100",
+		" -- SA examples:",
+		"--sa 1:5 1-100 0x35	# PathRecords from lid 5 to lids 1-100, SM at lid 1",
+		" -- CC examples:",
+		"--cc 1-100 log,log,info,sw_setting:set	# CongestionLog polling with concurrent setting writes",
+		" -- Class mix examples:",
+		"--classes smi,smi,pm,sa --sa 1 1-100 0x15 1	# PortInfo, PortCounters and NodeRecords on one port",
+		" -- Unhealthy targets:",
+		"--quarantine 50:200 1-100 0x15 1	# dead or overloaded switches get a probe every 200 ms instead of their queue depth",
+		" -- Multi port examples:",
+		"--endpoint mlx5_0:1 --endpoint mlx5_1:1 -p 4 1-200 0x15 1	# 2 workers on each HCA, 100 lids per HCA",
 		NULL
 	};
 
@@ -766,10 +4077,45 @@ int main(int argc, char *argv[])
 	ibdiag_process_opts(argc, argv, &w, "GKs", opts, process_opt,
 			    usage_args, usage_examples);
 
+	/* at least one worker per endpoint, default: the -C/-P port */
+	if (!g_n_endpoints) {
+		if (ibd_ca)
+			strncpy(g_endpoints[0].ca, ibd_ca, UMAD_CA_NAME_LEN - 1);
+		g_endpoints[0].port = ibd_ca_port;
+		g_n_endpoints = 1;
+	} else if (g_nworkers < g_n_endpoints)
+		g_nworkers = g_n_endpoints;
 	if (g_nworkers < 1 || g_nworkers > MAX_WORKERS)
 		IBPANIC("number of workers is wrong: %d", g_nworkers);
+	if (g_n_pm_ports) {
+		if (w.mgmt_class == IB_SMI_DIRECT_CLASS)
+			IBPANIC("perfmgt mads are lid routed, -D doesn't apply");
+		w.mgmt_class = IB_PERFORMANCE_CLASS;
+	}
+	if (g_sa_table && !g_sa_lid)
+		IBPANIC("--sa_table needs --sa");
+	if (g_cc) {
+		if (w.mgmt_class != IB_SMI_CLASS || g_sa_lid)
+			IBPANIC("CC mads are lid routed, -D, --perfmgt and --sa don't apply");
+		w.mgmt_class = IB_CC_CLASS;
+	}
+	if (g_classes) {
+		if (w.mgmt_class != IB_SMI_CLASS || g_sa_table)
+			IBPANIC("--classes sets the classes, -D, --perfmgt, --cc and --sa_table don't apply");
+	} else if (g_sa_lid) {
+		if (w.mgmt_class != IB_SMI_CLASS)
+			IBPANIC("SA queries are lid routed, -D and --perfmgt don't apply");
+		w.mgmt_class = IB_SA_CLASS;
+	}
 	check_worker(&w);
 
+	/* the tool retries instead of the kernel, every attempt is visible */
+	if (w.tool_retries)
+		w.ibd_retries = 0;
+
+	if (!w.sw_timeout_ms)
+		w.sw_timeout_ms = w.ibd_timeout * (w.ibd_retries + 1) + SW_TIMEOUT_SLACK_MS;
+
 	argc -= optind;
 	argv += optind;
 
@@ -779,41 +4125,87 @@ int main(int argc, char *argv[])
 	if (w.mgmt_class == IB_SMI_DIRECT_CLASS &&
 	    str2DRPath(strdupa(argv[0]), &path) < 0)
 		IBPANIC("bad path str '%s'", argv[0]);
+	for (i = 0; i < g_n_endpoints; ++i)
+		if (g_endpoints[i].lids && w.mgmt_class == IB_SMI_DIRECT_CLASS)
+			IBPANIC("endpoint lids are lid routed, -D doesn't apply");
 
-	if (w.mgmt_class == IB_SMI_CLASS) {
-		n_lids = parseLIDs(strdupa(argv[0]),lids, 1024);
+	if (w.mgmt_class != IB_SMI_DIRECT_CLASS) {
+		n_lids = parseLIDs(strdupa(argv[0]),lids, MAX_LIDS);
 		if (n_lids <= 0)
 			IBPANIC("bad lids list str '%s'", argv[0]);
 	}
 
-	w.smp_attr = strtoul(argv[1], NULL, 0);
+	if (w.mgmt_class == IB_CC_CLASS) {
+		if (parse_cc_mix(argv[1]))
+			IBPANIC("bad CC mix '%s'", argv[1]);
+		w.smp_attr = g_cc_mix[0].attr;
+	} else
+		w.smp_attr = strtoul(argv[1], NULL, 0);
 	if (argc > 2)
 		w.smp_mod = strtoul(argv[2], NULL, 0);
+	if (g_classes && parse_class_mix(strdupa(g_classes), w.smp_attr, w.smp_mod))
+		IBPANIC("bad class mix '%s'", g_classes);
+	for (i = 0; i < g_n_class_mix; ++i)
+		if (g_class_mix[i].mgmt_class == IB_SA_CLASS && !g_sa_lid)
+			IBPANIC("sa in the class mix needs --sa");
+	w.vendor_probe = w.smp_attr >= SMP_ATTR_VENDOR_FIRST &&
+		(w.mgmt_class == IB_SMI_CLASS || w.mgmt_class == IB_SMI_DIRECT_CLASS);
+	if (w.mgmt_class == IB_PERFORMANCE_CLASS && w.smp_attr != PM_ATTR_PORT_COUNTERS &&
+	    w.smp_attr != PM_ATTR_PORT_COUNTERS_EXT)
+		IBPANIC("perfmgt attr must be PortCounters (0x12) or PortCountersExtended (0x1d): 0x%x", w.smp_attr);
+	if (w.mgmt_class == IB_SA_CLASS && !strcmp(sa_attribute_name(w.smp_attr), "Unknown"))
+		IBPANIC("SA attr must be NodeRecord (0x11), PortInfoRecord (0x12) or PathRecord (0x35): 0x%x", w.smp_attr);
+
+	if (g_transport->init() < 0)
+		IBPANIC("can't init %s transport", g_transport->name);
+
+	/* open outputs before the run, so a bad path doesn't waste it */
+	if (g_json_path && g_csv_path && !strcmp(g_json_path, "-") && !strcmp(g_csv_path, "-"))
+		IBPANIC("only one of --json and --csv can go to stdout");
+	if (g_json_path) {
+		json = strcmp(g_json_path, "-") ? fopen(g_json_path, "w") : stdout;
+		if (!json)
+			IBPANIC("can't open %s: %m", g_json_path);
+	}
+	if (g_csv_path) {
+		csv = strcmp(g_csv_path, "-") ? fopen(g_csv_path, "w") : stdout;
+		if (!csv)
+			IBPANIC("can't open %s: %m", g_csv_path);
+	}
+	if (json == stdout || csv == stdout)
+		report = stderr;
 
-	if (umad_init() < 0)
-		IBPANIC("can't init UMAD library");
+	report_worker_params(&w, report);
 
+	for (i = 0; i < MAX_WORKERS; ++i) {
+		memcpy(&workers[i], &w, sizeof w);
+		workers[i].id = i;
+	}
 
-	report_worker_params(&w, stdout);
+	if (g_metrics_addr) {
+		for (i = 0; i < g_nworkers; ++i) {
+			workers[i].snap = (struct mad_snapshot *)calloc(1, sizeof(*workers[i].snap));
+			if (!workers[i].snap)
+				IBPANIC("can't allocate metrics snapshot");
+		}
+		ret = metrics_server_start(g_metrics_addr, render_metrics, workers);
+		if (ret)
+			IBPANIC("can't serve metrics on %s: %s", g_metrics_addr, strerror(-ret));
+	}
 
-	for (i = 0; i < MAX_WORKERS; ++i)
-		memcpy(&workers[i], &w, sizeof w);
+	place_workers(workers, lids, n_lids);
 
 	if (g_nworkers == 1) {
-		init_ib_device(&workers[0], ibd_ca, ibd_ca_port);
-		set_lid_routet_targets(&workers[0], (uint32_t *)lids, n_lids);
+		init_ib_device(&workers[0], workers[0].ibd_ca[0] ? workers[0].ibd_ca : NULL, workers[0].ibd_ca_port);
 		process_mads(&workers[0]);
 	} else {
 		pthread_barrierattr_t attr;
-		int lids_per_worker = n_lids / g_nworkers;
-		int lids_last_worker = lids_per_worker + n_lids % g_nworkers;
 
 		ret = pthread_barrier_init(&g_barrier, &attr, g_nworkers);
 		if (ret)
 			IBPANIC("can't create pthread barrier");
 
 		for (i = 0; i < g_nworkers; ++i) {
-			set_lid_routet_targets(&workers[i], (uint32_t *)lids + i * lids_per_worker, i != (g_nworkers - 1) ?  lids_per_worker : lids_last_worker);
 			if(pthread_create(&threads[i], NULL, thread_worker, &workers[i])) {
 				IBPANIC("failed to create a thread: %d %m", i);
 			}
@@ -823,8 +4215,21 @@ int main(int argc, char *argv[])
 			pthread_join(threads[i], NULL);
 	}
 
-	print_statistics(workers, g_nworkers, stdout);
-	putchar('\n');
+	metrics_server_stop();
+
+	print_statistics(workers, g_nworkers, report);
+	fputc('\n', report);
+
+	if (json) {
+		print_json(workers, g_nworkers, json);
+		if (json != stdout)
+			fclose(json);
+	}
+	if (csv) {
+		print_csv(workers, g_nworkers, csv);
+		if (csv != stdout)
+			fclose(csv);
+	}
 
 	for (i = 0; i < g_nworkers; ++i)
 		finalize_mad_worker(&workers[i]);
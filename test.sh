@@ -5,6 +5,15 @@ LID=${LID:="10,8,16,4,11,3,15,9"}
 #ATTR=${ATTR:="0x10 0x11 0x12 0x14 0x15 0x16 0x17 0x18 0x19 0x1A 0x1B 0x33"}
 #ATTR=${ATTR:="0x19"}
 ATTR=${ATTR:="0x15"}
+# SIM="service=exp:20,capacity=2" ./test.sh - run against simulated SMA, no fabric needed
+SIM=${SIM:=""}
+# keep out*.json of a known good run as baseline, then after an upgrade:
+# ./smp_compare -b base1.json -b base2.json -b base3.json out1.json out2.json out3.json
+if [ -n "$SIM" ]; then
+	DEV="--sim $SIM"
+else
+	DEV="-C mlx5_3"
+fi
 
 echo $LID
 
@@ -14,9 +23,9 @@ for method in {1..1}; do
 		echo "Attr: $attr"
 		for n in {8..8}; do
 			echo "n: $n"
-			./smp_mad_stress -C mlx5_3  -m $method -N 128 -n $n  -t 20 -L $LID $attr 1  1 > ./out1.log &2>1 &
-			./smp_mad_stress -C mlx5_3  -m $method -N 128 -n $n  -t 20 -L $LID $attr 1  1 > ./out2.log &2>1 &
-			./smp_mad_stress -C mlx5_3  -m $method -N 128 -n $n  -t 20 -L $LID $attr 1  1 > ./out3.log &2>1
+			./smp_mad_stress $DEV  -m $method -N 128 -n $n  -t 20 -L $LID --json ./out1.json $attr 1  1 > ./out1.log &2>1 &
+			./smp_mad_stress $DEV  -m $method -N 128 -n $n  -t 20 -L $LID --json ./out2.json $attr 1  1 > ./out2.log &2>1 &
+			./smp_mad_stress $DEV  -m $method -N 128 -n $n  -t 20 -L $LID --json ./out3.json $attr 1  1 > ./out3.log &2>1
 		done
 	done
 done